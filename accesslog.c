@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include "accesslog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define LINE_MAX_LEN 2048 // a formatted record, every string character escaped included
+
+/**
+ * one thread's ring. The producer owns "head" and its cache line, the
+ * writer owns "tail" and its own; each only reads the other's index.
+ */
+struct accesslog_ring {
+    atomic_ulong head;          // next record to fill
+    unsigned long tail_seen;    // "tail" as last read, it only grows
+    atomic_ulong dropped;
+    atomic_ulong tail __attribute__((aligned(64))); // next record to write
+    struct accesslog_ring *next;
+    accesslog_record records[ACCESSLOG_RING] __attribute__((aligned(64)));
+};
+
+static int log_fd = -1;
+static char *log_path;
+static pthread_t writer;
+static atomic_int running;
+static atomic_int stopping;
+static atomic_int reopen_requested;
+static atomic_ulong written_total;
+
+// every thread's ring, rings are only added until accesslog_shutdown
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct accesslog_ring *rings_head;
+static __thread struct accesslog_ring *self;
+
+static struct accesslog_ring *thread_ring(void) {
+    if (self == NULL) {
+        self = (struct accesslog_ring *)aligned_alloc(64, sizeof(struct accesslog_ring));
+        if (self == NULL) {
+            return NULL;
+        }
+        memset(self, 0, sizeof(*self));
+        pthread_mutex_lock(&rings_lock);
+        self->next = rings_head;
+        rings_head = self;
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return self;
+}
+
+static int open_log(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        return STDERR_FILENO;
+    }
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("error: access log");
+    }
+    return fd;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: access log write");
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// copies s[0..max) up to its NUL as the inside of a JSON string
+static size_t put_string(char *out, const char *s, size_t max) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+    for (size_t i = 0; i < max && s[i] != '\0'; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch == '"' || ch == '\\') {
+            out[len++] = '\\';
+            out[len++] = ch;
+        } else if (ch < 0x20 || ch == 0x7f) {
+            memcpy(out + len, "\\u00", 4);
+            out[len + 4] = hex[ch >> 4];
+            out[len + 5] = hex[ch & 15];
+            len += 6;
+        } else {
+            out[len++] = ch;
+        }
+    }
+    return len;
+}
+
+// one JSON line for "r" into out[0..LINE_MAX_LEN), returns its length
+static size_t format_record(char *out, const accesslog_record *r) {
+    // the date part changes once a second, it is rendered once per second
+    static time_t rendered_sec = -1;
+    static char date[32];
+    time_t sec = (time_t)(r->time_ms / 1000);
+    if (sec != rendered_sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        rendered_sec = sec;
+    }
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &r->client, client, sizeof(client));
+
+    size_t len = (size_t)sprintf(out, "{\"time\":\"%s.%03dZ\",\"client\":\"%s\",\"method\":\"",
+                                 date, (int)(r->time_ms % 1000), client);
+    len += put_string(out + len, r->method, sizeof(r->method));
+    memcpy(out + len, "\",\"host\":\"", 10);
+    len += 10;
+    len += put_string(out + len, r->host, sizeof(r->host));
+    memcpy(out + len, "\",\"path\":\"", 10);
+    len += 10;
+    len += put_string(out + len, r->path, sizeof(r->path));
+    len += sprintf(out + len, "\",\"status\":%d,\"bytes\":%llu,\"upstream_us\":%lld,\"total_us\":%lld}\n",
+                   r->status, r->bytes, r->upstream_us, r->total_us);
+    return len;
+}
+
+/**
+ * formats what every ring holds into batch[*len..) and writes whenever
+ * the batch fills up. returns the number of records taken
+ */
+static unsigned long drain(char *batch, size_t *len) {
+    pthread_mutex_lock(&rings_lock);
+    struct accesslog_ring *ring = rings_head;
+    pthread_mutex_unlock(&rings_lock);
+
+    unsigned long taken = 0;
+    for (; ring != NULL; ring = ring->next) {
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            if (*len + LINE_MAX_LEN > ACCESSLOG_BATCH) {
+                write_all(batch, *len);
+                *len = 0;
+            }
+            *len += format_record(batch + *len, &ring->records[tail & (ACCESSLOG_RING - 1)]);
+            tail++;
+            // the slot may be filled again once the writer is done with it
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            taken++;
+        }
+    }
+    return taken;
+}
+
+static void *run_writer(void *arg) {
+    (void)arg;
+    char *batch = (char *)malloc(ACCESSLOG_BATCH);
+    if (batch == NULL) {
+        perror("error: malloc");
+        return NULL;
+    }
+    struct timespec pause = {0, ACCESSLOG_FLUSH_MS * 1000000L};
+    while (1) {
+        // read first: whatever was committed before the stop is drained below
+        int last = atomic_load(&stopping);
+        if (atomic_exchange(&reopen_requested, 0) && log_fd != STDERR_FILENO) {
+            int fd = open_log(log_path);
+            if (fd >= 0) {
+                close(log_fd);
+                log_fd = fd;
+            }
+        }
+        size_t len = 0;
+        unsigned long taken = drain(batch, &len);
+        if (len > 0) {
+            write_all(batch, len);
+        }
+        atomic_fetch_add_explicit(&written_total, taken, memory_order_relaxed);
+        if (last) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    free(batch);
+    return NULL;
+}
+
+int accesslog_start(const char *path) {
+    log_path = strdup(path);
+    if (log_path == NULL) {
+        perror("error: malloc");
+        return -1;
+    }
+    log_fd = open_log(path);
+    if (log_fd < 0) {
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, run_writer, NULL) != 0) {
+        perror("error: access log thread");
+        atomic_store(&running, 0);
+        if (log_fd != STDERR_FILENO) {
+            close(log_fd);
+        }
+        log_fd = -1;
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int accesslog_enabled(void) {
+    return atomic_load_explicit(&running, memory_order_relaxed);
+}
+
+accesslog_record *accesslog_reserve(void) {
+    struct accesslog_ring *r;
+    if (!atomic_load_explicit(&running, memory_order_relaxed) || (r = thread_ring()) == NULL) {
+        return NULL;
+    }
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - r->tail_seen == ACCESSLOG_RING) {
+        // full as far as we knew, look at the writer's line only now
+        r->tail_seen = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->tail_seen == ACCESSLOG_RING) {
+            // single writer: a relaxed load and store, no locked instruction
+            atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return &r->records[head & (ACCESSLOG_RING - 1)];
+}
+
+void accesslog_commit(accesslog_record *rec) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); // vDSO, no syscall
+    rec->time_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    unsigned long head = atomic_load_explicit(&self->head, memory_order_relaxed);
+    atomic_store_explicit(&self->head, head + 1, memory_order_release);
+}
+
+void accesslog_reopen(void) {
+    atomic_store(&reopen_requested, 1);
+}
+
+void accesslog_get_stats(accesslog_stats *st) {
+    st->written = atomic_load_explicit(&written_total, memory_order_relaxed);
+    st->dropped = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (struct accesslog_ring *r = rings_head; r != NULL; r = r->next) {
+        st->dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+void accesslog_shutdown(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    atomic_store(&running, 0);
+    if (log_fd != STDERR_FILENO) {
+        close(log_fd);
+    }
+    log_fd = -1;
+    free(log_path);
+    log_path = NULL;
+    pthread_mutex_lock(&rings_lock);
+    while (rings_head != NULL) {
+        struct accesslog_ring *next = rings_head->next;
+        free(rings_head);
+        rings_head = next;
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
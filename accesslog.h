@@ -0,0 +1,95 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+/**
+ * accesslog.h
+ *
+ * Access log, one JSON object per line for every request answered:
+ * time, client address, method, host, path, status, bytes sent, and
+ * the time spent on the origin and in total.
+ *
+ * Every thread that logs gets a single-producer single-consumer ring
+ * of fixed-size records. A request fills its record in place and
+ * publishes it with one release store: no lock, no syscall, no
+ * allocation once the ring exists. A writer thread of its own drains
+ * all rings every ACCESSLOG_FLUSH_MS, formats the records and writes
+ * them in ACCESSLOG_BATCH blocks. When a ring is full because the
+ * writer fell behind, the record is dropped and counted instead of
+ * making the request wait.
+ */
+
+#define ACCESSLOG_RING 4096         // records per thread, a power of two
+#define ACCESSLOG_BATCH (256 * 1024) // bytes formatted before a write
+#define ACCESSLOG_FLUSH_MS 50       // how often the writer looks at the rings
+#define ACCESSLOG_METHOD_LEN 8      // longer fields are cut short
+#define ACCESSLOG_HOST_LEN 64
+#define ACCESSLOG_PATH_LEN 144
+
+/**
+ * one request. Strings are NUL-terminated, or cut at their length.
+ */
+typedef struct accesslog_record {
+    long long time_ms;          // wall clock when the request was answered
+    struct in_addr client;
+    int status;                 // 0 if the client went away before a status was known
+    unsigned long long bytes;   // sent to the client
+    long long upstream_us;      // request sent to last response byte, -1 if the origin was not asked
+    long long total_us;         // first request byte to response sent
+    char method[ACCESSLOG_METHOD_LEN];
+    char host[ACCESSLOG_HOST_LEN];
+    char path[ACCESSLOG_PATH_LEN];
+} accesslog_record;
+
+typedef struct accesslog_stats {
+    unsigned long written;      // records formatted and written
+    unsigned long dropped;      // records lost to a full ring
+} accesslog_stats;
+
+/**
+ * accesslog_start opens "path" for appending ("-" is stderr) and
+ * starts the writer thread.
+ * returns 0 on success, -1 if the file could not be opened.
+ */
+int accesslog_start(const char *path);
+
+/**
+ * accesslog_enabled returns 1 once accesslog_start succeeded.
+ */
+int accesslog_enabled(void);
+
+/**
+ * accesslog_reserve returns the calling thread's next free record,
+ * to be filled and then published with accesslog_commit. returns NULL
+ * if the log is off or the ring is full (the record is counted as
+ * dropped).
+ */
+accesslog_record *accesslog_reserve(void);
+
+/**
+ * accesslog_commit hands the record accesslog_reserve returned to the
+ * writer, stamping its time.
+ */
+void accesslog_commit(accesslog_record *r);
+
+/**
+ * accesslog_reopen makes the writer reopen the file before its next
+ * write, for log rotation. Safe in a signal handler.
+ */
+void accesslog_reopen(void);
+
+/**
+ * accesslog_get_stats adds up the counters of all threads.
+ */
+void accesslog_get_stats(accesslog_stats *st);
+
+/**
+ * accesslog_shutdown writes what the rings still hold, stops the
+ * writer and frees the rings. Nothing may log anymore.
+ */
+void accesslog_shutdown(void);
+
+#endif
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""
+compare_micro.py
+
+Compares two micro_bench JSON results and flags regressions. Every
+value is a cost (ns per operation), so higher is worse. A benchmark
+counts as changed only if its median moved by more than the threshold
+and the ranges of the two runs do not overlap, which keeps one noisy
+run from being reported.
+
+run: bench/compare_micro.py base.json new.json [threshold-percent (default 10)]
+exit status: 0 without regressions, 1 with, 2 on bad input
+"""
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {b["name"]: b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        print(__doc__.strip().split("\n\n")[-1], file=sys.stderr)
+        return 2
+    try:
+        base, new = load(sys.argv[1]), load(sys.argv[2])
+    except (OSError, ValueError, KeyError) as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 2
+    threshold = float(sys.argv[3]) / 100 if len(sys.argv) == 4 else 0.10
+
+    regressions = 0
+    print("%-40s %12s %12s %8s" % ("benchmark", "base", "new", "change"))
+    for name, b in base.items():
+        n = new.get(name)
+        if n is None:
+            print("%-40s %12.1f %12s" % (name, b["median"], "missing"))
+            continue
+        change = n["median"] / b["median"] - 1 if b["median"] > 0 else 0.0
+        apart = n["min"] > b["max"] or n["max"] < b["min"]
+        verdict = ""
+        if apart and change > threshold:
+            verdict = "REGRESSION"
+            regressions += 1
+        elif apart and change < -threshold:
+            verdict = "faster"
+        print("%-40s %12.1f %12.1f %+7.1f%% %s %s"
+              % (name, b["median"], n["median"], change * 100, b["unit"], verdict))
+    for name in new:
+        if name not in base:
+            print("%-40s %12s %12.1f" % (name, "new", new[name]["median"]))
+
+    print("%d regression%s beyond %.0f%%" % (regressions, "" if regressions == 1 else "s", threshold * 100))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
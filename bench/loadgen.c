@@ -0,0 +1,473 @@
+/**
+ * loadgen.c
+ *
+ * An open-loop HTTP load generator for the proxy. Requests are
+ * scheduled at a fixed rate whether or not earlier ones have been
+ * answered, so a stalled proxy shows up as latency instead of as a
+ * lower request rate.
+ *
+ * Every request has an intended send time on that schedule. The
+ * corrected latency runs from the intended time to the last response
+ * byte and includes the time a request waited for a free connection
+ * (coordinated omission correction); the raw latency runs from the
+ * moment a connection took the request, connecting included.
+ *
+ * Each thread runs its own epoll loop and connection set and takes an
+ * equal share of the rate. A request that meets a keep-alive connection
+ * the proxy has just closed is sent again on another one, as browsers
+ * do, and keeps its intended time.
+ *
+ *   -x host:port   the proxy (default 127.0.0.1:8080)
+ *   -u url         absolute URL to request (default
+ *                  http://127.0.0.1:18080/?size=1024)
+ *   -r rate        requests per second over all threads (default 1000)
+ *   -d secs        duration of the schedule (default 10)
+ *   -t threads     (default 2)
+ *   -c conns       most open connections per thread (default 64)
+ *   -n             one connection per request instead of keep-alive
+ *
+ * build: gcc -O2 -I. -o loadgen bench/loadgen.c http.c -lpthread
+ * run:   ./loadgen -x 127.0.0.1:8080 -u 'http://127.0.0.1:18080/?size=1024' -r 2000 -d 10
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "http.h"
+
+#define RECV_LEN (64 * 1024)
+#define MAX_EVENTS 256
+#define DRAIN_SECS 5 // how long to wait for answers after the schedule ends
+
+enum conn_state {
+    CONN_FREE,
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_READING,
+    CONN_IDLE
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    long intended_ns;       // when the request should have gone out
+    long sent_ns;           // when a connection took it
+    size_t written;
+    int reused;             // an earlier response came on this connection
+    http_framing framing;
+};
+
+struct samples {
+    long *v;
+    size_t len;
+    size_t cap;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct conn *conns;
+    int num_conns;          // slots in use, FREE ones included
+    int open_conns;
+    long *retry;            // intended times of requests to send again
+    int num_retry;
+    struct samples corrected;
+    struct samples raw;
+    long sent;
+    long completed;
+    long non_2xx;
+    long connect_errors;
+    long io_errors;
+    long retried;
+    long unsent;            // still waiting for a connection when the drain ended
+    long bytes;
+};
+
+static struct sockaddr_in proxy_addr;
+static char request[2048];
+static size_t request_len;
+static double rate = 1000;
+static int duration_secs = 10;
+static int num_threads = 2;
+static int max_conns = 64;
+static int close_each = 0;
+static long start_ns;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void add_sample(struct samples *s, long ns) {
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(long));
+        if (s->v == NULL) {
+            perror("error: realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->v[s->len++] = ns;
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->state = CONN_FREE;
+    w->open_conns--;
+}
+
+// writes what is left of the request, 0 on success or would-block
+static int conn_send(struct conn *c) {
+    while (c->written < request_len) {
+        ssize_t n = send(c->fd, request + c->written, request_len - c->written, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->written += n;
+    }
+    c->state = CONN_READING;
+    return 0;
+}
+
+static void conn_start(struct conn *c, long intended) {
+    c->intended_ns = intended;
+    c->sent_ns = now_ns();
+    c->written = 0;
+    c->state = CONN_SENDING;
+    http_framing_init(&c->framing, 0);
+}
+
+static struct conn *conn_open(struct worker *w, int epfd) {
+    struct conn *c = NULL;
+    for (int i = 0; i < w->num_conns; i++) {
+        if (w->conns[i].state == CONN_FREE) {
+            c = &w->conns[i];
+            break;
+        }
+    }
+    if (c == NULL) {
+        c = &w->conns[w->num_conns++];
+    }
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        w->connect_errors++;
+        return NULL;
+    }
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c->fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        w->connect_errors++;
+        return NULL;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = CONN_CONNECTING;
+    c->reused = 0;
+    w->open_conns++;
+    return c;
+}
+
+// a response ended (or the connection failed, "ok" = 0)
+static void conn_done(struct worker *w, struct conn *c, int ok) {
+    if (!ok) {
+        w->io_errors++;
+        conn_close(w, c);
+        return;
+    }
+    long now = now_ns();
+    add_sample(&w->corrected, now - c->intended_ns);
+    add_sample(&w->raw, now - c->sent_ns);
+    w->completed++;
+    if (c->framing.status < 200 || c->framing.status > 299) {
+        w->non_2xx++;
+    }
+    if (close_each || !c->framing.keep_alive) {
+        conn_close(w, c);
+    } else {
+        c->state = CONN_IDLE;
+        c->reused = 1;
+    }
+}
+
+// the connection ended before the response did, unless "ok"
+static void conn_lost(struct worker *w, struct conn *c, int ok) {
+    if (!ok && c->reused && c->framing.body.state == HF_HEADER && c->framing.line_len == 0) {
+        // the server closed a keep-alive connection as the request went
+        // out; like a browser, send it again on another one
+        w->retry[w->num_retry++] = c->intended_ns;
+        w->retried++;
+        conn_close(w, c);
+        return;
+    }
+    conn_done(w, c, ok);
+}
+
+static void conn_read(struct worker *w, struct conn *c, char *buf) {
+    while (1) {
+        ssize_t n = recv(c->fd, buf, RECV_LEN, 0);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                conn_lost(w, c, 0);
+            }
+            return;
+        }
+        if (n == 0) {
+            if (c->state == CONN_IDLE) {
+                conn_close(w, c);
+            } else {
+                conn_lost(w, c, c->framing.body.state == HF_BODY_EOF);
+            }
+            return;
+        }
+        if (c->state != CONN_READING) {
+            conn_done(w, c, 0); // bytes nobody asked for
+            return;
+        }
+        w->bytes += n;
+        size_t off = 0;
+        while (off < (size_t)n && c->framing.body.state != HF_DONE) {
+            long long pass = http_framing_passthrough(&c->framing);
+            if (pass > 0) {
+                size_t skip = (size_t)n - off < (unsigned long long)pass ? (size_t)n - off : (size_t)pass;
+                http_framing_skip(&c->framing, skip);
+                off += skip;
+            } else {
+                off += http_framing_feed(&c->framing, buf + off, n - off);
+            }
+        }
+        if (c->framing.body.state == HF_DONE) {
+            conn_done(w, c, off == (size_t)n);
+            return;
+        }
+    }
+}
+
+// intended send time of this thread's request number "k"
+static long intended(const struct worker *w, long k) {
+    double per_thread = rate / num_threads;
+    return start_ns + (long)((k + (double)w->index / num_threads) * 1e9 / per_thread);
+}
+
+// intended time of the next request waiting for a connection, retries first
+static long take_request(struct worker *w, long *next_sent) {
+    w->sent++;
+    if (w->num_retry > 0) {
+        return w->retry[--w->num_retry];
+    }
+    return intended(w, (*next_sent)++);
+}
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    char *buf = malloc(RECV_LEN);
+    struct epoll_event events[MAX_EVENTS];
+    long end_ns = start_ns + duration_secs * 1000000000L;
+    long due = 0;           // requests [next_sent, due) are waiting for a connection
+    long next_sent = 0;
+
+    while (1) {
+        long now = now_ns();
+        while (intended(w, due) <= now && intended(w, due) < end_ns) {
+            due++;
+        }
+        // hand waiting requests to idle connections, then to new ones
+        for (int i = 0; i < w->num_conns && (next_sent < due || w->num_retry > 0); i++) {
+            struct conn *c = &w->conns[i];
+            if (c->state == CONN_IDLE) {
+                conn_start(c, take_request(w, &next_sent));
+                if (conn_send(c) != 0) {
+                    conn_lost(w, c, 0);
+                }
+            }
+        }
+        while ((next_sent < due || w->num_retry > 0) && w->open_conns < max_conns) {
+            struct conn *c = conn_open(w, epfd);
+            if (c == NULL) {
+                break;
+            }
+            conn_start(c, take_request(w, &next_sent));
+            c->state = CONN_CONNECTING;
+        }
+        long next = intended(w, due);
+        if (now >= end_ns && ((next_sent == due && w->num_retry == 0) || now >= end_ns + DRAIN_SECS * 1000000000L)) {
+            int busy = 0;
+            for (int i = 0; i < w->num_conns; i++) {
+                busy |= w->conns[i].state == CONN_CONNECTING || w->conns[i].state == CONN_SENDING
+                        || w->conns[i].state == CONN_READING;
+            }
+            if (!busy || now >= end_ns + DRAIN_SECS * 1000000000L) {
+                w->unsent = due - next_sent + w->num_retry;
+                break;
+            }
+        }
+
+        int timeout = 1;
+        if (next < end_ns) {
+            timeout = next > now ? (int)((next - now) / 1000000) : 0;
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (c->state == CONN_FREE) {
+                continue;
+            }
+            if (c->state == CONN_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    w->connect_errors++;
+                    conn_close(w, c);
+                    continue;
+                }
+                c->state = CONN_SENDING;
+            }
+            if (c->state == CONN_SENDING && conn_send(c) != 0) {
+                conn_lost(w, c, 0);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                conn_read(w, c, buf);
+            }
+        }
+    }
+    for (int i = 0; i < w->num_conns; i++) {
+        if (w->conns[i].state != CONN_FREE) {
+            conn_close(w, &w->conns[i]);
+        }
+    }
+    free(buf);
+    close(epfd);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, struct samples *s) {
+    if (s->len == 0) {
+        printf("%-10s no samples\n", name);
+        return;
+    }
+    qsort(s->v, s->len, sizeof(long), cmp_long);
+    double q[] = {0.50, 0.99, 0.999};
+    printf("%-10s", name);
+    for (int i = 0; i < 3; i++) {
+        size_t at = (size_t)(q[i] * (s->len - 1) + 0.5);
+        printf(" p%-5g %9.3f ms", q[i] * 100, s->v[at] / 1e6);
+    }
+    printf("  max %9.3f ms\n", s->v[s->len - 1] / 1e6);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-x host:port] [-u url] [-r rate] [-d secs] [-t threads] [-c conns] [-n]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = "127.0.0.1:8080";
+    const char *url = "http://127.0.0.1:18080/?size=1024";
+    int opt;
+    while ((opt = getopt(argc, argv, "x:u:r:d:t:c:n")) != -1) {
+        switch (opt) {
+        case 'x': proxy = optarg; break;
+        case 'u': url = optarg; break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration_secs = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'c': max_conns = atoi(optarg); break;
+        case 'n': close_each = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (rate <= 0 || duration_secs <= 0 || num_threads <= 0 || max_conns <= 0 || strncmp(url, "http://", 7) != 0) {
+        usage(argv[0]);
+    }
+
+    char host[256];
+    const char *colon = strrchr(proxy, ':');
+    if (colon == NULL || (size_t)(colon - proxy) >= sizeof(host)) {
+        usage(argv[0]);
+    }
+    memcpy(host, proxy, colon - proxy);
+    host[colon - proxy] = '\0';
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &proxy_addr.sin_addr) != 1) {
+        fprintf(stderr, "error: the proxy must be given as an IPv4 address\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *authority = url + 7;
+    int authority_len = (int)strcspn(authority, "/?");
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %.*s\r\n%s\r\n", url, authority_len,
+                       authority, close_each ? "Connection: close\r\n" : "");
+    if (len < 0 || (size_t)len >= sizeof(request)) {
+        fprintf(stderr, "error: URL too long\n");
+        return EXIT_FAILURE;
+    }
+    request_len = len;
+    signal(SIGPIPE, SIG_IGN);
+
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].index = i;
+        workers[i].conns = calloc(max_conns, sizeof(struct conn)); // never more open at once
+        workers[i].retry = calloc(max_conns, sizeof(long));
+    }
+    start_ns = now_ns() + 10000000L; // let every thread start before the first request falls due
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+
+    struct worker total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        total.sent += w->sent;
+        total.completed += w->completed;
+        total.non_2xx += w->non_2xx;
+        total.connect_errors += w->connect_errors;
+        total.io_errors += w->io_errors;
+        total.unsent += w->unsent;
+        total.retried += w->retried;
+        total.bytes += w->bytes;
+        for (size_t j = 0; j < w->corrected.len; j++) {
+            add_sample(&total.corrected, w->corrected.v[j]);
+            add_sample(&total.raw, w->raw.v[j]);
+        }
+        free(w->corrected.v);
+        free(w->raw.v);
+        free(w->conns);
+        free(w->retry);
+    }
+    free(workers);
+
+    printf("target %.0f req/s for %d s, %d threads, up to %d conns each%s\n", rate, duration_secs, num_threads,
+           max_conns, close_each ? ", a connection per request" : "");
+    printf("sent %ld  completed %ld  (%.0f req/s, %.1f MB/s)\n", total.sent, total.completed,
+           total.completed / (double)duration_secs, total.bytes / (double)duration_secs / 1e6);
+    printf("errors: non-2xx %ld  connect %ld  io %ld  never sent %ld  (retried %ld)\n", total.non_2xx,
+           total.connect_errors, total.io_errors, total.unsent, total.retried);
+    print_latency("corrected", &total.corrected);
+    print_latency("raw", &total.raw);
+    free(total.corrected.v);
+    free(total.raw.v);
+    return total.completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,714 @@
+/**
+ * micro_bench.c
+ *
+ * Microbenchmarks of the hot paths we keep tuning, written as JSON so
+ * two runs can be compared with bench/compare_micro.py:
+ *  - dispatch throughput and dispatch-to-start latency of every
+ *    threadpool queue at 1 to 8 workers
+ *  - request header parsing (http_request_parse plus the method, host
+ *    and port extraction of parse_request) on a corpus of requests
+ *  - modified_request, laying out the rewritten request for the origin
+ *  - is_valid_host and is_ip_in_filter on filters of 10 to 100k rules
+ *  - handing a request to the access log, with its writer draining
+ *  - allocator calls (malloc, calloc, realloc, aligned_alloc) per
+ *    dispatched job, per error page and per request proxied end to end
+ *    by the proxy itself, run in-process against a local origin
+ *
+ * Every benchmark runs a few times; the JSON has the median and the
+ * range of those runs, so the comparison can tell noise from change.
+ * proxyServer.c is linked in with its main renamed, so the functions
+ * measured are the proxy's own.
+ *
+ * build: gcc -O2 -I. -Dmain=proxy_main -o micro_bench bench/micro_bench.c proxyServer.c threadpool.c
+ *            filter.c reactor.c dns.c http.c upstream.c relay.c cache.c listener.c metrics.c timer.c uring.c slab.c buf.c coalesce.c accesslog.c -lpthread
+ * run:   ./micro_bench [runs] > result.json    (or bench/run_micro.sh)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "threadpool.h"
+#include "filter.h"
+#include "http.h"
+#include "buf.h"
+#include "accesslog.h"
+
+#undef main
+
+// proxyServer.c has no header, these are its definitions
+int is_valid_host(const filter_snapshot *snap, const char *host);
+int is_ip_in_filter(const filter_snapshot *snap, struct in_addr input_addr);
+int modified_request(const char *buf, const http_request *r, buf_chain *out);
+void generate_error_response(char *response, int error_type);
+int proxy_main(int argc, char *argv[]);
+
+#define MAX_RUNS 15
+#define DISPATCH_JOBS 200000
+#define LATENCY_SAMPLES 1000
+#define LATENCY_GAP_US 200 // long enough for the workers to park again
+#define PARSE_ITERATIONS 500000
+#define FILTER_LOOKUPS 1000000
+#define FILTER_QUERIES 64
+#define LOG_ROUNDS 8 // half a ring each, the writer drains in between
+#define MAX_RESULTS 128
+#define ALLOC_BATCH 256 // jobs in flight at once, well under TP_WORK_RECORDS
+#define ALLOC_PAGES 100000
+#define ALLOC_CONNS 20 // client connections per run of the proxied-request count
+#define ALLOC_REQUESTS 10 // requests on each
+#define ALLOC_ORIGIN_CONNS 16
+#define ERROR_PAGE_LEN 1024 // MAX_RESPONSE_LEN of proxyServer.c
+
+struct result {
+    char name[96];
+    const char *unit;
+    double runs[MAX_RUNS];
+};
+
+static struct result results[MAX_RESULTS];
+static int num_results;
+static int num_runs = 5;
+
+static const char *corpus[] = {
+    "GET http://www.example.com/ HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n",
+
+    "GET http://cdn.example.net:8080/static/js/app.3f9a1c.js HTTP/1.1\r\n"
+    "Host: cdn.example.net:8080\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=9b2f64c1d0a7e3; theme=dark; _ga=GA1.2.1234567890.1700000000\r\n"
+    "If-None-Match: \"5e1c-61a2b3c4d5e6f\"\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n",
+
+    "GET http://api.example.org/v2/items?page=3&per_page=50&sort=-updated HTTP/1.1\r\n"
+    "Host: api.example.org\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: application/json\r\n"
+    "\r\n",
+
+    "GET http://example.com/index.html HTTP/1.0\r\n"
+    "Host: example.com\r\n"
+    "\r\n",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// runs "fn" num_runs times and keeps what each run returned
+static void measure(const char *name, const char *unit, double (*fn)(void *), void *arg) {
+    if (num_results == MAX_RESULTS) {
+        fprintf(stderr, "error: too many benchmarks\n");
+        exit(EXIT_FAILURE);
+    }
+    struct result *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    double sorted[MAX_RUNS];
+    for (int i = 0; i < num_runs; i++) {
+        r->runs[i] = fn(arg);
+        sorted[i] = r->runs[i];
+    }
+    qsort(sorted, num_runs, sizeof(double), cmp_double);
+    fprintf(stderr, "%-40s %10.1f %s\n", name, sorted[num_runs / 2], unit);
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// ---- threadpool
+
+struct pool_case {
+    threadpool_queue queue;
+    int threads;
+    int percentile;         // latency runs: which percentile to return
+};
+
+static atomic_long done;
+static atomic_long started_ns;
+
+static int empty_job(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int stamp_job(void *arg) {
+    (void)arg;
+    atomic_store(&started_ns, now_ns());
+    return 0;
+}
+
+// ns per job from the first dispatch until the last job has run
+static double dispatch_throughput(void *arg) {
+    struct pool_case *pc = arg;
+    threadpool *tp = create_threadpool_queue(pc->threads, pc->queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&done, 0);
+    long start = now_ns();
+    for (long i = 0; i < DISPATCH_JOBS; i++) {
+        dispatch(tp, empty_job, NULL);
+    }
+    while (atomic_load(&done) < DISPATCH_JOBS) {
+        sched_yield();
+    }
+    double ns = (double)(now_ns() - start) / DISPATCH_JOBS;
+    destroy_threadpool(tp);
+    return ns;
+}
+
+// ns from dispatch() until an idle worker starts the job
+static double dispatch_latency(void *arg) {
+    struct pool_case *pc = arg;
+    threadpool *tp = create_threadpool_queue(pc->threads, pc->queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    static long samples[LATENCY_SAMPLES];
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        usleep(LATENCY_GAP_US);
+        atomic_store(&started_ns, 0);
+        long start = now_ns();
+        dispatch(tp, stamp_job, NULL);
+        long stamp;
+        while ((stamp = atomic_load(&started_ns)) == 0) {
+            sched_yield();
+        }
+        samples[i] = stamp - start;
+    }
+    destroy_threadpool(tp);
+    qsort(samples, LATENCY_SAMPLES, sizeof(long), cmp_long);
+    return samples[LATENCY_SAMPLES * pc->percentile / 100];
+}
+
+// ---- parsing
+
+static volatile long sink;
+
+// what parse_request takes from a parsed header: method, host, port
+static int extract(const char *buf, const http_request *r) {
+    char method[16], target[2048], host[256];
+    if (r->host < 0 || http_span_copy(buf, r->method, method, sizeof(method)) != 0
+        || http_span_copy(buf, r->target, target, sizeof(target)) != 0
+        || http_span_copy(buf, r->headers[r->host].value, host, sizeof(host)) != 0) {
+        return -1;
+    }
+    const char *authority = host;
+    if (strncasecmp(target, "http://", 7) == 0) {
+        authority = target + 7;
+    }
+    size_t authority_len = strcspn(authority, "/?#");
+    const char *port_separator = memchr(authority, ':', authority_len);
+    return port_separator != NULL ? atoi(port_separator + 1) : 80;
+}
+
+static double parse_requests(void *arg) {
+    (void)arg;
+    size_t lens[CORPUS_SIZE];
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        lens[i] = strlen(corpus[i]);
+    }
+    http_request r;
+    long start = now_ns();
+    for (long i = 0; i < PARSE_ITERATIONS; i++) {
+        size_t k = i % CORPUS_SIZE;
+        http_request_init(&r);
+        if (http_request_parse(&r, corpus[k], lens[k]) == 1) {
+            sink += extract(corpus[k], &r);
+        }
+    }
+    return (double)(now_ns() - start) / PARSE_ITERATIONS;
+}
+
+static double rewrite_requests(void *arg) {
+    (void)arg;
+    static http_request parsed[CORPUS_SIZE];
+    static buf_chain out;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        http_request_init(&parsed[i]);
+        http_request_parse(&parsed[i], corpus[i], strlen(corpus[i]));
+    }
+    long start = now_ns();
+    for (long i = 0; i < PARSE_ITERATIONS; i++) {
+        size_t k = i % CORPUS_SIZE;
+        buf_chain_init(&out);
+        modified_request(corpus[k], &parsed[k], &out);
+        sink += out.len;
+    }
+    return (double)(now_ns() - start) / PARSE_ITERATIONS;
+}
+
+// ---- filtering
+
+static char filter_path[] = "/tmp/micro_bench_filterXXXXXX";
+static char hosts[FILTER_QUERIES][64];
+static struct in_addr addrs[FILTER_QUERIES];
+
+// half exact hosts, a quarter suffixes, a quarter /24 networks; a
+// third of the queries match
+static int write_filter(int rules) {
+    FILE *f = fopen(filter_path, "w");
+    if (f == NULL) {
+        perror("error: filter file");
+        return -1;
+    }
+    int exact = rules / 2, suffixes = rules / 4, nets = rules - exact - suffixes;
+    for (int i = 0; i < exact; i++) {
+        fprintf(f, "host%d.example.com\n", i);
+    }
+    for (int i = 0; i < suffixes; i++) {
+        fprintf(f, "*.zone%d.example.net\n", i);
+    }
+    for (int i = 0; i < nets; i++) {
+        fprintf(f, "10.%d.%d.0/24\n", (i >> 8) & 255, i & 255);
+    }
+    fclose(f);
+
+    for (int i = 0; i < FILTER_QUERIES; i++) {
+        unsigned k = i * 2654435761u;
+        switch (i % 3) {
+        case 0:
+            snprintf(hosts[i], sizeof(hosts[i]), "host%u.example.com", k % (exact ? exact : 1));
+            addrs[i].s_addr = htonl(0x0a000000 | (k % (nets ? nets : 1)) << 8 | (i & 255));
+            break;
+        case 1:
+            snprintf(hosts[i], sizeof(hosts[i]), "www.cdn.zone%u.example.net:8080", k % (suffixes ? suffixes : 1));
+            addrs[i].s_addr = htonl(0xc0a80000 | (k & 0xffff));
+            break;
+        default:
+            snprintf(hosts[i], sizeof(hosts[i]), "static%u.images.example.org", k % 100000);
+            addrs[i].s_addr = htonl(0x08080000 | (k & 0xffff));
+        }
+    }
+    return filter_reload();
+}
+
+static double filter_hosts(void *arg) {
+    (void)arg;
+    filter_snapshot *snap = filter_acquire();
+    long start = now_ns();
+    for (long i = 0; i < FILTER_LOOKUPS; i++) {
+        sink += is_valid_host(snap, hosts[i % FILTER_QUERIES]);
+    }
+    double ns = (double)(now_ns() - start) / FILTER_LOOKUPS;
+    filter_release(snap);
+    return ns;
+}
+
+static double filter_addrs(void *arg) {
+    (void)arg;
+    filter_snapshot *snap = filter_acquire();
+    long start = now_ns();
+    for (long i = 0; i < FILTER_LOOKUPS; i++) {
+        sink += is_ip_in_filter(snap, addrs[i % FILTER_QUERIES]);
+    }
+    double ns = (double)(now_ns() - start) / FILTER_LOOKUPS;
+    filter_release(snap);
+    return ns;
+}
+
+// ---- access log
+
+static double log_records(void *arg) {
+    (void)arg;
+    accesslog_stats st;
+    accesslog_get_stats(&st);
+    unsigned long logged = st.written;
+    long elapsed = 0;
+    for (int round = 0; round < LOG_ROUNDS; round++) {
+        long start = now_ns();
+        for (int i = 0; i < ACCESSLOG_RING / 2; i++) {
+            accesslog_record *r = accesslog_reserve();
+            if (r == NULL) {
+                continue;
+            }
+            r->client.s_addr = htonl(INADDR_LOOPBACK);
+            r->status = 200;
+            r->bytes = 1024 + i;
+            r->upstream_us = 800;
+            r->total_us = 1000;
+            strcpy(r->method, "GET");
+            strcpy(r->host, "origin.test");
+            snprintf(r->path, sizeof(r->path), "http://origin.test/small?size=1024&n=%d", i);
+            accesslog_commit(r);
+        }
+        elapsed += now_ns() - start;
+        // the next round finds an empty ring, a full one would measure drops
+        logged += ACCESSLOG_RING / 2;
+        do {
+            usleep(1000);
+            accesslog_get_stats(&st);
+        } while (st.written + st.dropped < logged);
+    }
+    return (double)elapsed / (LOG_ROUNDS * (ACCESSLOG_RING / 2));
+}
+
+// ---- allocator calls
+
+// every allocation in the process is counted, so a benchmark resets
+// the count and lets nothing else run while it measures
+static atomic_long alloc_calls;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return __libc_memalign(align, size);
+}
+
+// allocator calls per job, with the queue never deeper than ALLOC_BATCH
+static double dispatch_allocs(void *arg) {
+    struct pool_case *pc = arg;
+    threadpool *tp = create_threadpool_queue(pc->threads, pc->queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&done, 0);
+    atomic_store(&alloc_calls, 0);
+    for (long i = 0; i < DISPATCH_JOBS; i += ALLOC_BATCH) {
+        for (int j = 0; j < ALLOC_BATCH; j++) {
+            dispatch(tp, empty_job, NULL);
+        }
+        while (atomic_load(&done) < i + ALLOC_BATCH) {
+            sched_yield();
+        }
+    }
+    double calls = (double)atomic_load(&alloc_calls) / atomic_load(&done);
+    destroy_threadpool(tp);
+    return calls;
+}
+
+static double error_page_allocs(void *arg) {
+    (void)arg;
+    static char page[ERROR_PAGE_LEN];
+    atomic_store(&alloc_calls, 0);
+    for (int i = 0; i < ALLOC_PAGES; i++) {
+        generate_error_response(page, i % 2 ? 404 : 503);
+    }
+    return (double)atomic_load(&alloc_calls) / ALLOC_PAGES;
+}
+
+static int origin_listen_fd;
+static int proxy_bench_port;
+
+// a keep-alive origin answering every request with the same small uncacheable response
+static void *run_origin(void *arg) {
+    (void)arg;
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nCache-Control: no-store\r\n\r\nhello";
+    struct pollfd fds[ALLOC_ORIGIN_CONNS + 1];
+    static char bufs[ALLOC_ORIGIN_CONNS + 1][4096];
+    size_t lens[ALLOC_ORIGIN_CONNS + 1];
+    int n = 1;
+    fds[0].fd = origin_listen_fd;
+    fds[0].events = POLLIN;
+    while (poll(fds, n, -1) >= 0) {
+        if (fds[0].revents != 0 && n <= ALLOC_ORIGIN_CONNS) {
+            int fd = accept(origin_listen_fd, NULL, NULL);
+            if (fd < 0) {
+                break; // shut down, the benchmark is over
+            }
+            fds[n].fd = fd;
+            fds[n].events = POLLIN;
+            lens[n++] = 0;
+        }
+        for (int i = 1; i < n; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t got = read(fds[i].fd, bufs[i] + lens[i], sizeof(bufs[i]) - 1 - lens[i]);
+            if (got <= 0) {
+                close(fds[i].fd);
+                fds[i] = fds[--n];
+                memcpy(bufs[i], bufs[n], lens[n]);
+                lens[i] = lens[n];
+                i--;
+                continue;
+            }
+            lens[i] += got;
+            bufs[i][lens[i]] = '\0';
+            char *end;
+            while ((end = strstr(bufs[i], "\r\n\r\n")) != NULL) {
+                if (write(fds[i].fd, response, sizeof(response) - 1) < 0) {
+                    break;
+                }
+                size_t used = end + 4 - bufs[i];
+                memmove(bufs[i], end + 4, lens[i] - used + 1);
+                lens[i] -= used;
+            }
+        }
+    }
+    for (int i = 1; i < n; i++) {
+        close(fds[i].fd);
+    }
+    return NULL;
+}
+
+static void *run_proxy(void *arg) {
+    char **argv = arg;
+    proxy_main(5, argv);
+    return NULL;
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        perror("error: connect");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// ALLOC_CONNS connections of ALLOC_REQUESTS requests each, one after the other
+static void proxy_requests(int origin_port) {
+    char request[256];
+    int len = snprintf(request, sizeof(request), "GET http://127.0.0.1:%d/ HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+                       origin_port, origin_port);
+    for (int c = 0; c < ALLOC_CONNS; c++) {
+        int fd = connect_local(proxy_bench_port);
+        for (int r = 0; r < ALLOC_REQUESTS; r++) {
+            if (write(fd, request, len) != len) {
+                perror("error: write");
+                exit(EXIT_FAILURE);
+            }
+            char buf[1024];
+            size_t have = 0;
+            while (have < 5 || memcmp(buf + have - 5, "hello", 5) != 0) {
+                ssize_t got = read(fd, buf + have, sizeof(buf) - have);
+                if (got <= 0 || (size_t)got == sizeof(buf) - have) {
+                    fprintf(stderr, "error: the proxy did not answer\n");
+                    exit(EXIT_FAILURE);
+                }
+                have += got;
+            }
+        }
+        close(fd);
+    }
+}
+
+// allocator calls per request proxied, connection setup included
+static double proxied_allocs(void *arg) {
+    int origin_port = *(int *)arg;
+    atomic_store(&alloc_calls, 0);
+    proxy_requests(origin_port);
+    return (double)atomic_load(&alloc_calls) / (ALLOC_CONNS * ALLOC_REQUESTS);
+}
+
+/**
+ * starts the proxy on its own threads, with a max-number-of-request
+ * that ends it once the warm-up and the measured runs are done, and
+ * measures. The proxy's globals only allow this once per process.
+ */
+static void measure_proxied(void) {
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    origin_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (origin_listen_fd < 0 || bind(origin_listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0
+        || listen(origin_listen_fd, 64) != 0
+        || getsockname(origin_listen_fd, (struct sockaddr *)&sa, &sa_len) != 0) {
+        perror("error: origin socket");
+        exit(EXIT_FAILURE);
+    }
+    int origin_port = ntohs(sa.sin_port);
+    // a free port for the proxy, there is a small window for someone else to take it
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    sa.sin_port = 0;
+    sa_len = sizeof(sa);
+    if (probe < 0 || bind(probe, (struct sockaddr *)&sa, sizeof(sa)) != 0
+        || getsockname(probe, (struct sockaddr *)&sa, &sa_len) != 0) {
+        perror("error: proxy port");
+        exit(EXIT_FAILURE);
+    }
+    proxy_bench_port = ntohs(sa.sin_port);
+    close(probe);
+
+    static char port_arg[16], requests_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", proxy_bench_port);
+    // the warm-up, the runs, the connection that checks the proxy is up and
+    // the one that ends it (the last one allowed cuts keep-alive clients off)
+    snprintf(requests_arg, sizeof(requests_arg), "%d", ALLOC_CONNS * (num_runs + 1) + 2);
+    static char *argv[6] = {"proxyServer", port_arg, "2", requests_arg, filter_path, NULL};
+    setenv("PROXY_CACHE_MB", "0", 1);
+    pthread_t origin, proxy;
+    pthread_create(&origin, NULL, run_origin, NULL);
+    pthread_create(&proxy, NULL, run_proxy, argv);
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sa.sin_port = htons(proxy_bench_port);
+        int up = connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+        close(fd);
+        if (up) {
+            break;
+        }
+        usleep(10000);
+    }
+    proxy_requests(origin_port); // caches and slabs fill up
+    measure("alloc/proxy/request", "allocs/request", proxied_allocs, &origin_port);
+    close(connect_local(proxy_bench_port));
+    pthread_join(proxy, NULL);
+    shutdown(origin_listen_fd, SHUT_RDWR);
+    pthread_join(origin, NULL);
+    close(origin_listen_fd);
+}
+
+// ---- output
+
+static void print_json(void) {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    printf("{\n  \"host\": \"%s\",\n  \"cpus\": %ld,\n  \"time\": %ld,\n  \"runs\": %d,\n  \"benchmarks\": [\n",
+           host, sysconf(_SC_NPROCESSORS_ONLN), (long)time(NULL), num_runs);
+    for (int i = 0; i < num_results; i++) {
+        struct result *r = &results[i];
+        double sorted[MAX_RUNS];
+        memcpy(sorted, r->runs, num_runs * sizeof(double));
+        qsort(sorted, num_runs, sizeof(double), cmp_double);
+        printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.2f, \"min\": %.2f, \"max\": %.2f, \"runs\": [",
+               r->name, r->unit, sorted[num_runs / 2], sorted[0], sorted[num_runs - 1]);
+        for (int j = 0; j < num_runs; j++) {
+            printf("%s%.2f", j ? ", " : "", r->runs[j]);
+        }
+        printf("]}%s\n", i + 1 < num_results ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    num_runs = argc > 1 ? atoi(argv[1]) : 5;
+    if (num_runs < 1 || num_runs > MAX_RUNS) {
+        fprintf(stderr, "usage: %s [runs (1-%d)]\n", argv[0], MAX_RUNS);
+        return EXIT_FAILURE;
+    }
+
+    struct {
+        const char *name;
+        threadpool_queue queue;
+    } queues[] = {
+        {"locked", TP_QUEUE_LOCKED},
+        {"lockfree", TP_QUEUE_LOCKFREE},
+        {"stealing", TP_QUEUE_STEALING},
+    };
+    int threads[] = {1, 2, 4, 8};
+    char name[96];
+    for (int q = 0; q < 3; q++) {
+        for (int t = 0; t < 4; t++) {
+            struct pool_case pc = {queues[q].queue, threads[t], 0};
+            snprintf(name, sizeof(name), "dispatch/%s/threads=%d/throughput", queues[q].name, threads[t]);
+            measure(name, "ns/job", dispatch_throughput, &pc);
+        }
+        for (int t = 0; t < 4; t += 2) {
+            struct pool_case pc = {queues[q].queue, threads[t], 50};
+            snprintf(name, sizeof(name), "dispatch/%s/threads=%d/wakeup_p50", queues[q].name, threads[t]);
+            measure(name, "ns", dispatch_latency, &pc);
+            pc.percentile = 99;
+            snprintf(name, sizeof(name), "dispatch/%s/threads=%d/wakeup_p99", queues[q].name, threads[t]);
+            measure(name, "ns", dispatch_latency, &pc);
+        }
+    }
+
+    measure("parse/request", "ns/request", parse_requests, NULL);
+    measure("rewrite/modified_request", "ns/request", rewrite_requests, NULL);
+
+    int fd = mkstemp(filter_path);
+    if (fd < 0) {
+        perror("error: mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (filter_init(filter_path) != 0) {
+        return EXIT_FAILURE;
+    }
+    int sizes[] = {10, 100, 1000, 10000, 100000};
+    for (int i = 0; i < 5; i++) {
+        if (write_filter(sizes[i]) != 0) {
+            fprintf(stderr, "error: filter with %d rules did not load\n", sizes[i]);
+            return EXIT_FAILURE;
+        }
+        snprintf(name, sizeof(name), "filter/rules=%d/is_valid_host", sizes[i]);
+        measure(name, "ns/lookup", filter_hosts, NULL);
+        snprintf(name, sizeof(name), "filter/rules=%d/is_ip_in_filter", sizes[i]);
+        measure(name, "ns/lookup", filter_addrs, NULL);
+    }
+    filter_shutdown();
+
+    if (accesslog_start("/dev/null") != 0) {
+        return EXIT_FAILURE;
+    }
+    measure("accesslog/record", "ns/record", log_records, NULL);
+    accesslog_shutdown();
+
+    for (int q = 0; q < 3; q++) {
+        struct pool_case pc = {queues[q].queue, 1, 0};
+        snprintf(name, sizeof(name), "alloc/dispatch/%s", queues[q].name);
+        measure(name, "allocs/job", dispatch_allocs, &pc);
+    }
+    measure("alloc/error_page", "allocs/page", error_page_allocs, NULL);
+    // the proxy filters nothing
+    FILE *empty = fopen(filter_path, "w");
+    if (empty == NULL) {
+        perror("error: filter");
+        return EXIT_FAILURE;
+    }
+    fclose(empty);
+    measure_proxied();
+    unlink(filter_path);
+
+    print_json();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/**
+ * mock_origin.c
+ *
+ * An HTTP/1.1 origin for load tests, one thread per connection,
+ * keep-alive unless the client asks otherwise. What it answers is
+ * chosen per request in the query string of any path:
+ *   size=N      body bytes (default 1024)
+ *   var=N       adds 0..N random bytes to the size
+ *   delay=MS    waits this long before answering
+ *   jitter=MS   adds 0..MS random milliseconds to the delay
+ *   chunked=1   sends the body chunked instead of with Content-Length
+ *   cache=1     lets the proxy cache the response (no-store otherwise)
+ *   maxage=S    how long a cached response stays fresh (default 60)
+ *
+ * SIGUSR1 prints the number of requests answered since the last one.
+ *
+ * build: gcc -O2 -o mock_origin bench/mock_origin.c -lpthread
+ * run:   ./mock_origin [port]   (listens on 127.0.0.1, default 18080)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define REQUEST_LEN 8192
+#define BODY_CHUNK (64 * 1024) // bytes per send, and per chunk when chunked
+
+static char body[BODY_CHUNK];
+static atomic_ulong requests;
+static volatile sig_atomic_t report_requested;
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    report_requested = 1; // accept is interrupted, main prints it
+}
+
+// value of "name=" in the query of the request line, or "fallback"
+static long query_param(const char *line, const char *name, long fallback) {
+    const char *q = strchr(line, '?');
+    const char *end = strchr(line, ' ');
+    if (end != NULL) {
+        end = strchr(end + 1, ' '); // the space before the version
+    }
+    size_t name_len = strlen(name);
+    while (q != NULL && (end == NULL || q < end)) {
+        q++;
+        if (strncmp(q, name, name_len) == 0 && q[name_len] == '=') {
+            return atol(q + name_len + 1);
+        }
+        q = strchr(q, '&');
+    }
+    return fallback;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int respond(int fd, const char *request, int keep_alive, unsigned *seed) {
+    long size = query_param(request, "size", 1024);
+    long var = query_param(request, "var", 0);
+    long delay = query_param(request, "delay", 0);
+    long jitter = query_param(request, "jitter", 0);
+    int chunked = query_param(request, "chunked", 0) != 0;
+    int cache = query_param(request, "cache", 0) != 0;
+    long max_age = query_param(request, "maxage", 60);
+    if (var > 0) {
+        size += rand_r(seed) % (var + 1);
+    }
+    if (jitter > 0) {
+        delay += rand_r(seed) % (jitter + 1);
+    }
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+
+    char framing[64];
+    if (chunked) {
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked");
+    } else {
+        snprintf(framing, sizeof(framing), "Content-Length: %ld", size);
+    }
+    char cache_control[32];
+    if (cache) {
+        snprintf(cache_control, sizeof(cache_control), "max-age=%ld", max_age);
+    } else {
+        snprintf(cache_control, sizeof(cache_control), "no-store");
+    }
+    char header[512];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Cache-Control: %s\r\n"
+                       "%s\r\n"
+                       "Connection: %s\r\n\r\n",
+                       cache_control, framing, keep_alive ? "keep-alive" : "close");
+    if (send_all(fd, header, len) != 0) {
+        return -1;
+    }
+    while (size > 0) {
+        size_t n = size < BODY_CHUNK ? (size_t)size : BODY_CHUNK;
+        if (chunked) {
+            char line[32];
+            int line_len = snprintf(line, sizeof(line), "%zx\r\n", n);
+            if (send_all(fd, line, line_len) != 0) {
+                return -1;
+            }
+        }
+        if (send_all(fd, body, n) != 0 || (chunked && send_all(fd, "\r\n", 2) != 0)) {
+            return -1;
+        }
+        size -= n;
+    }
+    return chunked ? send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+static void *serve(void *arg) {
+    int fd = (int)(long)arg;
+    unsigned seed = (unsigned)fd * 2654435761u;
+    char buf[REQUEST_LEN + 1];
+    size_t len = 0;
+    while (1) {
+        char *end = NULL;
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL || len == 0) {
+            if (len == REQUEST_LEN) {
+                goto done;
+            }
+            ssize_t n = recv(fd, buf + len, REQUEST_LEN - len, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            len += n;
+            buf[len] = '\0';
+        }
+        size_t request_len = end + 4 - buf;
+        int keep_alive = strcasestr(buf, "\r\nConnection: close") == NULL
+                         && strncmp(end - 8, "HTTP/1.0", 8) != 0;
+        end[2] = '\0';
+        atomic_fetch_add(&requests, 1);
+        if (respond(fd, buf, keep_alive, &seed) != 0 || !keep_alive) {
+            break;
+        }
+        memmove(buf, buf + request_len, len - request_len);
+        len -= request_len;
+        buf[len] = '\0';
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 18080;
+    memset(body, 'x', sizeof(body));
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1; // no SA_RESTART, so that accept returns
+    sigaction(SIGUSR1, &sa, NULL);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("mock_origin: listen");
+        return EXIT_FAILURE;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+        if (report_requested) {
+            report_requested = 0;
+            printf("origin: %lu requests\n", atomic_exchange(&requests, 0));
+            fflush(stdout);
+        }
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) {
+                continue;
+            }
+            perror("mock_origin: accept");
+            return EXIT_FAILURE;
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        // the connection's thread inherits SIGUSR1 blocked, it is for accept only
+        sigset_t usr1, old;
+        sigemptyset(&usr1);
+        sigaddset(&usr1, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &usr1, &old);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve, (void *)(long)client) != 0) {
+            close(client);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+}
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# run_load.sh
+#
+# Builds the proxy, mock_origin and loadgen, then runs the load
+# scenarios through a fresh proxy each, all on loopback:
+#   small       1 KB objects over keep-alive connections
+#   variable    1..9 KB objects, chunked
+#   close       1 KB objects, a new connection per request
+#   large       1 MB downloads
+#   slow        an origin that takes 50..150 ms to answer
+#   filter      small objects with a filter of 50000 hosts, wildcards
+#               and networks, none of which matches
+#   herd        one cacheable object that expires every second, so
+#               that requests pile up on each refetch; once with
+#               request coalescing and once without (herd-solo)
+#   logged      small, with the access log written to a file
+#
+# Each scenario ends with the number of requests the origin answered.
+# run: bench/run_load.sh [secs] [rate-scale]   (from the repository root)
+# "rate-scale" multiplies every scenario's request rate (default 1).
+# The proxies inherit the environment, so e.g. PROXY_IO=uring runs the
+# scenarios on the io_uring backend.
+
+set -e
+SECS=${1:-10}
+SCALE=${2:-1}
+ORIGIN_PORT=18080
+ORIGIN=http://127.0.0.1:$ORIGIN_PORT
+OUT=$(mktemp -d)
+trap 'kill $ORIGIN_PID 2>/dev/null; rm -rf "$OUT"' EXIT
+
+SRC="proxyServer.c threadpool.c filter.c reactor.c dns.c http.c upstream.c relay.c cache.c listener.c metrics.c timer.c uring.c slab.c buf.c coalesce.c accesslog.c"
+gcc -O2 -o "$OUT/proxy" $SRC -lpthread
+gcc -O2 -o "$OUT/mock_origin" bench/mock_origin.c -lpthread
+gcc -O2 -I. -o "$OUT/loadgen" bench/loadgen.c http.c -lpthread
+
+echo "blocked.example" > "$OUT/filter-small.txt"
+awk 'BEGIN {
+    for (i = 0; i < 20000; i++) printf "host%d.blocked.example\n", i
+    for (i = 0; i < 20000; i++) printf "*.zone%d.example\n", i
+    for (i = 0; i < 10000; i++) printf "10.%d.%d.0/24\n", int(i / 256), i % 256
+}' > "$OUT/filter-heavy.txt"
+
+"$OUT/mock_origin" $ORIGIN_PORT &
+ORIGIN_PID=$!
+sleep 0.2
+
+# scenario <name> <filter> <rate> <url> [loadgen options]
+# $PROXY_ENV, if set, adds VAR=value settings to the proxy's environment
+scenario() {
+    name=$1 filter=$2 rate=$(awk "BEGIN { print $3 * $SCALE }") url=$4
+    shift 4
+    port=$(awk 'BEGIN { srand(); print 20000 + int(rand() * 20000) }')
+    env $PROXY_ENV "$OUT/proxy" $port 4 1000000000 "$OUT/$filter" > "$OUT/proxy.log" 2>&1 &
+    proxy_pid=$!
+    sleep 0.5
+    echo "=== $name"
+    "$OUT/loadgen" -x 127.0.0.1:$port -u "$url" -r "$rate" -d "$SECS" "$@" || true
+    kill $proxy_pid
+    wait $proxy_pid 2>/dev/null || true
+    kill -USR1 $ORIGIN_PID
+    sleep 0.1
+}
+
+scenario small filter-small.txt 5000 "$ORIGIN/small?size=1024"
+scenario variable filter-small.txt 2000 "$ORIGIN/var?size=1024&var=8192&chunked=1"
+scenario close filter-small.txt 1000 "$ORIGIN/small?size=1024" -n
+scenario large filter-small.txt 50 "$ORIGIN/large?size=1048576" -c 32
+scenario slow filter-small.txt 500 "$ORIGIN/slow?size=1024&delay=50&jitter=100" -c 256
+scenario filter filter-heavy.txt 5000 "$ORIGIN/small?size=1024"
+scenario herd filter-small.txt 2000 "$ORIGIN/herd?size=16384&delay=100&cache=1&maxage=1" -c 256
+PROXY_ENV=PROXY_COALESCE_SECS=0 scenario herd-solo filter-small.txt 2000 "$ORIGIN/herd?size=16384&delay=100&cache=1&maxage=1" -c 256
+PROXY_ENV=PROXY_ACCESS_LOG=$OUT/access.log scenario logged filter-small.txt 5000 "$ORIGIN/small?size=1024"
+echo "access log: $(wc -l < "$OUT/access.log") lines"
@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# run_micro.sh
+#
+# Builds micro_bench against the current tree and writes its JSON to
+# "out" (default micro-<commit>.json). Compare two results with
+# bench/compare_micro.py base.json new.json.
+#
+# run: bench/run_micro.sh [out] [runs]   (from the repository root)
+
+set -e
+OUT=${1:-micro-$(git rev-parse --short HEAD 2>/dev/null || echo local).json}
+RUNS=${2:-5}
+BIN=$(mktemp)
+trap 'rm -f "$BIN"' EXIT
+
+gcc -O2 -I. -Dmain=proxy_main -o "$BIN" bench/micro_bench.c proxyServer.c threadpool.c filter.c reactor.c \
+    dns.c http.c upstream.c relay.c cache.c listener.c metrics.c timer.c uring.c slab.c buf.c coalesce.c accesslog.c -lpthread
+"$BIN" "$RUNS" > "$OUT"
+echo "wrote $OUT"
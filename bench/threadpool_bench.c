@@ -0,0 +1,219 @@
+/**
+ * threadpool_bench.c
+ *
+ * Compares the threadpool queues:
+ *  - dispatch throughput: producers dispatch empty jobs as fast as
+ *    they can, timed until the last job has run
+ *  - wake-up latency: one job at a time reaches a pool whose workers
+ *    are all idle, timed from dispatch until the job starts
+ *  - spawn throughput: a few root jobs each dispatch a binary tree of
+ *    jobs from inside the workers, the case work stealing is made for
+ *  - elastic sizing: a burst of blocking jobs reaches a pool started at
+ *    one worker, then the pool idles; its stats are printed as it grows
+ *    and shrinks back
+ *
+ * build: gcc -O2 -I. -o threadpool_bench bench/threadpool_bench.c threadpool.c -lpthread
+ * run:   ./threadpool_bench [pool-size] [jobs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#define LATENCY_SAMPLES 2000
+#define LATENCY_GAP_US 200 // long enough for the workers to park again
+#define SPAWN_ROOTS 8
+#define ELASTIC_JOBS 2000
+#define ELASTIC_JOB_US 1000 // each job blocks this long, like a lookup would
+#define ELASTIC_IDLE_MS 200 // idle timeout of the elastic pool
+#define ELASTIC_SAMPLE_MS 50
+
+static atomic_long done;
+static atomic_long started_ns; // wake-up latency: when the job began
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int empty_job(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int stamp_job(void *arg) {
+    (void)arg;
+    atomic_store(&started_ns, now_ns());
+    return 0;
+}
+
+static threadpool *spawn_pool;
+
+// a job that dispatches two children until its depth runs out
+static int spawn_job(void *arg) {
+    long depth = (long)arg;
+    if (depth > 0) {
+        dispatch(spawn_pool, spawn_job, (void *)(depth - 1));
+        dispatch(spawn_pool, spawn_job, (void *)(depth - 1));
+    }
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    return 0;
+}
+
+struct producer {
+    pthread_t thread;
+    threadpool *tp;
+    long jobs;
+};
+
+static void *produce(void *arg) {
+    struct producer *p = (struct producer *)arg;
+    for (long i = 0; i < p->jobs; i++) {
+        dispatch(p->tp, empty_job, NULL);
+    }
+    return NULL;
+}
+
+static void throughput(const char *name, threadpool_queue queue, int pool_size, int producers, long jobs) {
+    threadpool *tp = create_threadpool_queue(pool_size, queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    struct producer p[16];
+    atomic_store(&done, 0);
+    long start = now_ns();
+    for (int i = 0; i < producers; i++) {
+        p[i].tp = tp;
+        p[i].jobs = jobs / producers;
+        pthread_create(&p[i].thread, NULL, produce, &p[i]);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_join(p[i].thread, NULL);
+    }
+    long total = jobs / producers * producers;
+    while (atomic_load(&done) < total) {
+        sched_yield();
+    }
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-9s throughput  %2d producers  %8.2f Mjobs/s\n", name, producers, total / secs / 1e6);
+    destroy_threadpool(tp);
+}
+
+static void spawn(const char *name, threadpool_queue queue, int pool_size, long jobs) {
+    spawn_pool = create_threadpool_queue(pool_size, queue);
+    if (spawn_pool == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    // a tree of depth d has 2^(d+1) - 1 jobs
+    long depth = 0;
+    while ((2L << (depth + 1)) - 1 <= jobs / SPAWN_ROOTS) {
+        depth++;
+    }
+    long total = SPAWN_ROOTS * ((2L << depth) - 1);
+    atomic_store(&done, 0);
+    long start = now_ns();
+    for (int i = 0; i < SPAWN_ROOTS; i++) {
+        dispatch(spawn_pool, spawn_job, (void *)depth);
+    }
+    while (atomic_load(&done) < total) {
+        sched_yield();
+    }
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-9s spawn       %2d roots      %8.2f Mjobs/s\n", name, SPAWN_ROOTS, total / secs / 1e6);
+    destroy_threadpool(spawn_pool);
+}
+
+static int blocking_job(void *arg) {
+    (void)arg;
+    usleep(ELASTIC_JOB_US);
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void print_stats(threadpool *tp, long start) {
+    threadpool_stats st;
+    threadpool_get_stats(tp, &st);
+    printf("%-9s elastic  %6ld ms  threads %3d  idle %3d  queued %5ld  spawned %3lu  retired %3lu\n",
+           "", (now_ns() - start) / 1000000, st.threads, st.idle, st.queued, st.spawned, st.retired);
+}
+
+static void elastic(const char *name, threadpool_queue queue, int max_threads) {
+    threadpool *tp = create_threadpool_elastic(1, max_threads, ELASTIC_IDLE_MS, queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    printf("%s, 1..%d workers, %d jobs of %d us\n", name, max_threads, ELASTIC_JOBS, ELASTIC_JOB_US);
+    atomic_store(&done, 0);
+    long start = now_ns();
+    for (int i = 0; i < ELASTIC_JOBS; i++) {
+        dispatch(tp, blocking_job, NULL);
+    }
+    long next = 0;
+    while (atomic_load(&done) < ELASTIC_JOBS) {
+        if (now_ns() - start >= next) {
+            print_stats(tp, start);
+            next += ELASTIC_SAMPLE_MS * 1000000L;
+        }
+        usleep(1000);
+    }
+    print_stats(tp, start);
+    // idle: the workers above the minimum retire after ELASTIC_IDLE_MS
+    for (int i = 0; i < 4; i++) {
+        usleep(ELASTIC_IDLE_MS * 1000);
+        print_stats(tp, start);
+    }
+    destroy_threadpool(tp);
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void latency(const char *name, threadpool_queue queue, int pool_size) {
+    threadpool *tp = create_threadpool_queue(pool_size, queue);
+    if (tp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    static long samples[LATENCY_SAMPLES];
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        usleep(LATENCY_GAP_US);
+        atomic_store(&started_ns, 0);
+        long start = now_ns();
+        dispatch(tp, stamp_job, NULL);
+        long stamp;
+        while ((stamp = atomic_load(&started_ns)) == 0) {
+            sched_yield();
+        }
+        samples[i] = stamp - start;
+    }
+    qsort(samples, LATENCY_SAMPLES, sizeof(long), cmp_long);
+    printf("%-9s wake-up     p50 %6.1f us  p99 %6.1f us\n", name,
+           samples[LATENCY_SAMPLES / 2] / 1e3, samples[LATENCY_SAMPLES * 99 / 100] / 1e3);
+    destroy_threadpool(tp);
+}
+
+int main(int argc, char *argv[]) {
+    int pool_size = argc > 1 ? atoi(argv[1]) : 4;
+    long jobs = argc > 2 ? atol(argv[2]) : 2000000;
+
+    int producers[] = {1, 4};
+    for (int i = 0; i < 2; i++) {
+        throughput("locked", TP_QUEUE_LOCKED, pool_size, producers[i], jobs);
+        throughput("lockfree", TP_QUEUE_LOCKFREE, pool_size, producers[i], jobs);
+        throughput("stealing", TP_QUEUE_STEALING, pool_size, producers[i], jobs);
+    }
+    spawn("locked", TP_QUEUE_LOCKED, pool_size, jobs);
+    spawn("lockfree", TP_QUEUE_LOCKFREE, pool_size, jobs);
+    spawn("stealing", TP_QUEUE_STEALING, pool_size, jobs);
+    latency("locked", TP_QUEUE_LOCKED, pool_size);
+    latency("lockfree", TP_QUEUE_LOCKFREE, pool_size);
+    latency("stealing", TP_QUEUE_STEALING, pool_size);
+    elastic("lockfree", TP_QUEUE_LOCKFREE, pool_size * 8);
+    elastic("stealing", TP_QUEUE_STEALING, pool_size * 8);
+    return EXIT_SUCCESS;
+}
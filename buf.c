@@ -0,0 +1,141 @@
+#include "buf.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+void buf_pool_init(buf_pool *p) {
+    for (int i = 0; i < BUF_CLASSES; i++) {
+        slab_init(&p->classes[i], sizeof(buf_seg) + ((size_t)BUF_MIN_LEN << i));
+    }
+}
+
+buf_seg *buf_get(buf_pool *p, size_t len) {
+    unsigned cls = 0;
+    while (cls < BUF_CLASSES && ((size_t)BUF_MIN_LEN << cls) < len) {
+        cls++;
+    }
+    if (cls == BUF_CLASSES) {
+        return NULL;
+    }
+    buf_seg *s = (buf_seg *)slab_alloc(&p->classes[cls]);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->refs = 1;
+    s->cls = cls;
+    s->cap = (size_t)BUF_MIN_LEN << cls;
+    return s;
+}
+
+buf_seg *buf_hold(buf_seg *s) {
+    s->refs++;
+    return s;
+}
+
+void buf_put(buf_pool *p, buf_seg *s) {
+    if (s != NULL && --s->refs == 0) {
+        slab_free(&p->classes[s->cls], s);
+    }
+}
+
+int buf_grow(buf_pool *p, buf_seg **s, size_t len, size_t want) {
+    size_t cap = (*s)->cap * 2;
+    buf_seg *bigger = buf_get(p, cap > want ? cap : want);
+    if (bigger == NULL) {
+        return -1;
+    }
+    memcpy(bigger->data, (*s)->data, len);
+    buf_put(p, *s);
+    *s = bigger;
+    return 0;
+}
+
+void buf_pool_destroy(buf_pool *p) {
+    for (int i = 0; i < BUF_CLASSES; i++) {
+        slab_destroy(&p->classes[i]);
+    }
+}
+
+void buf_chain_init(buf_chain *ch) {
+    ch->num_iov = ch->next = 0;
+    ch->next_off = ch->len = 0;
+    ch->num_held = 0;
+}
+
+int buf_chain_add(buf_chain *ch, const void *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (ch->num_iov > 0) {
+        struct iovec *last = &ch->iov[ch->num_iov - 1];
+        if ((const char *)last->iov_base + last->iov_len == (const char *)data) {
+            last->iov_len += len;
+            ch->len += len;
+            return 0;
+        }
+    }
+    if (ch->num_iov == BUF_CHAIN_IOV) {
+        return -1;
+    }
+    ch->iov[ch->num_iov].iov_base = (void *)data;
+    ch->iov[ch->num_iov].iov_len = len;
+    ch->num_iov++;
+    ch->len += len;
+    return 0;
+}
+
+int buf_chain_hold(buf_chain *ch, buf_seg *s) {
+    if (ch->num_held == BUF_CHAIN_HOLD) {
+        return -1;
+    }
+    ch->held[ch->num_held++] = buf_hold(s);
+    return 0;
+}
+
+void buf_chain_rewind(buf_chain *ch) {
+    ch->next = 0;
+    ch->next_off = 0;
+}
+
+int buf_chain_write(buf_chain *ch, int fd) {
+    while (ch->next < ch->num_iov) {
+        // the first piece may be partly written, it is trimmed for the
+        // call only so the chain can still be rewound
+        struct iovec *first = &ch->iov[ch->next];
+        struct iovec saved = *first;
+        first->iov_base = (char *)first->iov_base + ch->next_off;
+        first->iov_len -= ch->next_off;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = first;
+        msg.msg_iovlen = ch->num_iov - ch->next;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        *first = saved;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        size_t left = (size_t)n;
+        while (left > 0 && ch->next < ch->num_iov) {
+            size_t rest = ch->iov[ch->next].iov_len - ch->next_off;
+            if (left < rest) {
+                ch->next_off += left;
+                break;
+            }
+            left -= rest;
+            ch->next++;
+            ch->next_off = 0;
+        }
+    }
+    return 1;
+}
+
+void buf_chain_reset(buf_pool *p, buf_chain *ch) {
+    while (ch->num_held > 0) {
+        buf_put(p, ch->held[--ch->num_held]);
+    }
+    buf_chain_init(ch);
+}
@@ -0,0 +1,123 @@
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "slab.h"
+
+/**
+ * buf.h
+ *
+ * Refcounted byte segments and the gather lists built over them.
+ *
+ * Segments come from a per-thread pool in power-of-two size classes,
+ * the smallest one fits the usual request header. Whoever keeps a
+ * pointer into a segment holds a reference, so the bytes a request
+ * was received into can be sent on by reference while the receive
+ * side lets go of them.
+ *
+ * A chain lists pieces of segments and of other buffers as an iovec
+ * array and writes them with one writev, picking up where a partial
+ * write stopped. Nothing is copied to put a message together.
+ */
+
+#define BUF_MIN_LEN 2048    // smallest segment, room for most request headers
+#define BUF_CLASSES 6       // 2K .. 64K, each class twice the one before
+#define BUF_MAX_LEN (BUF_MIN_LEN << (BUF_CLASSES - 1))
+#define BUF_CHAIN_IOV 72    // pieces in a chain, a request with every header kept apart fits
+#define BUF_CHAIN_HOLD 4    // segments a chain keeps references to
+
+typedef struct buf_seg {
+    unsigned refs;
+    unsigned cls;           // size class, the slab cache it goes back to
+    size_t cap;             // bytes in data
+    char data[];
+} buf_seg;
+
+typedef struct buf_pool {
+    slab_cache classes[BUF_CLASSES];
+} buf_pool;
+
+typedef struct buf_chain {
+    struct iovec iov[BUF_CHAIN_IOV];
+    int num_iov;
+    int next;               // first piece not completely written
+    size_t next_off;        // bytes of iov[next] already written
+    size_t len;             // of all pieces
+    buf_seg *held[BUF_CHAIN_HOLD];
+    int num_held;
+} buf_chain;
+
+/**
+ * buf_pool_init prepares an empty pool, segments are taken as needed.
+ */
+void buf_pool_init(buf_pool *p);
+
+/**
+ * buf_get returns a segment with room for at least "len" bytes and one
+ * reference, the caller's. returns NULL if len is over BUF_MAX_LEN or
+ * out of memory.
+ */
+buf_seg *buf_get(buf_pool *p, size_t len);
+
+/**
+ * buf_hold adds a reference to "s" and returns it.
+ */
+buf_seg *buf_hold(buf_seg *s);
+
+/**
+ * buf_put drops a reference, the last one gives the segment back to
+ * the pool. "s" may be NULL.
+ */
+void buf_put(buf_pool *p, buf_seg *s);
+
+/**
+ * buf_grow moves the first "len" bytes of *s into a segment of the next
+ * class that holds at least "want" bytes and drops the old one.
+ * returns 0 on success, -1 (*s untouched) if there is no such segment.
+ */
+int buf_grow(buf_pool *p, buf_seg **s, size_t len, size_t want);
+
+/**
+ * buf_pool_destroy frees every segment, those still referenced included.
+ */
+void buf_pool_destroy(buf_pool *p);
+
+/**
+ * buf_chain_init empties a chain that holds no references.
+ */
+void buf_chain_init(buf_chain *ch);
+
+/**
+ * buf_chain_add appends data[0..len), which has to stay valid until the
+ * chain is written or reset. Adjacent pieces are merged.
+ * returns -1 if the chain is full.
+ */
+int buf_chain_add(buf_chain *ch, const void *data, size_t len);
+
+/**
+ * buf_chain_hold makes the chain keep a reference to "s" until it is
+ * reset, for pieces pointing into it. returns -1 if it holds too many.
+ */
+int buf_chain_hold(buf_chain *ch, buf_seg *s);
+
+/**
+ * buf_chain_rewind starts writing the chain over from its first byte.
+ */
+void buf_chain_rewind(buf_chain *ch);
+
+/**
+ * buf_chain_write writes what is left of the chain to "fd" with writev
+ * (sendmsg for sockets, so a closed peer raises no SIGPIPE).
+ * returns 1 once everything is written, 0 if the socket would block
+ * and -1 with errno set on error.
+ */
+int buf_chain_write(buf_chain *ch, int fd);
+
+/**
+ * buf_chain_reset drops the chain's pieces and references.
+ */
+void buf_chain_reset(buf_pool *p, buf_chain *ch);
+
+#endif
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry *buckets[CACHE_BUCKETS];
+    cache_entry *lru_head;      // most recently used
+    cache_entry *lru_tail;      // evicted first
+    size_t bytes;
+} __attribute__((aligned(64)));
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t shard_budget;     // bytes per shard, 0 if the cache is off
+
+/**
+ * what the headers of a response say about storing it. Filled from
+ * the stored response and then from a 304 that revalidated it.
+ */
+struct policy {
+    int status;
+    int no_store;               // no-store, private, Vary or Set-Cookie
+    int no_cache;
+    long long max_age;          // -1 if absent
+    long long s_maxage;         // -1 if absent
+    long long age;              // Age header, 0 if absent
+    time_t date;                // -1 if absent
+    time_t expires;             // -1 if absent, 0 if unparseable
+    time_t last_modified;       // -1 if absent
+    int has_etag;
+};
+
+static unsigned hash_key(const char *s) {
+    unsigned h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT", returns -1 if it isn't one
+static time_t http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S", &tm);
+    if (end == NULL) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+static void policy_init(struct policy *p) {
+    memset(p, 0, sizeof(*p));
+    p->max_age = p->s_maxage = -1;
+    p->date = p->expires = p->last_modified = -1;
+}
+
+static void cache_control(struct policy *p, char *value) {
+    for (char *save, *token = strtok_r(value, ",", &save); token != NULL;
+         token = strtok_r(NULL, ",", &save)) {
+        while (*token == ' ' || *token == '\t') {
+            token++;
+        }
+        if (strncasecmp(token, "no-store", 8) == 0 || strncasecmp(token, "private", 7) == 0) {
+            p->no_store = 1;
+        } else if (strncasecmp(token, "no-cache", 8) == 0) {
+            p->no_cache = 1;
+        } else if (strncasecmp(token, "max-age=", 8) == 0) {
+            p->max_age = atoll(token + 8);
+        } else if (strncasecmp(token, "s-maxage=", 9) == 0) {
+            p->s_maxage = atoll(token + 9);
+        }
+    }
+}
+
+// reads head[0..len), which runs from the status line to the empty line
+static void parse_policy(struct policy *p, const char *head, size_t len) {
+    const char *end = head + len;
+    const char *line = head;
+    int first = 1;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        size_t line_len = (nl != NULL ? nl : end) - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%.*s", (int)line_len, line);
+        line = nl != NULL ? nl + 1 : end;
+
+        if (first) {
+            // "HTTP/1.1 200 OK", a revalidating 304 keeps the stored status
+            first = 0;
+            if (p->status == 0 && strncmp(buf, "HTTP/1.", 7) == 0 && buf[8] == ' ') {
+                p->status = atoi(buf + 9);
+            }
+            continue;
+        }
+        char *colon = strchr(buf, ':');
+        if (colon == NULL) {
+            continue;
+        }
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+
+        if (strcasecmp(buf, "Cache-Control") == 0) {
+            cache_control(p, value);
+        } else if (strcasecmp(buf, "Pragma") == 0) {
+            if (strcasestr(value, "no-cache") != NULL) {
+                p->no_cache = 1;
+            }
+        } else if (strcasecmp(buf, "Expires") == 0) {
+            p->expires = http_date(value);
+            if (p->expires < 0) {
+                p->expires = 0; // an invalid date means "already expired"
+            }
+        } else if (strcasecmp(buf, "Date") == 0) {
+            p->date = http_date(value);
+        } else if (strcasecmp(buf, "Age") == 0) {
+            p->age = atoll(value);
+        } else if (strcasecmp(buf, "Last-Modified") == 0) {
+            p->last_modified = http_date(value);
+        } else if (strcasecmp(buf, "ETag") == 0) {
+            p->has_etag = 1;
+        } else if (strcasecmp(buf, "Vary") == 0 || strcasecmp(buf, "Set-Cookie") == 0) {
+            p->no_store = 1; // one key can't hold variants or per-user state
+        }
+    }
+}
+
+// the wall clock time at which a response received at "now" goes stale
+static time_t policy_expires(const struct policy *p, time_t now) {
+    long long lifetime = 0;
+    if (p->no_cache) {
+        lifetime = 0;
+    } else if (p->s_maxage >= 0) {
+        lifetime = p->s_maxage;
+    } else if (p->max_age >= 0) {
+        lifetime = p->max_age;
+    } else if (p->expires >= 0) {
+        lifetime = p->expires - (p->date >= 0 ? p->date : now);
+    } else if (p->last_modified >= 0) {
+        lifetime = ((p->date >= 0 ? p->date : now) - p->last_modified) / 10;
+        if (lifetime > CACHE_HEURISTIC_MAX) {
+            lifetime = CACHE_HEURISTIC_MAX;
+        }
+    }
+    long long age = p->date >= 0 && now > p->date ? now - p->date : 0;
+    if (p->age > age) {
+        age = p->age;
+    }
+    return now + lifetime - age;
+}
+
+static int policy_storable(const struct policy *p, time_t now) {
+    if (p->status != 200 || p->no_store) {
+        return 0;
+    }
+    // a response that is stale right away is only useful if it can be revalidated
+    return policy_expires(p, now) > now || p->has_etag || p->last_modified >= 0;
+}
+
+static size_t header_length(const char *resp, size_t len) {
+    const char *end = memmem(resp, len, "\r\n\r\n", 4);
+    return end != NULL ? (size_t)(end - resp) + 4 : 0;
+}
+
+// copies the value of header "name" from head[0..len) into out
+static void header_value(const char *head, size_t len, const char *name, char *out, size_t out_len) {
+    size_t name_len = strlen(name);
+    out[0] = '\0';
+    for (const char *line = head; line != NULL && line < head + len; ) {
+        const char *nl = memchr(line, '\n', head + len - line);
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            size_t value_len = (nl != NULL ? nl : head + len) - value;
+            while (value_len > 0 && (value[value_len - 1] == '\r' || value[value_len - 1] == ' ')) {
+                value_len--;
+            }
+            if (value_len < out_len) {
+                memcpy(out, value, value_len);
+                out[value_len] = '\0';
+            }
+            return;
+        }
+        line = nl != NULL ? nl + 1 : NULL;
+    }
+}
+
+static size_t entry_charge(const cache_entry *e) {
+    return sizeof(*e) + e->len + strlen(e->key) + 1;
+}
+
+static void entry_free(cache_entry *e) {
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+// takes "e" out of the table and the LRU list. Shard lock held
+static void shard_unlink(struct cache_shard *shard, cache_entry *e) {
+    cache_entry **link = &shard->buckets[(e->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+    shard->bytes -= entry_charge(e);
+    cache_release(e);
+}
+
+static void lru_push_front(struct cache_shard *shard, cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+}
+
+void cache_init(size_t max_bytes) {
+    shard_budget = max_bytes / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+cache_entry *cache_lookup(const char *key, int *fresh) {
+    if (shard_budget == 0) {
+        return NULL;
+    }
+    unsigned h = hash_key(key);
+    struct cache_shard *shard = &shards[h % CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry *e = shard->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (e != NULL && (e->hash != h || strcmp(e->key, key) != 0)) {
+        e = e->next;
+    }
+    if (e != NULL) {
+        *fresh = time(NULL) < e->expires;
+        if (!*fresh && e->etag[0] == '\0' && e->last_modified[0] == '\0') {
+            shard_unlink(shard, e); // stale and can't be revalidated
+            e = NULL;
+        } else {
+            if (shard->lru_head != e) {
+                e->lru_prev->lru_next = e->lru_next;
+                if (e->lru_next != NULL) {
+                    e->lru_next->lru_prev = e->lru_prev;
+                } else {
+                    shard->lru_tail = e->lru_prev;
+                }
+                lru_push_front(shard, e);
+            }
+            atomic_fetch_add(&e->refs, 1);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e;
+}
+
+void cache_release(cache_entry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        entry_free(e);
+    }
+}
+
+int cache_storable(const char *resp, size_t len) {
+    size_t head_len = header_length(resp, len);
+    if (shard_budget == 0 || head_len == 0) {
+        return 0;
+    }
+    struct policy p;
+    policy_init(&p);
+    parse_policy(&p, resp, head_len);
+    return policy_storable(&p, time(NULL));
+}
+
+int cache_store(const char *key, const char *resp, size_t len, struct in_addr addr) {
+    if (shard_budget == 0 || len > CACHE_MAX_OBJECT) {
+        return 0;
+    }
+    size_t head_len = header_length(resp, len);
+    if (head_len == 0) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    struct policy p;
+    policy_init(&p);
+    parse_policy(&p, resp, head_len);
+    if (!policy_storable(&p, now)) {
+        return 0;
+    }
+
+    cache_entry *e = (cache_entry *)calloc(1, sizeof(cache_entry));
+    if (e == NULL) {
+        return 0;
+    }
+    e->key = strdup(key);
+    e->data = (char *)malloc(len);
+    if (e->key == NULL || e->data == NULL) {
+        entry_free(e);
+        return 0;
+    }
+    memcpy(e->data, resp, len);
+    e->len = len;
+    e->addr = addr;
+    header_value(resp, head_len, "ETag", e->etag, sizeof(e->etag));
+    header_value(resp, head_len, "Last-Modified", e->last_modified, sizeof(e->last_modified));
+    e->expires = policy_expires(&p, now);
+    e->hash = hash_key(key);
+    atomic_init(&e->refs, 1); // the shard's reference
+    if (entry_charge(e) > shard_budget) {
+        entry_free(e);
+        return 0;
+    }
+
+    struct cache_shard *shard = &shards[e->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry **bucket = &shard->buckets[(e->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    for (cache_entry *old = *bucket; old != NULL; old = old->next) {
+        if (old->hash == e->hash && strcmp(old->key, key) == 0) {
+            shard_unlink(shard, old); // readers holding it keep their copy
+            break;
+        }
+    }
+    e->next = *bucket;
+    *bucket = e;
+    lru_push_front(shard, e);
+    shard->bytes += entry_charge(e);
+    while (shard->bytes > shard_budget) {
+        shard_unlink(shard, shard->lru_tail);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+void cache_refresh(cache_entry *e, const char *resp, size_t len) {
+    time_t now = time(NULL);
+    struct policy p;
+    policy_init(&p);
+    parse_policy(&p, e->data, header_length(e->data, e->len));
+    // the 304's headers replace the stored ones
+    p.date = -1;
+    p.age = 0;
+    parse_policy(&p, resp, header_length(resp, len));
+
+    struct cache_shard *shard = &shards[e->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    e->expires = policy_expires(&p, now);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_shutdown(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &shards[i];
+        while (shard->lru_head != NULL) {
+            shard_unlink(shard, shard->lru_head);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    shard_budget = 0;
+}
@@ -0,0 +1,94 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/**
+ * cache.h
+ *
+ * In-memory cache of complete GET responses, keyed on
+ * "host:port/path".
+ *
+ * Freshness follows the origin's Cache-Control (s-maxage, max-age,
+ * no-cache), Expires and Age headers, with the usual 10% of the
+ * Last-Modified age as a heuristic. Stale entries that carry an ETag
+ * or Last-Modified are kept so the proxy can revalidate them with a
+ * conditional request; the rest are dropped.
+ *
+ * Entries live in CACHE_SHARDS shards, each with its own lock, hash
+ * table and byte-bounded LRU list. Lookups hold the shard lock only
+ * to take a reference, the response bytes are sent without it.
+ */
+
+#define CACHE_SHARDS 16                 // shards, each with its own lock
+#define CACHE_BUCKETS 1024              // hash buckets per shard
+#define CACHE_DEFAULT_MB 64             // total size unless PROXY_CACHE_MB says otherwise
+#define CACHE_MAX_OBJECT (1024 * 1024)  // largest response we store
+#define CACHE_MAX_VALIDATOR 256         // longest ETag / Last-Modified we keep
+#define CACHE_HEURISTIC_MAX (24 * 60 * 60) // cap for Last-Modified based freshness
+
+/**
+ * a stored response. Everything above "refs" is immutable once the
+ * entry is published, so it may be read while holding a reference.
+ */
+typedef struct cache_entry {
+    char *key;
+    char *data;                 // status line, headers and body as received
+    size_t len;
+    struct in_addr addr;        // origin address, for re-applying the IP filter
+    char etag[CACHE_MAX_VALIDATOR];          // "" if the origin sent none
+    char last_modified[CACHE_MAX_VALIDATOR]; // "" if the origin sent none
+
+    atomic_int refs;
+    time_t expires;             // wall clock, protected by the shard lock
+    unsigned hash;
+    struct cache_entry *next;   // hash chain
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry;
+
+/**
+ * cache_init sizes the cache to "max_bytes", 0 disables it.
+ */
+void cache_init(size_t max_bytes);
+
+/**
+ * cache_lookup returns a referenced entry for "key", or NULL.
+ * "*fresh" is 1 if the entry may be served as is, 0 if it is stale
+ * and has to be revalidated first.
+ */
+cache_entry *cache_lookup(const char *key, int *fresh);
+
+/**
+ * cache_release drops a reference taken by cache_lookup.
+ */
+void cache_release(cache_entry *e);
+
+/**
+ * cache_storable looks at the header at the start of resp[0..len)
+ * and returns 1 if the complete response may be stored, 0 if not or
+ * if the header is not complete yet.
+ */
+int cache_storable(const char *resp, size_t len);
+
+/**
+ * cache_store stores a complete response for "key", replacing any
+ * older one. returns 1 if it was stored.
+ */
+int cache_store(const char *key, const char *resp, size_t len, struct in_addr addr);
+
+/**
+ * cache_refresh applies the headers of a 304 (resp[0..len)) that
+ * answered a revalidation of "e", making it fresh again.
+ */
+void cache_refresh(cache_entry *e, const char *resp, size_t len);
+
+/**
+ * cache_shutdown frees every entry not referenced anymore.
+ */
+void cache_shutdown(void);
+
+#endif
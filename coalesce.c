@@ -0,0 +1,254 @@
+#include "coalesce.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct coalesce_chunk {
+    struct coalesce_chunk *next;
+    size_t len;                 // bytes of data filled, under the fill's lock
+    char data[COALESCE_CHUNK];
+};
+
+struct coalesce_fill {
+    pthread_mutex_t lock;       // protects everything above "shard"
+    int refs;                   // the leader while it fetches, and every waiter
+    int published;
+    int ended;
+    int complete;
+    struct in_addr addr;
+    struct coalesce_chunk *head;
+    struct coalesce_chunk *tail;
+    coalesce_waiter *waiters;
+
+    struct coalesce_shard *shard;
+    unsigned hash;
+    struct coalesce_fill *next; // hash chain, under the shard lock
+    char key[];
+};
+
+struct coalesce_shard {
+    pthread_mutex_t lock;
+    coalesce_fill *buckets[COALESCE_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct coalesce_shard shards[COALESCE_SHARDS] = {
+    [0 ... COALESCE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static atomic_ulong fills_total;
+static atomic_ulong attached_total;
+static atomic_ulong shared_total;
+
+static unsigned hash_key(const char *s) {
+    unsigned h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// drops a reference, the last one frees the fill and its bytes
+static void fill_put(coalesce_fill *f) {
+    pthread_mutex_lock(&f->lock);
+    int last = --f->refs == 0;
+    pthread_mutex_unlock(&f->lock);
+    if (!last) {
+        return;
+    }
+    struct coalesce_chunk *chunk = f->head;
+    while (chunk != NULL) {
+        struct coalesce_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+// tells every waiter not told yet that there is news, fill lock held
+static void notify(coalesce_fill *f) {
+    for (coalesce_waiter *w = f->waiters; w != NULL; w = w->next) {
+        if (!w->notified) {
+            w->notified = 1;
+            w->ready(w);
+        }
+    }
+}
+
+coalesce_fill *coalesce_join(const char *key, coalesce_waiter *w, int notified, int *leader) {
+    unsigned h = hash_key(key);
+    struct coalesce_shard *shard = &shards[h % COALESCE_SHARDS];
+    coalesce_fill **bucket = &shard->buckets[(h / COALESCE_SHARDS) % COALESCE_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (coalesce_fill *f = *bucket; f != NULL; f = f->next) {
+        if (f->hash == h && strcmp(f->key, key) == 0) {
+            // an ending fill leaves the table under this lock first, so this one takes waiters
+            pthread_mutex_lock(&f->lock);
+            f->refs++;
+            w->notified = notified;
+            w->chunk = NULL;
+            w->off = 0;
+            w->prev = NULL;
+            w->next = f->waiters;
+            if (f->waiters != NULL) {
+                f->waiters->prev = w;
+            }
+            f->waiters = w;
+            pthread_mutex_unlock(&f->lock);
+            pthread_mutex_unlock(&shard->lock);
+            atomic_fetch_add(&attached_total, 1);
+            *leader = 0;
+            return f;
+        }
+    }
+
+    size_t key_len = strlen(key);
+    coalesce_fill *f = (coalesce_fill *)calloc(1, sizeof(*f) + key_len + 1);
+    if (f == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        perror("error: malloc");
+        return NULL;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    f->refs = 1;
+    f->shard = shard;
+    f->hash = h;
+    memcpy(f->key, key, key_len + 1);
+    f->next = *bucket;
+    *bucket = f;
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(&fills_total, 1);
+    *leader = 1;
+    return f;
+}
+
+int coalesce_append(coalesce_fill *f, const char *data, size_t len) {
+    pthread_mutex_lock(&f->lock);
+    while (len > 0) {
+        struct coalesce_chunk *tail = f->tail;
+        if (tail == NULL || tail->len == COALESCE_CHUNK) {
+            tail = (struct coalesce_chunk *)malloc(sizeof(*tail));
+            if (tail == NULL) {
+                pthread_mutex_unlock(&f->lock);
+                perror("error: malloc");
+                return -1;
+            }
+            tail->next = NULL;
+            tail->len = 0;
+            if (f->tail != NULL) {
+                f->tail->next = tail;
+            } else {
+                f->head = tail;
+            }
+            f->tail = tail;
+        }
+        size_t n = COALESCE_CHUNK - tail->len < len ? COALESCE_CHUNK - tail->len : len;
+        memcpy(tail->data + tail->len, data, n);
+        tail->len += n;
+        data += n;
+        len -= n;
+    }
+    if (f->published) {
+        notify(f);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+}
+
+void coalesce_publish(coalesce_fill *f, struct in_addr addr) {
+    pthread_mutex_lock(&f->lock);
+    if (!f->published && !f->ended) {
+        f->published = 1;
+        f->addr = addr;
+        notify(f);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+void coalesce_end(coalesce_fill *f, int complete) {
+    struct coalesce_shard *shard = f->shard;
+    pthread_mutex_lock(&shard->lock);
+    coalesce_fill **link = &shard->buckets[(f->hash / COALESCE_SHARDS) % COALESCE_BUCKETS];
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_mutex_lock(&f->lock);
+    f->ended = 1;
+    f->complete = complete;
+    notify(f);
+    pthread_mutex_unlock(&f->lock);
+    fill_put(f);
+}
+
+int coalesce_read(coalesce_fill *f, coalesce_waiter *w, const char **data, size_t *len,
+                  struct in_addr *addr) {
+    *len = 0;
+    pthread_mutex_lock(&f->lock);
+    int rc;
+    if (!f->published) {
+        rc = f->ended ? COALESCE_UNSHARED : COALESCE_WAIT;
+    } else {
+        if (w->chunk == NULL) {
+            w->chunk = f->head;
+            w->off = 0;
+        }
+        while (w->chunk != NULL && w->off == w->chunk->len && w->chunk->next != NULL) {
+            w->chunk = w->chunk->next;
+            w->off = 0;
+        }
+        if (w->chunk != NULL && w->off < w->chunk->len) {
+            *data = w->chunk->data + w->off;
+            *len = w->chunk->len - w->off;
+            rc = COALESCE_DATA;
+        } else if (!f->ended) {
+            rc = COALESCE_WAIT;
+        } else {
+            rc = f->complete ? COALESCE_DONE : COALESCE_BROKEN;
+        }
+        *addr = f->addr;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+void coalesce_consume(coalesce_fill *f, coalesce_waiter *w, size_t n) {
+    (void)f; // only the waiter's thread moves its position
+    w->off += n;
+}
+
+void coalesce_ack(coalesce_fill *f, coalesce_waiter *w) {
+    pthread_mutex_lock(&f->lock);
+    w->notified = 0;
+    pthread_mutex_unlock(&f->lock);
+}
+
+int coalesce_leave(coalesce_fill *f, coalesce_waiter *w, int shared) {
+    pthread_mutex_lock(&f->lock);
+    if (w->prev != NULL) {
+        w->prev->next = w->next;
+    } else {
+        f->waiters = w->next;
+    }
+    if (w->next != NULL) {
+        w->next->prev = w->prev;
+    }
+    int notified = w->notified;
+    pthread_mutex_unlock(&f->lock);
+    if (shared) {
+        atomic_fetch_add(&shared_total, 1);
+    }
+    fill_put(f);
+    return notified;
+}
+
+void coalesce_get_stats(coalesce_stats *st) {
+    st->fills = atomic_load(&fills_total);
+    st->attached = atomic_load(&attached_total);
+    st->shared = atomic_load(&shared_total);
+}
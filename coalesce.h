@@ -0,0 +1,122 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+/**
+ * coalesce.h
+ *
+ * Collapsed forwarding: while one request (the leader) fetches a
+ * cacheable response, identical requests for the same cache key
+ * attach to its fetch (a fill) instead of going to the origin
+ * themselves, and are sent the response bytes as they come in.
+ *
+ * The leader appends what it relays. Waiters are given nothing until
+ * the leader published the fill, that is until the response turned
+ * out to be one the cache would store: a response meant for the
+ * leader's client alone is never shared. A fill that ends without
+ * being published tells its waiters to fetch on their own.
+ *
+ * Bytes go into COALESCE_CHUNK chunks that never move, so waiters on
+ * other loops send straight out of them. Fills live in COALESCE_SHARDS
+ * shards with a lock each, every fill has a lock of its own for its
+ * bytes and waiters.
+ */
+
+#define COALESCE_SHARDS 16              // fill table shards, each with its own lock
+#define COALESCE_BUCKETS 64             // hash buckets per shard
+#define COALESCE_CHUNK (16 * 1024)      // response bytes per chunk
+
+// coalesce_read results
+#define COALESCE_WAIT 0         // nothing new yet, "ready" is called when there is
+#define COALESCE_DATA 1         // bytes to send
+#define COALESCE_DONE 2         // the whole response was read
+#define COALESCE_UNSHARED 3     // the fill ended without being published, fetch it yourself
+#define COALESCE_BROKEN 4       // the leader's fetch failed after it was published
+
+typedef struct coalesce_fill coalesce_fill;
+
+/**
+ * a request attached to a fill. "ready" is called on the leader's
+ * thread once there is something new to read; it is not called again
+ * until coalesce_ack says the waiter looked.
+ */
+typedef struct coalesce_waiter {
+    void (*ready)(struct coalesce_waiter *w);
+    void *arg;
+    int notified;               // "ready" was called and not acknowledged yet
+    struct coalesce_chunk *chunk; // where the waiter reads, NULL before the first byte
+    size_t off;                 // bytes of "chunk" already read
+    struct coalesce_waiter *prev;
+    struct coalesce_waiter *next;
+} coalesce_waiter;
+
+typedef struct coalesce_stats {
+    unsigned long fills;        // fetches other requests could attach to
+    unsigned long attached;     // requests that attached to one
+    unsigned long shared;       // attached requests answered from a fill
+} coalesce_stats;
+
+/**
+ * coalesce_join looks for a fill of "key". If there is one, "w" is
+ * attached to it and *leader set to 0; if not, a fill is started with
+ * the caller as its leader and *leader set to 1. "notified" is the
+ * initial w->notified, 1 if a call of w->ready is still outstanding.
+ * returns the fill, or NULL if out of memory.
+ */
+coalesce_fill *coalesce_join(const char *key, coalesce_waiter *w, int notified, int *leader);
+
+/**
+ * coalesce_append adds response bytes, leader only.
+ * returns -1 if out of memory, the leader should then end the fill.
+ */
+int coalesce_append(coalesce_fill *f, const char *data, size_t len);
+
+/**
+ * coalesce_publish lets waiters have the response, whose origin is at
+ * "addr" (for the IP filter). Leader only, once the response is known
+ * to be storable.
+ */
+void coalesce_publish(coalesce_fill *f, struct in_addr addr);
+
+/**
+ * coalesce_end takes the fill out of the table and drops the leader's
+ * reference. "complete" says every byte of the response was appended.
+ * Waiters carry on reading what is there.
+ */
+void coalesce_end(coalesce_fill *f, int complete);
+
+/**
+ * coalesce_read points *data at the next *len bytes "w" has not read,
+ * which stay valid until the waiter leaves. Reading them is
+ * acknowledged with coalesce_consume. *addr is set once published.
+ * returns one of the COALESCE_ results above.
+ */
+int coalesce_read(coalesce_fill *f, coalesce_waiter *w, const char **data, size_t *len,
+                  struct in_addr *addr);
+
+/**
+ * coalesce_consume marks "n" bytes returned by coalesce_read as read.
+ */
+void coalesce_consume(coalesce_fill *f, coalesce_waiter *w, size_t n);
+
+/**
+ * coalesce_ack says a call of w->ready was handled, the next news
+ * calls it again.
+ */
+void coalesce_ack(coalesce_fill *f, coalesce_waiter *w);
+
+/**
+ * coalesce_leave detaches "w" and drops its reference. "shared" counts
+ * it as answered from the fill.
+ * returns 1 if a call of w->ready may still be on its way.
+ */
+int coalesce_leave(coalesce_fill *f, coalesce_waiter *w, int shared);
+
+/**
+ * coalesce_get_stats copies the counters since startup.
+ */
+void coalesce_get_stats(coalesce_stats *st);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef CORO_H
+#define CORO_H
+
+/**
+ * coro.h
+ *
+ * Stackless coroutines for code that runs on an event loop, in the
+ * style of protothreads. A coroutine is an ordinary function whose
+ * body sits between CORO_BEGIN and CORO_END and which is called again
+ * every time something it may be waiting for happened; it picks up at
+ * the await it stopped in, which checks its condition again and
+ * either returns to the loop or carries on.
+ *
+ * A suspended coroutine is the line number in its coro and nothing
+ * else: there is no stack to keep, so local variables do not survive
+ * a suspension and whatever must is kept in the object the coroutine
+ * works on. A local assigned in an await's condition is fine to use
+ * right after it, the condition is the last thing evaluated before
+ * carrying on.
+ *
+ * Awaits are case labels of a switch around the body: at most one per
+ * source line, and none inside a switch of the coroutine's own.
+ */
+
+typedef struct coro {
+    int line;                   // of the await to carry on at, 0 to start from the top
+} coro;
+
+/**
+ * CORO_INIT makes the next call run the coroutine from its start.
+ */
+#define CORO_INIT(co) ((co)->line = 0)
+
+/**
+ * CORO_BEGIN goes back to the await the coroutine last stopped in.
+ */
+#define CORO_BEGIN(co) switch ((co)->line) { case 0:
+
+/**
+ * CORO_END closes the body opened by CORO_BEGIN.
+ */
+#define CORO_END(co) }
+
+/**
+ * CORO_AWAIT returns from the coroutine until "cond" is true, the
+ * coroutine's function must return void.
+ */
+#define CORO_AWAIT(co, cond)                    \
+    do {                                        \
+        if (0) {                                \
+            case __LINE__:;                     \
+        }                                       \
+        if (!(cond)) {                          \
+            (co)->line = __LINE__;              \
+            return;                             \
+        }                                       \
+    } while (0)
+
+#endif
@@ -0,0 +1,637 @@
+#include "dns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+#define DNS_BUCKETS 1024      // hash buckets per shard
+#define DNS_TIMEOUT_MS 1000   // wait per UDP attempt
+#define DNS_TRIES 3           // UDP attempts before giving up
+#define DNS_MAX_PACKET 1232   // largest UDP answer we accept
+#define DNS_RANDOM_IDS 128    // query IDs taken from the kernel at a time
+
+enum { ENTRY_PENDING, ENTRY_RESOLVED };
+
+struct dns_entry {
+    char name[DNS_MAX_NAME];
+    uint32_t hash;
+    int state;
+    int status;
+    struct in_addr addr;
+    time_t expires;              // monotonic seconds
+    dns_query *waiters;          // queries sharing this lookup
+    struct dns_entry *next;      // hash chain
+    struct dns_shard *shard;
+    tp_bounded_job job;          // getaddrinfo mode: the lookup on the pool
+
+    // UDP mode only
+    int fd;                      // the query's own socket, a fresh source port
+    uint16_t id;
+    int tries;
+    struct timespec deadline;
+    struct dns_entry *io_next;   // submitted / in flight list
+};
+
+struct dns_shard {
+    pthread_mutex_t lock;
+    struct dns_entry *buckets[DNS_BUCKETS];
+    int count;
+} __attribute__((aligned(64)));
+
+static struct dns_shard shards[DNS_SHARDS];
+static threadpool *lookup_pool;
+
+// UDP resolver thread state
+static int udp_on;
+static struct sockaddr_in server_addr;
+static int wake_fd = -1;
+static pthread_t udp_thread;
+static atomic_int udp_stop;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dns_entry *submitted;    // protected by submit_lock
+static struct dns_entry *inflight;     // resolver thread only
+static int inflight_count;             // resolver thread only
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// lowercase, drop ":port" and a trailing dot. returns -1 if too long
+static int normalize(const char *name, char *out) {
+    size_t len = 0;
+    while (name[len] != '\0' && name[len] != ':') {
+        if (len == DNS_MAX_NAME - 1)
+            return -1;
+        out[len] = (char)tolower((unsigned char)name[len]);
+        len++;
+    }
+    if (len > 0 && out[len - 1] == '.')
+        len--;
+    out[len] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+// drops expired entries, or any settled entry if none has expired
+static void shard_evict(struct dns_shard *shard, time_t now) {
+    int evicted = 0;
+    struct dns_entry *victim = NULL, **victim_link = NULL;
+    for (int b = 0; b < DNS_BUCKETS; b++) {
+        struct dns_entry **link = &shard->buckets[b];
+        while (*link != NULL) {
+            struct dns_entry *e = *link;
+            if (e->state == ENTRY_RESOLVED && e->expires <= now) {
+                *link = e->next;
+                free(e);
+                shard->count--;
+                evicted++;
+                continue;
+            }
+            if (victim == NULL && e->state == ENTRY_RESOLVED) {
+                victim = e;
+                victim_link = link;
+            }
+            link = &e->next;
+        }
+    }
+    if (evicted == 0 && victim != NULL) {
+        *victim_link = victim->next;
+        free(victim);
+        shard->count--;
+    }
+}
+
+// stores the answer and wakes every query waiting on the entry
+static void entry_complete(struct dns_entry *e, int status, struct in_addr addr, uint32_t ttl) {
+    struct dns_shard *shard = e->shard;
+    pthread_mutex_lock(&shard->lock);
+    e->state = ENTRY_RESOLVED;
+    e->status = status;
+    e->addr = addr;
+    e->expires = now_secs() + ttl;
+    dns_query *waiters = e->waiters;
+    e->waiters = NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    while (waiters != NULL) {
+        dns_query *next = waiters->next;
+        waiters->status = status;
+        waiters->addr = addr;
+        waiters->done(waiters);
+        waiters = next;
+    }
+}
+
+// getaddrinfo mode: runs on the threadpool
+static int lookup_job(void *arg) {
+    struct dns_entry *e = (struct dns_entry *)arg;
+    struct in_addr addr = {0};
+    int status = DNS_OK;
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(e->name, NULL, &hints, &res);
+    if (rc == 0 && res != NULL) {
+        addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    } else {
+        status = rc == EAI_NONAME ? DNS_NOTFOUND : DNS_FAILED;
+    }
+    entry_complete(e, status, addr, status == DNS_OK ? DNS_DEFAULT_TTL : DNS_NEGATIVE_TTL);
+    return 0;
+}
+
+// getaddrinfo mode: the pool dropped the lookup, it waited too long
+static int lookup_dropped(void *arg) {
+    struct in_addr none = {0};
+    entry_complete((struct dns_entry *)arg, DNS_BUSY, none, 0); // not cached
+    return 0;
+}
+
+static void start_lookup(struct dns_entry *e) {
+    if (!udp_on) {
+        e->job.routine = lookup_job;
+        e->job.dropped = lookup_dropped;
+        e->job.arg = e;
+        if (dispatch_bounded(lookup_pool, &e->job) != 0) {
+            lookup_dropped(e);
+        }
+        return;
+    }
+    pthread_mutex_lock(&submit_lock);
+    e->io_next = submitted;
+    submitted = e;
+    pthread_mutex_unlock(&submit_lock);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("error: eventfd write");
+}
+
+int dns_resolve(const char *name, dns_query *q) {
+    char key[DNS_MAX_NAME];
+    if (normalize(name, key) != 0) {
+        q->status = DNS_FAILED;
+        return 1;
+    }
+    // literal addresses need no lookup
+    if (inet_pton(AF_INET, key, &q->addr) == 1) {
+        q->status = DNS_OK;
+        return 1;
+    }
+
+    uint32_t h = hash_name(key);
+    struct dns_shard *shard = &shards[h % DNS_SHARDS];
+    time_t now = now_secs();
+
+    pthread_mutex_lock(&shard->lock);
+    struct dns_entry *e = shard->buckets[(h / DNS_SHARDS) % DNS_BUCKETS];
+    while (e != NULL && (e->hash != h || strcmp(e->name, key) != 0))
+        e = e->next;
+
+    if (e != NULL && e->state == ENTRY_RESOLVED && e->expires > now) {
+        q->status = e->status;
+        q->addr = e->addr;
+        pthread_mutex_unlock(&shard->lock);
+        return 1;
+    }
+    if (e != NULL && e->state == ENTRY_PENDING) {
+        // someone is already asking, wait for the same answer
+        q->next = e->waiters;
+        e->waiters = q;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    if (e == NULL) {
+        if (shard->count >= DNS_SHARD_MAX)
+            shard_evict(shard, now);
+        e = (struct dns_entry *)calloc(1, sizeof(struct dns_entry));
+        if (e == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            perror("error: malloc");
+            q->status = DNS_FAILED;
+            return 1;
+        }
+        strcpy(e->name, key);
+        e->hash = h;
+        e->shard = shard;
+        struct dns_entry **bucket = &shard->buckets[(h / DNS_SHARDS) % DNS_BUCKETS];
+        e->next = *bucket;
+        *bucket = e;
+        shard->count++;
+    }
+    // new or expired: this query starts the lookup
+    e->state = ENTRY_PENDING;
+    q->next = NULL;
+    e->waiters = q;
+    pthread_mutex_unlock(&shard->lock);
+
+    start_lookup(e);
+    return 0;
+}
+
+static int build_query(uint8_t *buf, uint16_t id, const char *name) {
+    memset(buf, 0, 12);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = 0x01; // recursion desired
+    buf[5] = 1;    // one question
+
+    uint8_t *p = buf + 12;
+    const char *label = name;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63)
+            return -1;
+        *p++ = (uint8_t)len;
+        memcpy(p, label, len);
+        p += len;
+        label += len;
+        if (*label == '.')
+            label++;
+    }
+    *p++ = 0;
+    *p++ = 0; *p++ = 1; // QTYPE A
+    *p++ = 0; *p++ = 1; // QCLASS IN
+    return (int)(p - buf);
+}
+
+static int skip_name(const uint8_t *msg, int len, int off) {
+    while (off < len) {
+        uint8_t l = msg[off];
+        if (l == 0)
+            return off + 1;
+        if ((l & 0xc0) == 0xc0)
+            return off + 2 <= len ? off + 2 : -1;
+        if (l & 0xc0)
+            return -1;
+        off += l + 1;
+    }
+    return -1;
+}
+
+/**
+ * checks that the question at msg[off..) is the one we asked: "name",
+ * type A, class IN. returns the offset after it, -1 if it is not
+ */
+static int match_question(const uint8_t *msg, int len, int off, const char *name) {
+    const char *label = name;
+    while (1) {
+        if (off >= len)
+            return -1;
+        uint8_t l = msg[off++];
+        if (l == 0)
+            break;
+        // we send no compression pointers, so a copy of the question has none
+        size_t want = strcspn(label, ".");
+        if (l > 63 || off + l > len || want != l || strncasecmp(label, (const char *)msg + off, l) != 0)
+            return -1;
+        off += l;
+        label += l;
+        if (*label == '.')
+            label++;
+    }
+    if (*label != '\0' || off + 4 > len || msg[off] != 0 || msg[off + 1] != 1 || msg[off + 2] != 0
+        || msg[off + 3] != 1)
+        return -1;
+    return off + 4;
+}
+
+/**
+ * parses the answer to the A query of "e".
+ * returns -1 if malformed or an answer to anything else (another ID or
+ * question), otherwise sets status, addr and ttl (the smallest TTL on
+ * the CNAME/A chain)
+ */
+static int parse_response(const uint8_t *msg, int len, const struct dns_entry *e, int *status,
+                          struct in_addr *addr, uint32_t *ttl) {
+    if (len < 12 || !(msg[2] & 0x80) || (uint16_t)(msg[0] << 8 | msg[1]) != e->id)
+        return -1;
+    int rcode = msg[3] & 0x0f;
+    int qdcount = msg[4] << 8 | msg[5];
+    int ancount = msg[6] << 8 | msg[7];
+    if (qdcount != 1)
+        return -1;
+    int off = match_question(msg, len, 12, e->name);
+    if (off < 0)
+        return -1;
+
+    int found = 0;
+    uint32_t min_ttl = UINT32_MAX;
+    for (int i = 0; i < ancount; i++) {
+        off = skip_name(msg, len, off);
+        if (off < 0 || off + 10 > len)
+            return -1;
+        int type = msg[off] << 8 | msg[off + 1];
+        int cls = msg[off + 2] << 8 | msg[off + 3];
+        uint32_t rttl = (uint32_t)msg[off + 4] << 24 | msg[off + 5] << 16 | msg[off + 6] << 8 | msg[off + 7];
+        int rdlen = msg[off + 8] << 8 | msg[off + 9];
+        off += 10;
+        if (off + rdlen > len)
+            return -1;
+        if (cls == 1 && (type == 1 || type == 5) && rttl < min_ttl)
+            min_ttl = rttl;
+        if (cls == 1 && type == 1 && rdlen == 4 && !found) {
+            memcpy(&addr->s_addr, msg + off, 4);
+            found = 1;
+        }
+        off += rdlen;
+    }
+
+    if (found) {
+        *status = DNS_OK;
+        *ttl = min_ttl;
+    } else {
+        *status = rcode == 0 || rcode == 3 ? DNS_NOTFOUND : DNS_FAILED;
+        *ttl = DNS_NEGATIVE_TTL;
+    }
+    return 0;
+}
+
+/**
+ * returns a query ID from the kernel's random source, -1 if it has none.
+ * IDs are fetched a batch at a time, one getrandom per DNS_RANDOM_IDS
+ */
+static int random_id(void) {
+    static uint16_t ids[DNS_RANDOM_IDS];
+    static int left;
+    while (left == 0) {
+        if (getrandom(ids, sizeof(ids), 0) == (ssize_t)sizeof(ids)) {
+            left = DNS_RANDOM_IDS;
+        } else if (errno != EINTR) {
+            perror("error: getrandom");
+            return -1;
+        }
+    }
+    return ids[--left];
+}
+
+/**
+ * a socket connected to the server for one query: the kernel binds it
+ * to a random ephemeral port, and only the server's datagrams to that
+ * port reach it. returns -1 on failure
+ */
+static int open_query_socket(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        perror("error: dns socket");
+    return fd;
+}
+
+static void send_query(struct dns_entry *e) {
+    uint8_t buf[DNS_MAX_NAME + 32];
+    int len = build_query(buf, e->id, e->name);
+    if (len < 0 || send(e->fd, buf, len, 0) < 0) {
+        if (len >= 0)
+            perror("error: dns send");
+        e->tries = DNS_TRIES; // give up at the next timeout scan
+    }
+    clock_gettime(CLOCK_MONOTONIC, &e->deadline);
+    e->deadline.tv_sec += DNS_TIMEOUT_MS / 1000;
+    e->deadline.tv_nsec += (DNS_TIMEOUT_MS % 1000) * 1000000L;
+    if (e->deadline.tv_nsec >= 1000000000L) {
+        e->deadline.tv_sec++;
+        e->deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+// the query is over: it leaves the in-flight list and closes its socket
+static void unlink_inflight(struct dns_entry *e) {
+    for (struct dns_entry **link = &inflight; *link != NULL; link = &(*link)->io_next) {
+        if (*link == e) {
+            *link = e->io_next;
+            break;
+        }
+    }
+    inflight_count--;
+    close(e->fd);
+    e->fd = -1;
+}
+
+/**
+ * starts the UDP query of a submitted entry, "fds" and "owners" having
+ * room for it. returns -1 if it could not be sent at all
+ */
+static int start_query(struct dns_entry *e) {
+    int id = random_id();
+    if (id < 0)
+        return -1;
+    e->fd = open_query_socket();
+    if (e->fd < 0)
+        return -1;
+    e->id = (uint16_t)id;
+    e->tries = 1;
+    e->io_next = inflight;
+    inflight = e;
+    inflight_count++;
+    send_query(e);
+    return 0;
+}
+
+static void *run_udp_resolver(void *arg) {
+    (void)arg;
+    // wake_fd first, then one socket per query in flight
+    struct pollfd *fds = NULL;
+    struct dns_entry **owners = NULL;
+    int cap = 0;
+
+    while (!atomic_load(&udp_stop)) {
+        while (inflight_count + 1 > cap) {
+            int grown = cap > 0 ? cap * 2 : 64;
+            struct pollfd *f = (struct pollfd *)realloc(fds, grown * sizeof(*fds));
+            if (f != NULL)
+                fds = f;
+            struct dns_entry **o = (struct dns_entry **)realloc(owners, grown * sizeof(*owners));
+            if (o != NULL)
+                owners = o;
+            if (f == NULL || o == NULL) {
+                // the queries that do not fit are not read, they time out
+                perror("error: malloc");
+                break;
+            }
+            cap = grown;
+        }
+        if (cap == 0) {
+            break;
+        }
+        int n = 1;
+        fds[0].fd = wake_fd;
+        fds[0].events = POLLIN;
+        for (struct dns_entry *e = inflight; e != NULL && n < cap; e = e->io_next, n++) {
+            fds[n].fd = e->fd;
+            fds[n].events = POLLIN;
+            owners[n] = e;
+        }
+        if (poll(fds, n, 100) < 0) {
+            if (errno != EINTR) {
+                perror("error: poll");
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 1; i < n; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            // an error (the server's port unreachable) is read and dropped, the query retries
+            struct dns_entry *e = owners[i];
+            uint8_t msg[DNS_MAX_PACKET];
+            ssize_t len;
+            while ((len = recv(e->fd, msg, sizeof(msg), 0)) > 0 || (len < 0 && errno == ECONNREFUSED)) {
+                int status;
+                struct in_addr addr = {0};
+                uint32_t ttl;
+                if (len < 0 || parse_response(msg, (int)len, e, &status, &addr, &ttl) != 0)
+                    continue; // malformed, late or not the answer to our question
+                unlink_inflight(e);
+                entry_complete(e, status, addr, ttl);
+                break;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            while (read(wake_fd, &count, sizeof(count)) > 0) {
+            }
+            pthread_mutex_lock(&submit_lock);
+            struct dns_entry *list = submitted;
+            submitted = NULL;
+            pthread_mutex_unlock(&submit_lock);
+            while (list != NULL) {
+                struct dns_entry *e = list;
+                list = list->io_next;
+                if (start_query(e) != 0) {
+                    struct in_addr none = {0};
+                    entry_complete(e, DNS_FAILED, none, 0); // not cached
+                }
+            }
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct dns_entry *e = inflight;
+        while (e != NULL) {
+            struct dns_entry *next = e->io_next;
+            if (now.tv_sec > e->deadline.tv_sec
+                || (now.tv_sec == e->deadline.tv_sec && now.tv_nsec >= e->deadline.tv_nsec)) {
+                if (e->tries < DNS_TRIES) {
+                    e->tries++;
+                    send_query(e);
+                } else {
+                    struct in_addr none = {0};
+                    unlink_inflight(e);
+                    entry_complete(e, DNS_FAILED, none, 0); // don't cache timeouts
+                }
+            }
+            e = next;
+        }
+    }
+    while (inflight != NULL)
+        unlink_inflight(inflight);
+    free(fds);
+    free(owners);
+    return NULL;
+}
+
+int dns_init(threadpool *pool, const char *server) {
+    lookup_pool = pool;
+    for (int i = 0; i < DNS_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    if (server == NULL || *server == '\0')
+        return 0;
+
+    char host[64];
+    int port = 53;
+    snprintf(host, sizeof(host), "%s", server);
+    char *colon = strchr(host, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid DNS server address: %s\n", server);
+        return -1;
+    }
+
+    // queries open sockets of their own, one now tells whether they can
+    int probe = open_query_socket();
+    if (probe < 0 || random_id() < 0) {
+        if (probe >= 0)
+            close(probe);
+        return -1;
+    }
+    close(probe);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        perror("error: eventfd");
+        return -1;
+    }
+
+    atomic_store(&udp_stop, 0);
+    if (pthread_create(&udp_thread, NULL, run_udp_resolver, NULL) != 0) {
+        perror("error: thread creation");
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    udp_on = 1;
+    return 0;
+}
+
+void dns_shutdown(void) {
+    if (udp_on) {
+        atomic_store(&udp_stop, 1);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            perror("error: eventfd write");
+        pthread_join(udp_thread, NULL);
+        close(wake_fd);
+        wake_fd = -1;
+        udp_on = 0;
+    }
+    for (int i = 0; i < DNS_SHARDS; i++) {
+        for (int b = 0; b < DNS_BUCKETS; b++) {
+            struct dns_entry *e = shards[i].buckets[b];
+            while (e != NULL) {
+                struct dns_entry *next = e->next;
+                free(e);
+                e = next;
+            }
+            shards[i].buckets[b] = NULL;
+        }
+        shards[i].count = 0;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
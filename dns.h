@@ -0,0 +1,70 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <netinet/in.h>
+#include "threadpool.h"
+
+/**
+ * dns.h
+ *
+ * Asynchronous IPv4 resolver with a sharded cache.
+ *
+ * Lookups never run on the caller's thread. Either they are
+ * getaddrinfo jobs on the threadpool (cached for DNS_DEFAULT_TTL,
+ * since getaddrinfo does not report TTLs), or, when a server is
+ * configured, a resolver thread sends A queries over UDP and caches
+ * the answers for the TTL the server returned. Each query goes out
+ * from a socket of its own, so from a random source port, with an ID
+ * from getrandom; an answer counts only if it arrives on that socket
+ * with that ID and repeats the question asked. Concurrent lookups of
+ * the same name share one query. Failures are cached for
+ * DNS_NEGATIVE_TTL seconds. getaddrinfo jobs are bounded jobs: when
+ * the pool refuses or drops one, its queries end with DNS_BUSY, which
+ * is not cached.
+ */
+
+#define DNS_MAX_NAME 256      // longest name we resolve
+#define DNS_DEFAULT_TTL 60    // seconds, for getaddrinfo answers
+#define DNS_NEGATIVE_TTL 5    // seconds to remember a failed lookup
+#define DNS_SHARDS 16         // cache shards, each with its own lock
+#define DNS_SHARD_MAX 4096    // cached names per shard
+
+// query status
+#define DNS_OK 0
+#define DNS_NOTFOUND 1        // NXDOMAIN or no A record
+#define DNS_FAILED 2          // timeout, bad name or server error
+#define DNS_BUSY 3            // the pool had no room for the lookup, try again later
+
+/**
+ * a pending lookup, normally embedded in the object waiting for it.
+ * "done" is called on a resolver thread once status and addr are set.
+ */
+typedef struct dns_query {
+    void (*done)(struct dns_query *q);
+    void *arg;
+    int status;
+    struct in_addr addr;
+    struct dns_query *next;
+} dns_query;
+
+/**
+ * dns_init starts the resolver. With "server" ("ip" or "ip:port")
+ * queries are sent over UDP to it, otherwise getaddrinfo runs as
+ * jobs on "pool". returns 0 on success, -1 on failure.
+ */
+int dns_init(threadpool *pool, const char *server);
+
+/**
+ * dns_resolve looks "name" up, a ":port" suffix is ignored.
+ * returns 1 if the answer was already known (q->status and q->addr
+ * are set and q->done is not called), 0 if q->done will be called
+ * later, which may be before dns_resolve returns (DNS_BUSY).
+ */
+int dns_resolve(const char *name, dns_query *q);
+
+/**
+ * dns_shutdown stops the resolver thread and frees the cache.
+ */
+void dns_shutdown(void);
+
+#endif
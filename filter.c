@@ -0,0 +1,385 @@
+#include "filter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#define FILTER_MAX_NAME 256 // longest host name we try to match
+#define FILTER_WATCH_SECS 1 // how often the watcher checks the file
+
+/**
+ * open addressing set of NUL terminated names, the names point
+ * into the snapshot's copy of the file
+ */
+struct host_set {
+    const char **keys;
+    uint32_t *hashes;
+    uint32_t mask;
+};
+
+/**
+ * binary radix trie node, prefix is the CIDR length if a listed
+ * block ends here and -1 otherwise
+ */
+struct cidr_node {
+    int32_t child[2];
+    int32_t prefix;
+};
+
+struct filter_snapshot {
+    int slot;                // which of the two publish slots holds us
+    char *text;              // the filter file, split into lines in place
+    struct host_set exact;   // "www.example.com"
+    struct host_set suffix;  // "*.example.com" and ".example.com"
+    struct cidr_node *nodes; // nodes[0] is the root
+    int num_nodes;
+    int cap_nodes;
+};
+
+static const char *filter_path;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec loaded_mtime;
+static off_t loaded_size;
+
+// two publish slots: readers pin a slot with its counter, the writer
+// fills the idle slot, flips current_slot and waits for the old
+// slot's readers to drain before freeing it
+static _Atomic(filter_snapshot *) slots[2];
+static atomic_int current_slot;
+static atomic_long readers[2];
+
+static pthread_t watcher;
+static int watcher_started;
+static atomic_int watcher_stop;
+static volatile sig_atomic_t reload_requested;
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int set_init(struct host_set *set, int expected) {
+    uint32_t cap = 16;
+    while (cap < (uint32_t)expected * 2)
+        cap <<= 1;
+    set->keys = (const char **)calloc(cap, sizeof(char *));
+    set->hashes = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    set->mask = cap - 1;
+    if (set->keys == NULL || set->hashes == NULL) {
+        free(set->keys);
+        free(set->hashes);
+        return -1;
+    }
+    return 0;
+}
+
+static void set_add(struct host_set *set, const char *name) {
+    uint32_t h = hash_name(name);
+    uint32_t i = h & set->mask;
+    while (set->keys[i] != NULL) {
+        if (set->hashes[i] == h && strcmp(set->keys[i], name) == 0)
+            return; // duplicate line
+        i = (i + 1) & set->mask;
+    }
+    set->keys[i] = name;
+    set->hashes[i] = h;
+}
+
+static int set_contains(const struct host_set *set, const char *name) {
+    uint32_t h = hash_name(name);
+    uint32_t i = h & set->mask;
+    while (set->keys[i] != NULL) {
+        if (set->hashes[i] == h && strcmp(set->keys[i], name) == 0)
+            return 1;
+        i = (i + 1) & set->mask;
+    }
+    return 0;
+}
+
+static int32_t trie_new_node(filter_snapshot *snap) {
+    if (snap->num_nodes == snap->cap_nodes) {
+        int cap = snap->cap_nodes ? snap->cap_nodes * 2 : 64;
+        struct cidr_node *nodes = (struct cidr_node *)realloc(snap->nodes, cap * sizeof(struct cidr_node));
+        if (nodes == NULL)
+            return -1;
+        snap->nodes = nodes;
+        snap->cap_nodes = cap;
+    }
+    struct cidr_node *node = &snap->nodes[snap->num_nodes];
+    node->child[0] = node->child[1] = -1;
+    node->prefix = -1;
+    return snap->num_nodes++;
+}
+
+static int trie_add(filter_snapshot *snap, uint32_t addr, int prefix) {
+    int32_t cur = 0;
+    for (int depth = 0; depth < prefix; depth++) {
+        int bit = (addr >> (31 - depth)) & 1;
+        if (snap->nodes[cur].child[bit] < 0) {
+            int32_t next = trie_new_node(snap);
+            if (next < 0)
+                return -1;
+            snap->nodes[cur].child[bit] = next;
+        }
+        cur = snap->nodes[cur].child[bit];
+    }
+    snap->nodes[cur].prefix = prefix;
+    return 0;
+}
+
+// parses "a.b.c.d" or "a.b.c.d/n"; returns 1 if the line is a CIDR entry
+static int parse_cidr(char *line, uint32_t *addr, int *prefix) {
+    for (const char *p = line; *p; p++) {
+        if (!isdigit((unsigned char)*p) && *p != '.' && *p != '/')
+            return 0;
+    }
+    *prefix = 32;
+    char *slash = strchr(line, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        if (slash[1] == '\0')
+            return 0;
+        *prefix = atoi(slash + 1);
+        if (*prefix < 0 || *prefix > 32)
+            return 0;
+    }
+    struct in_addr in;
+    if (inet_pton(AF_INET, line, &in) != 1)
+        return 0;
+    *addr = ntohl(in.s_addr);
+    if (*prefix < 32)
+        *addr &= *prefix == 0 ? 0 : ~0u << (32 - *prefix);
+    return 1;
+}
+
+static void snapshot_free(filter_snapshot *snap) {
+    if (snap == NULL)
+        return;
+    free(snap->exact.keys);
+    free(snap->exact.hashes);
+    free(snap->suffix.keys);
+    free(snap->suffix.hashes);
+    free(snap->nodes);
+    free(snap->text);
+    free(snap);
+}
+
+static filter_snapshot *snapshot_compile(const char *path, struct stat *st) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Error opening filter file");
+        return NULL;
+    }
+    if (fstat(fileno(fp), st) != 0) {
+        perror("error: fstat");
+        fclose(fp);
+        return NULL;
+    }
+
+    filter_snapshot *snap = (filter_snapshot *)calloc(1, sizeof(filter_snapshot));
+    if (snap == NULL || (snap->text = (char *)malloc(st->st_size + 1)) == NULL) {
+        perror("error: malloc");
+        free(snap);
+        fclose(fp);
+        return NULL;
+    }
+    size_t len = fread(snap->text, 1, st->st_size, fp);
+    snap->text[len] = '\0';
+    fclose(fp);
+
+    int lines = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (snap->text[i] == '\n')
+            lines++;
+    }
+    if (set_init(&snap->exact, lines) != 0 || set_init(&snap->suffix, lines) != 0
+        || trie_new_node(snap) < 0) {
+        perror("error: malloc");
+        snapshot_free(snap);
+        return NULL;
+    }
+
+    char *next = snap->text;
+    while (next != NULL) {
+        char *line = next;
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        // trim, lowercase, skip blanks and comments
+        while (isspace((unsigned char)*line))
+            line++;
+        char *end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        if (*line == '\0' || *line == '#')
+            continue;
+        for (char *p = line; *p; p++)
+            *p = (char)tolower((unsigned char)*p);
+
+        uint32_t addr;
+        int prefix;
+        if (parse_cidr(line, &addr, &prefix)) {
+            if (trie_add(snap, addr, prefix) != 0) {
+                perror("error: malloc");
+                snapshot_free(snap);
+                return NULL;
+            }
+            continue;
+        }
+        if (strchr(line, '/') != NULL)
+            continue; // malformed CIDR, skip it like before
+
+        if (end > line && end[-1] == '.')
+            *--end = '\0';
+        if (strncmp(line, "*.", 2) == 0)
+            set_add(&snap->suffix, line + 2);
+        else if (line[0] == '.')
+            set_add(&snap->suffix, line + 1);
+        else
+            set_add(&snap->exact, line);
+    }
+    return snap;
+}
+
+int filter_reload(void) {
+    struct stat st;
+    filter_snapshot *snap = snapshot_compile(filter_path, &st);
+    if (snap == NULL)
+        return -1;
+
+    pthread_mutex_lock(&reload_lock);
+    int old = atomic_load(&current_slot);
+    int next = 1 - old;
+    snap->slot = next;
+    atomic_store(&slots[next], snap);
+    atomic_store(&current_slot, next);
+
+    // grace period: wait for readers that pinned the old slot
+    while (atomic_load(&readers[old]) != 0)
+        sched_yield();
+    filter_snapshot *prev = atomic_exchange(&slots[old], NULL);
+    loaded_mtime = st.st_mtim;
+    loaded_size = st.st_size;
+    pthread_mutex_unlock(&reload_lock);
+
+    snapshot_free(prev);
+    return 0;
+}
+
+filter_snapshot *filter_acquire(void) {
+    while (1) {
+        int idx = atomic_load(&current_slot);
+        atomic_fetch_add(&readers[idx], 1);
+        // the writer may have flipped slots between the two loads
+        if (atomic_load(&current_slot) == idx) {
+            filter_snapshot *snap = atomic_load(&slots[idx]);
+            if (snap == NULL)
+                atomic_fetch_sub(&readers[idx], 1);
+            return snap;
+        }
+        atomic_fetch_sub(&readers[idx], 1);
+    }
+}
+
+void filter_release(filter_snapshot *snap) {
+    if (snap != NULL)
+        atomic_fetch_sub(&readers[snap->slot], 1);
+}
+
+int filter_match_host(const filter_snapshot *snap, const char *host) {
+    char name[FILTER_MAX_NAME];
+    size_t len = 0;
+    while (host[len] != '\0' && host[len] != ':') {
+        if (len == sizeof(name) - 1)
+            return 0;
+        name[len] = (char)tolower((unsigned char)host[len]);
+        len++;
+    }
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    name[len] = '\0';
+    if (len == 0)
+        return 0;
+
+    if (set_contains(&snap->exact, name) || set_contains(&snap->suffix, name))
+        return 1;
+    for (const char *p = strchr(name, '.'); p != NULL; p = strchr(p + 1, '.')) {
+        if (set_contains(&snap->suffix, p + 1))
+            return 1;
+    }
+    return 0;
+}
+
+int filter_match_ip(const filter_snapshot *snap, struct in_addr addr) {
+    uint32_t ip = ntohl(addr.s_addr);
+    int32_t cur = 0;
+    int best = snap->nodes[0].prefix;
+    for (int depth = 0; depth < 32; depth++) {
+        cur = snap->nodes[cur].child[(ip >> (31 - depth)) & 1];
+        if (cur < 0)
+            break;
+        if (snap->nodes[cur].prefix >= 0)
+            best = snap->nodes[cur].prefix;
+    }
+    return best;
+}
+
+void filter_request_reload(void) {
+    reload_requested = 1;
+}
+
+static void *watch_filter(void *arg) {
+    (void)arg;
+    struct timespec tick = {FILTER_WATCH_SECS, 0};
+    while (!atomic_load(&watcher_stop)) {
+        nanosleep(&tick, NULL);
+        int changed = 0;
+        struct stat st;
+        if (stat(filter_path, &st) == 0) {
+            pthread_mutex_lock(&reload_lock);
+            changed = st.st_mtim.tv_sec != loaded_mtime.tv_sec
+                      || st.st_mtim.tv_nsec != loaded_mtime.tv_nsec
+                      || st.st_size != loaded_size;
+            pthread_mutex_unlock(&reload_lock);
+        }
+        if (reload_requested || changed) {
+            reload_requested = 0;
+            filter_reload();
+        }
+    }
+    return NULL;
+}
+
+int filter_init(const char *path) {
+    filter_path = path;
+    int rc = filter_reload();
+    atomic_store(&watcher_stop, 0);
+    if (pthread_create(&watcher, NULL, watch_filter, NULL) != 0) {
+        perror("error: thread creation");
+        return rc;
+    }
+    watcher_started = 1;
+    return rc;
+}
+
+void filter_shutdown(void) {
+    if (watcher_started) {
+        atomic_store(&watcher_stop, 1);
+        pthread_join(watcher, NULL);
+        watcher_started = 0;
+    }
+    for (int i = 0; i < 2; i++)
+        snapshot_free(atomic_exchange(&slots[i], NULL));
+}
@@ -0,0 +1,69 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * filter.h
+ *
+ * The filter file is compiled once into an immutable snapshot:
+ * a hashed set of exact host names, a hashed set of domain
+ * suffixes ("*.example.com" or ".example.com" lines) and a
+ * longest-prefix binary radix trie of IPv4 CIDR blocks
+ * ("10.0.0.0/8", or a bare address meaning /32).
+ *
+ * Worker threads read the current snapshot without taking a lock.
+ * A reload (SIGHUP or a change of the file's mtime) builds a new
+ * snapshot on the watcher thread and swaps it in atomically; the
+ * old one is freed once the last reader has released it.
+ */
+
+typedef struct filter_snapshot filter_snapshot;
+
+/**
+ * filter_init compiles "path" into the first snapshot and starts the
+ * watcher thread that reloads it. returns 0 on success, -1 if the
+ * file could not be read (the proxy then answers 500 as before).
+ */
+int filter_init(const char *path);
+
+/**
+ * filter_request_reload asks the watcher thread to rebuild the
+ * snapshot. It only sets a flag, so it is safe to call from a
+ * signal handler.
+ */
+void filter_request_reload(void);
+
+/**
+ * filter_reload rebuilds the snapshot synchronously and swaps it in.
+ * On failure the previous snapshot stays active. returns 0 / -1.
+ */
+int filter_reload(void);
+
+/**
+ * filter_acquire pins the current snapshot for the calling thread,
+ * filter_release unpins it. Never blocks. returns NULL if no
+ * snapshot was ever loaded.
+ */
+filter_snapshot *filter_acquire(void);
+void filter_release(filter_snapshot *snap);
+
+/**
+ * filter_match_host returns 1 if "host" (optionally with ":port")
+ * is listed exactly or falls under a listed suffix, 0 otherwise.
+ */
+int filter_match_host(const filter_snapshot *snap, const char *host);
+
+/**
+ * filter_match_ip returns the length of the longest listed prefix
+ * that contains "addr", or -1 if none does.
+ */
+int filter_match_ip(const filter_snapshot *snap, struct in_addr addr);
+
+/**
+ * filter_shutdown stops the watcher thread and frees the snapshots.
+ */
+void filter_shutdown(void);
+
+#endif
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include "http.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+
+void http_framing_init(http_framing *f, int head_request) {
+    memset(f, 0, offsetof(http_framing, line));
+    f->body.state = HF_HEADER;
+    f->head_request = head_request;
+}
+
+static void framing_error(http_framing *f) {
+    f->body.state = HF_ERROR;
+    f->keep_alive = 0;
+}
+
+// called with one status or header line, CRLF already stripped
+static void header_line(http_framing *f) {
+    char *line = f->line;
+
+    if (f->status == 0) {
+        // "HTTP/1.1 200 OK"
+        if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)line[7])
+            || line[8] != ' ' || !isdigit((unsigned char)line[9])) {
+            framing_error(f);
+            return;
+        }
+        f->keep_alive = line[7] != '0'; // 1.1 is persistent unless told otherwise
+        f->status = atoi(line + 9);
+        return;
+    }
+
+    if (*line == '\0') {
+        // end of headers, decide how the body is framed
+        f->heads++;
+        if (f->status / 100 == 1 && f->status != 101) {
+            f->status = 0; // interim response, the real one follows
+            f->chunked = f->have_length = 0;
+            return;
+        }
+        if (f->status == 101) {
+            f->body.state = HF_BODY_EOF;
+            f->keep_alive = 0;
+        } else if (f->head_request || f->status == 204 || f->status == 304) {
+            f->body.state = HF_DONE;
+        } else if (f->chunked || f->have_length) {
+            http_body_init(&f->body, f->chunked, f->body.remaining);
+        } else {
+            f->body.state = HF_BODY_EOF;
+            f->keep_alive = 0;
+        }
+        return;
+    }
+
+    char *colon = strchr(line, ':');
+    if (colon == NULL) {
+        return; // not a header, ignore it like most clients do
+    }
+    *colon = '\0';
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+        char *end;
+        long long length = strtoll(value, &end, 10);
+        if (end == value || length < 0) {
+            framing_error(f);
+            return;
+        }
+        f->have_length = 1;
+        f->body.remaining = length;
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        if (strcasestr(value, "chunked") != NULL) {
+            f->chunked = 1;
+        }
+    } else if (strcasecmp(line, "Connection") == 0) {
+        if (strcasestr(value, "close") != NULL) {
+            f->keep_alive = 0;
+        } else if (strcasestr(value, "keep-alive") != NULL) {
+            f->keep_alive = 1;
+        }
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+void http_body_init(http_body *b, int chunked, long long length) {
+    memset(b, 0, sizeof(*b));
+    if (chunked) {
+        b->state = HF_CHUNK_SIZE;
+    } else {
+        b->state = length > 0 ? HF_BODY_LENGTH : HF_DONE;
+        b->remaining = length;
+    }
+}
+
+size_t http_body_feed(http_body *b, const char *buf, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        switch (b->state) {
+            case HF_BODY_LENGTH: {
+                size_t take = n - i;
+                if ((long long)take > b->remaining) {
+                    take = (size_t)b->remaining;
+                }
+                i += take;
+                b->remaining -= take;
+                if (b->remaining == 0) {
+                    b->state = HF_DONE;
+                }
+                break;
+            }
+            case HF_CHUNK_SIZE: {
+                char c = buf[i++];
+                int v;
+                if (c == '\n') {
+                    if (b->chunk_digits == 0) {
+                        b->state = HF_ERROR;
+                        return n;
+                    }
+                    b->state = b->remaining == 0 ? HF_TRAILER : HF_CHUNK_DATA;
+                } else if (c == '\r' || b->in_extension || c == ' ' || c == '\t') {
+                    // skip
+                } else if (c == ';') {
+                    b->in_extension = 1;
+                } else if ((v = hex_value(c)) >= 0 && b->chunk_digits < 15) {
+                    b->remaining = b->remaining * 16 + v;
+                    b->chunk_digits++;
+                } else {
+                    b->state = HF_ERROR;
+                    return n;
+                }
+                break;
+            }
+            case HF_CHUNK_DATA: {
+                size_t take = n - i;
+                if ((long long)take > b->remaining) {
+                    take = (size_t)b->remaining;
+                }
+                i += take;
+                b->remaining -= take;
+                if (b->remaining == 0) {
+                    b->state = HF_CHUNK_DATA_END;
+                }
+                break;
+            }
+            case HF_CHUNK_DATA_END: {
+                char c = buf[i++];
+                if (c == '\n') {
+                    b->state = HF_CHUNK_SIZE;
+                    b->remaining = 0;
+                    b->chunk_digits = 0;
+                    b->in_extension = 0;
+                } else if (c != '\r') {
+                    b->state = HF_ERROR;
+                    return n;
+                }
+                break;
+            }
+            case HF_TRAILER: {
+                char c = buf[i++];
+                if (c == '\n') {
+                    b->state = HF_DONE;
+                } else if (c != '\r') {
+                    b->state = HF_TRAILER_LINE;
+                }
+                break;
+            }
+            case HF_TRAILER_LINE:
+                if (buf[i++] == '\n') {
+                    b->state = HF_TRAILER;
+                }
+                break;
+            case HF_BODY_EOF:
+            case HF_ERROR:
+                return n;
+            case HF_HEADER:
+            case HF_DONE:
+                return i;
+        }
+    }
+    return i;
+}
+
+long long http_body_passthrough(const http_body *b) {
+    switch (b->state) {
+        case HF_BODY_LENGTH:
+        case HF_CHUNK_DATA:
+            return b->remaining;
+        case HF_BODY_EOF:
+            return LLONG_MAX;
+        default:
+            return 0;
+    }
+}
+
+void http_body_skip(http_body *b, size_t n) {
+    if (b->state == HF_BODY_LENGTH || b->state == HF_CHUNK_DATA) {
+        b->remaining -= n;
+        if (b->remaining == 0) {
+            b->state = b->state == HF_BODY_LENGTH ? HF_DONE : HF_CHUNK_DATA_END;
+        }
+    }
+}
+
+size_t http_framing_feed(http_framing *f, const char *buf, size_t n) {
+    size_t i = 0;
+    while (i < n && f->body.state == HF_HEADER) {
+        const char *nl = (const char *)memchr(buf + i, '\n', n - i);
+        size_t take = nl != NULL ? (size_t)(nl - (buf + i)) + 1 : n - i;
+        if (f->line_len + take > HTTP_MAX_LINE - 1) {
+            framing_error(f);
+            return n;
+        }
+        memcpy(f->line + f->line_len, buf + i, take);
+        f->line_len += take;
+        i += take;
+        if (nl != NULL) {
+            size_t len = f->line_len - 1;
+            if (len > 0 && f->line[len - 1] == '\r') {
+                len--;
+            }
+            f->line[len] = '\0';
+            f->line_len = 0;
+            header_line(f);
+        }
+    }
+    i += http_body_feed(&f->body, buf + i, n - i);
+    if (f->body.state == HF_ERROR) {
+        f->keep_alive = 0;
+    }
+    return i;
+}
+
+long long http_framing_passthrough(const http_framing *f) {
+    return http_body_passthrough(&f->body);
+}
+
+void http_framing_skip(http_framing *f, size_t n) {
+    http_body_skip(&f->body, n);
+}
+
+void http_request_init(http_request *r) {
+    r->state = HR_REQUEST_LINE;
+    r->scan_off = r->line_off = r->header_len = 0;
+    r->num_headers = 0;
+    r->host = -1;
+}
+
+static http_span span(const char *buf, const char *start, const char *end) {
+    http_span s = { (unsigned)(start - buf), (unsigned)(end - start) };
+    return s;
+}
+
+// "GET http://host/path HTTP/1.1"
+static int request_line(http_request *r, const char *buf, const char *line, const char *end) {
+    const char *sp1 = memchr(line, ' ', end - line);
+    if (sp1 == NULL || sp1 == line) {
+        return -1;
+    }
+    const char *target = sp1 + 1;
+    const char *sp2 = memchr(target, ' ', end - target);
+    if (sp2 == NULL || sp2 == target) {
+        return -1;
+    }
+    const char *version = sp2 + 1;
+    if (end - version != 8 || memcmp(version, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)version[7])) {
+        return -1;
+    }
+    r->method = span(buf, line, sp1);
+    r->target = span(buf, target, sp2);
+    r->version = span(buf, version, end);
+    return 0;
+}
+
+/**
+ * indexes one header line.
+ * returns the state the request goes to, HR_HEADERS if it was fine.
+ * Lines are forwarded as they are, so one we can't read the way the
+ * origin might is refused rather than skipped: obs-fold continuations,
+ * lines without a name and colon, whitespace in or after the name
+ * ("Transfer-Encoding : chunked" is a header we would never find) and
+ * a second Host, the origin might go by another one than we do
+ */
+static enum http_request_state header(http_request *r, const char *buf, const char *line, const char *end) {
+    const char *colon = memchr(line, ':', end - line);
+    if (colon == NULL || colon == line) {
+        return HR_ERROR;
+    }
+    for (const char *p = line; p < colon; p++) {
+        if (*p == ' ' || *p == '\t') {
+            return HR_ERROR;
+        }
+    }
+    if (r->num_headers == HTTP_MAX_HEADERS) {
+        return HR_TOO_LARGE;
+    }
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    const char *value_end = end;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+    int i = r->num_headers++;
+    r->headers[i].name = span(buf, line, colon);
+    r->headers[i].value = span(buf, value, value_end);
+    if (colon - line == 4 && strncasecmp(line, "Host", 4) == 0) {
+        if (r->host >= 0) {
+            return HR_ERROR;
+        }
+        r->host = i;
+    }
+    return HR_HEADERS;
+}
+
+int http_request_parse(http_request *r, const char *buf, size_t len) {
+    while (r->state == HR_REQUEST_LINE || r->state == HR_HEADERS) {
+        // memchr is vectorized in any libc we care about, so finding the
+        // end of a line costs far less than a byte at a time loop
+        const char *nl = memchr(buf + r->scan_off, '\n', len - r->scan_off);
+        if (nl == NULL) {
+            r->scan_off = len;
+            return 0;
+        }
+        const char *line = buf + r->line_off;
+        const char *end = nl;
+        if (end == line || end[-1] != '\r') {
+            // a bare LF is legal but the request is forwarded as it is,
+            // and a proxy that splits lines differently than the origin
+            // is open to request smuggling
+            r->state = HR_ERROR;
+            break;
+        }
+        end--;
+        r->scan_off = r->line_off = nl + 1 - buf;
+
+        if (r->state == HR_REQUEST_LINE) {
+            if (end == line) {
+                continue; // empty lines before a request are allowed
+            }
+            if (request_line(r, buf, line, end) != 0) {
+                r->state = HR_ERROR;
+                break;
+            }
+            r->state = HR_HEADERS;
+        } else if (end == line) {
+            r->header_len = r->line_off;
+            r->state = HR_DONE;
+        } else {
+            r->state = header(r, buf, line, end);
+        }
+    }
+    return r->state == HR_DONE ? 1 : -1;
+}
+
+const http_span *http_request_header(const http_request *r, const char *buf, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < r->num_headers; i++) {
+        if (r->headers[i].name.len == name_len
+            && strncasecmp(buf + r->headers[i].name.off, name, name_len) == 0) {
+            return &r->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+int http_span_copy(const char *buf, http_span s, char *out, size_t out_len) {
+    if (s.len >= out_len) {
+        return -1;
+    }
+    memcpy(out, buf + s.off, s.len);
+    out[s.len] = '\0';
+    return 0;
+}
@@ -0,0 +1,178 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * http.h
+ *
+ * Incremental HTTP/1.x parsing.
+ *
+ * Response framing: the relay feeds it the bytes it forwards
+ * unchanged, and it reports where the response ends (Content-Length,
+ * chunked encoding, or end of connection) and whether the origin
+ * connection can carry another request.
+ *
+ * Body framing: the part of the above that follows the header, also
+ * used on its own for request bodies streamed to the origin.
+ *
+ * Request headers: parsed in place in the receive buffer as bytes
+ * arrive, see http_request.
+ */
+
+#define HTTP_MAX_LINE 8192 // longest status/header line we accept
+
+enum http_framing_state {
+    HF_HEADER,          // reading the status line and headers
+    HF_BODY_LENGTH,     // Content-Length bytes remain
+    HF_CHUNK_SIZE,      // reading a chunk-size line
+    HF_CHUNK_DATA,      // inside chunk data
+    HF_CHUNK_DATA_END,  // CRLF after chunk data
+    HF_TRAILER,         // at the start of a trailer line
+    HF_TRAILER_LINE,    // inside a trailer line
+    HF_BODY_EOF,        // body runs until the origin closes
+    HF_DONE,            // the response is complete
+    HF_ERROR            // unparseable, relay until the origin closes
+};
+
+/**
+ * where a body ends. It only keeps a few counters, whatever the size
+ * of the body or of its chunks.
+ */
+typedef struct http_body {
+    enum http_framing_state state;
+    long long remaining;    // body or chunk bytes left
+    int chunk_digits;       // hex digits seen on the chunk-size line
+    int in_extension;       // past ';' on the chunk-size line
+} http_body;
+
+typedef struct http_framing {
+    http_body body;         // state is HF_HEADER until the header was read
+    int head_request;       // responses to HEAD carry no body
+    int status;             // status code of the final response
+    int keep_alive;         // 1 if the connection may be reused
+    int chunked;
+    int have_length;
+    int heads;              // header blocks read, interim ones included
+    size_t line_len;
+    char line[HTTP_MAX_LINE];
+} http_framing;
+
+/**
+ * http_body_init prepares "b" for a chunked body, or one of "length"
+ * bytes (HF_DONE right away if that is 0).
+ */
+void http_body_init(http_body *b, int chunked, long long length);
+
+/**
+ * http_body_feed consumes body bytes and returns how many of them
+ * belong to the body (less than "n" only if it ended inside the
+ * buffer). b->state is HF_DONE once the body is complete, HF_ERROR if
+ * the chunked encoding is broken.
+ */
+size_t http_body_feed(http_body *b, const char *buf, size_t n);
+
+/**
+ * http_body_passthrough and http_body_skip are what
+ * http_framing_passthrough and http_framing_skip below are for a body.
+ */
+long long http_body_passthrough(const http_body *b);
+void http_body_skip(http_body *b, size_t n);
+
+/**
+ * http_framing_init prepares "f" for the response to a request,
+ * "head_request" is 1 for HEAD.
+ */
+void http_framing_init(http_framing *f, int head_request);
+
+/**
+ * http_framing_feed consumes response bytes and returns how many of
+ * them belong to this response (less than "n" only if the response
+ * ended inside the buffer). f->body.state is HF_DONE once the response is
+ * complete; in the HF_BODY_EOF and HF_ERROR states every byte is
+ * consumed.
+ */
+size_t http_framing_feed(http_framing *f, const char *buf, size_t n);
+
+/**
+ * http_framing_passthrough returns how many of the next response
+ * bytes are plain body bytes that can be moved without being looked
+ * at (LLONG_MAX if the body runs until the origin closes), or 0 if
+ * the next bytes must go through http_framing_feed.
+ */
+long long http_framing_passthrough(const http_framing *f);
+
+/**
+ * http_framing_skip accounts for "n" passthrough bytes that were
+ * moved without being read (n <= http_framing_passthrough).
+ */
+void http_framing_skip(http_framing *f, size_t n);
+
+/**
+ * a piece of a request buffer, kept as an offset so it stays valid
+ * when the buffer is copied
+ */
+typedef struct http_span {
+    unsigned off;
+    unsigned len;
+} http_span;
+
+#define HTTP_MAX_HEADERS 64 // headers we index per request, a request with more gets a 431
+
+enum http_request_state {
+    HR_REQUEST_LINE,    // reading "METHOD target HTTP/x.y"
+    HR_HEADERS,         // reading header lines
+    HR_DONE,            // the empty line was seen
+    HR_ERROR,           // malformed, answer 400
+    HR_TOO_LARGE        // more headers or bytes than we take, answer 431
+};
+
+/**
+ * a resumable request header parser. It works on the receive buffer
+ * in place, only looks at bytes it has not seen before and allocates
+ * nothing; every field is a span of that buffer.
+ */
+typedef struct http_request {
+    enum http_request_state state;
+    size_t scan_off;        // bytes before this were already scanned
+    size_t line_off;        // start of the line being read
+    size_t header_len;      // length up to and including the empty line
+    http_span method;
+    http_span target;
+    http_span version;
+    int num_headers;
+    int host;               // index of the Host header, -1 if none
+    struct {
+        http_span name;
+        http_span value;    // without surrounding blanks
+    } headers[HTTP_MAX_HEADERS];
+} http_request;
+
+/**
+ * http_request_init prepares "r" for a request starting at offset 0.
+ */
+void http_request_init(http_request *r);
+
+/**
+ * http_request_parse continues parsing buf[0..len), which holds the
+ * bytes passed last time plus any that arrived since.
+ * returns 1 once the header is complete (r->header_len is set), 0 if
+ * more bytes are needed and -1 if the request is malformed or has too
+ * many headers (r->state tells which).
+ */
+int http_request_parse(http_request *r, const char *buf, size_t len);
+
+/**
+ * http_request_header returns the value of the first header called
+ * "name" (compared without case), NULL if there is none.
+ */
+const http_span *http_request_header(const http_request *r, const char *buf, const char *name);
+
+/**
+ * http_span_copy copies "s" as a string into out[0..out_len).
+ * returns -1 if it does not fit.
+ */
+int http_span_copy(const char *buf, http_span s, char *out, size_t out_len);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/**
+ * listener.h
+ *
+ * Listening sockets for the event loops.
+ *
+ * By default all loops accept from one socket. In sharded mode every
+ * loop has its own socket bound to the same port with SO_REUSEPORT,
+ * and the kernel spreads incoming connections over them, so loops
+ * share nothing on the accept path. A classic BPF program attached to
+ * the group can pick the socket of the CPU that received the
+ * connection, which keeps it on that CPU when loop i is pinned to
+ * CPU i.
+ */
+
+/**
+ * listener_open returns a non-blocking socket listening on "port" on
+ * all addresses, or -1 (after perror). With "reuseport" set the
+ * socket joins the port's SO_REUSEPORT group.
+ */
+int listener_open(int port, int backlog, int reuseport);
+
+/**
+ * listener_steer_by_cpu attaches to "fd"'s SO_REUSEPORT group a
+ * program that hands a connection to the group's socket number
+ * <receiving CPU>. Sockets are numbered in the order they joined, so
+ * it only helps when socket i belongs to the loop pinned to CPU i and
+ * there is one socket per CPU. returns 0 on success, -1 if the kernel
+ * refused.
+ */
+int listener_steer_by_cpu(int fd);
+
+/**
+ * listener_cpus fills "cpus" with up to "max" CPUs the process may run
+ * on, in ascending order, and returns how many it found (0 if the
+ * affinity mask could not be read).
+ */
+int listener_cpus(int *cpus, int max);
+
+#endif
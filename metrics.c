@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define ADMIN_REQUEST_LEN 4096 // longest scrape request we read
+#define ADMIN_TIMEOUT_SECS 2   // for reading the request and sending the answer
+#define EXPORT_MIN_EXP 10      // histogram buckets exported: 2^10 ns (1us) ...
+#define EXPORT_MAX_EXP 36      // ... to 2^36 ns (69s), then +Inf
+
+static const char *stage_names[METRIC_STAGES] = {
+    "recv", "parse", "dns", "filter", "connect", "ttfb", "relay", "total"
+};
+static const int error_codes[METRICS_NUM_CODES] = METRICS_CODES;
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static atomic_int enabled;
+static int admin_fd = -1;
+static pthread_t admin_thread;
+static atomic_int admin_stop;
+static metrics_extra_fn extra_fn;
+
+// every thread's block, blocks are only added until metrics_shutdown
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread *threads_head;
+static __thread metrics_thread *self;
+
+static metrics_thread *thread_block(void) {
+    if (self == NULL) {
+        self = (metrics_thread *)calloc(1, sizeof(metrics_thread));
+        if (self == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&threads_lock);
+        self->next = threads_head;
+        threads_head = self;
+        pthread_mutex_unlock(&threads_lock);
+    }
+    return self;
+}
+
+// single writer: a relaxed load and store, no locked instruction
+static void bump(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static int bucket_of(unsigned long ns) {
+    if (ns < METRICS_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int e = 63 - __builtin_clzl(ns);
+    if (e > METRICS_MAX_EXP) {
+        return METRICS_BUCKETS - 1;
+    }
+    return (e - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS
+           + (int)(ns >> (e - METRICS_SUB_BITS)) - METRICS_SUB_BUCKETS;
+}
+
+// the middle of the values counted in bucket "i"
+static double bucket_value(int i) {
+    if (i < METRICS_SUB_BUCKETS) {
+        return i;
+    }
+    int e = i / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    unsigned long m = i % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+    return ((double)(m << (e - METRICS_SUB_BITS)) + (double)((m + 1) << (e - METRICS_SUB_BITS))) / 2;
+}
+
+long metrics_now(void) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+long metrics_observe(metric_stage stage, long start) {
+    long now = metrics_now();
+    metrics_thread *t;
+    if (start == 0 || now == 0 || (t = thread_block()) == NULL) {
+        return now;
+    }
+    unsigned long ns = now > start ? (unsigned long)(now - start) : 0;
+    metrics_histogram *h = &t->stages[stage];
+    bump(&h->buckets[bucket_of(ns)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum_ns, ns);
+    return now;
+}
+
+void metrics_count_error(int code) {
+    metrics_thread *t;
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    int i = 0;
+    while (i < METRICS_NUM_CODES && error_codes[i] != code) {
+        i++;
+    }
+    bump(&t->errors[i], 1);
+}
+
+void metrics_add_bytes(size_t n) {
+    metrics_thread *t;
+    if (n == 0 || !atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    bump(&t->bytes_relayed, n);
+}
+
+void metrics_conn_opened(void) {
+    metrics_thread *t;
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    bump(&t->conns_opened, 1);
+}
+
+void metrics_conn_closed(void) {
+    metrics_thread *t;
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    bump(&t->conns_closed, 1);
+}
+
+void metrics_tunnel_opened(void) {
+    metrics_thread *t;
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    bump(&t->tunnels_opened, 1);
+}
+
+void metrics_tunnel_closed(unsigned long long up, unsigned long long down) {
+    metrics_thread *t;
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed) || (t = thread_block()) == NULL) {
+        return;
+    }
+    bump(&t->tunnels_closed, 1);
+    bump(&t->tunnel_bytes[0], up);
+    bump(&t->tunnel_bytes[1], down);
+}
+
+// ---- exposition
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} out_buf;
+
+static void put(out_buf *o, const char *fmt, ...) {
+    if (o->len >= o->cap) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        o->len = o->len + n < o->cap ? o->len + n : o->cap;
+    }
+}
+
+size_t metrics_render(char *out, size_t cap) {
+    static unsigned long buckets[METRIC_STAGES][METRICS_BUCKETS]; // only the admin thread renders
+    unsigned long count[METRIC_STAGES] = {0}, sum_ns[METRIC_STAGES] = {0};
+    out_buf o = {out, cap, 0};
+
+    pthread_mutex_lock(&threads_lock);
+    metrics_thread *head = threads_head;
+    pthread_mutex_unlock(&threads_lock);
+
+    memset(buckets, 0, sizeof(buckets));
+    for (metrics_thread *t = head; t != NULL; t = t->next) {
+        for (int s = 0; s < METRIC_STAGES; s++) {
+            metrics_histogram *h = &t->stages[s];
+            for (int i = 0; i < METRICS_BUCKETS; i++) {
+                buckets[s][i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+            }
+            count[s] += atomic_load_explicit(&h->count, memory_order_relaxed);
+            sum_ns[s] += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+        }
+    }
+
+    put(&o, "# HELP proxy_stage_duration_seconds Time spent in each stage of a request.\n");
+    put(&o, "# TYPE proxy_stage_duration_seconds histogram\n");
+    for (int s = 0; s < METRIC_STAGES; s++) {
+        // cumulative counts at powers of two, from the full-resolution buckets
+        unsigned long below = 0;
+        int i = 0;
+        for (int e = EXPORT_MIN_EXP; e <= EXPORT_MAX_EXP; e++) {
+            int limit = bucket_of(1UL << e);
+            for (; i < limit; i++) {
+                below += buckets[s][i];
+            }
+            put(&o, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %lu\n",
+                stage_names[s], (double)(1UL << e) / 1e9, below);
+        }
+        put(&o, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage_names[s], count[s]);
+        put(&o, "proxy_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], sum_ns[s] / 1e9);
+        put(&o, "proxy_stage_duration_seconds_count{stage=\"%s\"} %lu\n", stage_names[s], count[s]);
+    }
+
+    // quantiles straight from the buckets, which the exported histogram is too coarse for
+    put(&o, "# HELP proxy_stage_duration_quantile_seconds Stage latency quantiles since start.\n");
+    put(&o, "# TYPE proxy_stage_duration_quantile_seconds gauge\n");
+    for (int s = 0; s < METRIC_STAGES; s++) {
+        unsigned long total = 0;
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            total += buckets[s][i];
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && total > 0; q++) {
+            unsigned long rank = (unsigned long)(quantiles[q] * (total - 1)) + 1, seen = 0;
+            int i = 0;
+            for (; i < METRICS_BUCKETS - 1 && seen + buckets[s][i] < rank; i++) {
+                seen += buckets[s][i];
+            }
+            put(&o, "proxy_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                stage_names[s], quantiles[q], bucket_value(i) / 1e9);
+        }
+    }
+
+    unsigned long errors[METRICS_NUM_CODES + 1] = {0};
+    unsigned long bytes = 0, opened = 0, closed = 0;
+    unsigned long tunnels_opened = 0, tunnels_closed = 0, tunnel_bytes[2] = {0, 0};
+    for (metrics_thread *t = head; t != NULL; t = t->next) {
+        for (int i = 0; i <= METRICS_NUM_CODES; i++) {
+            errors[i] += atomic_load_explicit(&t->errors[i], memory_order_relaxed);
+        }
+        bytes += atomic_load_explicit(&t->bytes_relayed, memory_order_relaxed);
+        opened += atomic_load_explicit(&t->conns_opened, memory_order_relaxed);
+        closed += atomic_load_explicit(&t->conns_closed, memory_order_relaxed);
+        tunnels_opened += atomic_load_explicit(&t->tunnels_opened, memory_order_relaxed);
+        tunnels_closed += atomic_load_explicit(&t->tunnels_closed, memory_order_relaxed);
+        for (int i = 0; i < 2; i++) {
+            tunnel_bytes[i] += atomic_load_explicit(&t->tunnel_bytes[i], memory_order_relaxed);
+        }
+    }
+    put(&o, "# HELP proxy_error_responses_total Responses the proxy generated itself, by status code.\n");
+    put(&o, "# TYPE proxy_error_responses_total counter\n");
+    for (int i = 0; i < METRICS_NUM_CODES; i++) {
+        put(&o, "proxy_error_responses_total{code=\"%d\"} %lu\n", error_codes[i], errors[i]);
+    }
+    put(&o, "proxy_error_responses_total{code=\"other\"} %lu\n", errors[METRICS_NUM_CODES]);
+    put(&o, "# HELP proxy_relayed_bytes_total Response bytes sent to clients.\n");
+    put(&o, "# TYPE proxy_relayed_bytes_total counter\n");
+    put(&o, "proxy_relayed_bytes_total %lu\n", bytes);
+    put(&o, "# HELP proxy_connections_total Client connections accepted.\n");
+    put(&o, "# TYPE proxy_connections_total counter\n");
+    put(&o, "proxy_connections_total %lu\n", opened);
+    put(&o, "# HELP proxy_connections_active Client connections open.\n");
+    put(&o, "# TYPE proxy_connections_active gauge\n");
+    // read without a snapshot, a close may be seen before its open
+    put(&o, "proxy_connections_active %ld\n", opened >= closed ? (long)(opened - closed) : 0L);
+    put(&o, "# HELP proxy_tunnels_total CONNECT tunnels established.\n");
+    put(&o, "# TYPE proxy_tunnels_total counter\n");
+    put(&o, "proxy_tunnels_total %lu\n", tunnels_opened);
+    put(&o, "# HELP proxy_tunnels_active CONNECT tunnels open.\n");
+    put(&o, "# TYPE proxy_tunnels_active gauge\n");
+    put(&o, "proxy_tunnels_active %ld\n",
+        tunnels_opened >= tunnels_closed ? (long)(tunnels_opened - tunnels_closed) : 0L);
+    put(&o, "# HELP proxy_tunnel_bytes_total Bytes carried by closed CONNECT tunnels.\n");
+    put(&o, "# TYPE proxy_tunnel_bytes_total counter\n");
+    put(&o, "proxy_tunnel_bytes_total{direction=\"up\"} %lu\n", tunnel_bytes[0]);
+    put(&o, "proxy_tunnel_bytes_total{direction=\"down\"} %lu\n", tunnel_bytes[1]);
+
+    if (extra_fn != NULL && o.len < o.cap) {
+        o.len += extra_fn(o.buf + o.len, o.cap - o.len);
+    }
+    return o.len;
+}
+
+// ---- admin port
+
+static void serve_scrape(int fd, char *body) {
+    struct timeval tv = {ADMIN_TIMEOUT_SECS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char request[ADMIN_REQUEST_LEN + 1];
+    size_t len = 0;
+    while (len < ADMIN_REQUEST_LEN) {
+        ssize_t n = recv(fd, request + len, ADMIN_REQUEST_LEN - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    size_t body_len = 0;
+    const char *status = "404 Not Found";
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        status = "200 OK";
+        body_len = metrics_render(body, METRICS_MAX_RESPONSE);
+    }
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n", status, body_len);
+    if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) {
+        size_t off = 0;
+        while (off < body_len) {
+            ssize_t n = send(fd, body + off, body_len - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+    }
+}
+
+static void *run_admin(void *arg) {
+    (void)arg;
+    char *body = (char *)malloc(METRICS_MAX_RESPONSE);
+    if (body == NULL) {
+        perror("error: malloc");
+        return NULL;
+    }
+    while (!atomic_load(&admin_stop)) {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // metrics_shutdown shut the socket down
+        }
+        serve_scrape(fd, body);
+        close(fd);
+    }
+    free(body);
+    return NULL;
+}
+
+void metrics_enable(void) {
+    atomic_store(&enabled, 1);
+}
+
+int metrics_start(int port, metrics_extra_fn extra) {
+    admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd == -1) {
+        perror("error: admin socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0) {
+        perror("error: admin port");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    extra_fn = extra;
+    atomic_store(&enabled, 1);
+    if (pthread_create(&admin_thread, NULL, run_admin, NULL) != 0) {
+        perror("error: admin thread");
+        atomic_store(&enabled, 0);
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_shutdown(void) {
+    if (admin_fd != -1) {
+        atomic_store(&admin_stop, 1);
+        shutdown(admin_fd, SHUT_RDWR); // wakes the blocked accept
+        pthread_join(admin_thread, NULL);
+        close(admin_fd);
+        admin_fd = -1;
+    }
+    atomic_store(&enabled, 0);
+    pthread_mutex_lock(&threads_lock);
+    while (threads_head != NULL) {
+        metrics_thread *next = threads_head->next;
+        free(threads_head);
+        threads_head = next;
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
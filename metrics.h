@@ -0,0 +1,143 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * metrics.h
+ *
+ * Request instrumentation, served in the Prometheus text format on an
+ * admin port.
+ *
+ * Every thread that records gets its own block of counters and
+ * log-linear latency histograms (HDR style: METRICS_SUB_BUCKETS
+ * buckets per power of two, so any value is known to within 12.5%).
+ * Only the owning thread writes a block, with plain relaxed stores, so
+ * recording takes no lock and shares no cache line. A scrape adds all
+ * blocks up.
+ *
+ * Nothing is recorded until metrics_start or metrics_enable was
+ * called: metrics_now returns 0 and observations of a 0 start are
+ * dropped.
+ */
+
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 40        // ns values up to 2^41 (about 36 minutes)
+#define METRICS_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_RESPONSE (1024 * 1024) // cap on one scrape's output
+
+/**
+ * the stages of a proxied request, each with its own histogram
+ */
+typedef enum {
+    METRIC_RECV,        // first request byte to complete header
+    METRIC_PARSE,       // request line and headers to method/host/port
+    METRIC_DNS,         // resolver, cache hits included
+    METRIC_FILTER,      // host and address checks
+    METRIC_CONNECT,     // new origin connections only
+    METRIC_TTFB,        // request sent to first response byte
+    METRIC_RELAY,       // first to last response byte
+    METRIC_TOTAL,       // first request byte to response sent
+    METRIC_STAGES
+} metric_stage;
+
+/**
+ * status codes the proxy answers with itself, counted per code
+ */
+#define METRICS_CODES {400, 403, 404, 408, 431, 500, 501, 502, 503, 504}
+#define METRICS_NUM_CODES 10
+
+typedef struct metrics_histogram {
+    atomic_ulong buckets[METRICS_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_ns;
+} metrics_histogram;
+
+/**
+ * one thread's block, written by that thread only
+ */
+typedef struct metrics_thread {
+    metrics_histogram stages[METRIC_STAGES];
+    atomic_ulong errors[METRICS_NUM_CODES + 1]; // the last one counts other codes
+    atomic_ulong bytes_relayed;
+    atomic_ulong conns_opened;
+    atomic_ulong conns_closed;
+    atomic_ulong tunnels_opened;
+    atomic_ulong tunnels_closed;
+    atomic_ulong tunnel_bytes[2];   // client to origin, origin to client
+    struct metrics_thread *next;
+} metrics_thread;
+
+/**
+ * appends gauges the metrics module does not know about (pool, cache)
+ * to out[0..cap) in the text format, returns the bytes written.
+ */
+typedef size_t (*metrics_extra_fn)(char *out, size_t cap);
+
+/**
+ * metrics_start serves GET /metrics on 127.0.0.1:"port" from a thread
+ * of its own and starts recording. "extra" may be NULL.
+ * returns 0 on success, -1 if the port could not be opened.
+ */
+int metrics_start(int port, metrics_extra_fn extra);
+
+/**
+ * metrics_enable starts recording without serving, for users of the
+ * timestamps such as the access log.
+ */
+void metrics_enable(void);
+
+/**
+ * metrics_now returns a monotonic timestamp in ns to pass to
+ * metrics_observe, or 0 while metrics are off.
+ */
+long metrics_now(void);
+
+/**
+ * metrics_observe records "now - start" for "stage". A "start" of 0
+ * (metrics off, or the stage was not timed) is ignored. returns the
+ * timestamp it used, so consecutive stages need one clock read each.
+ */
+long metrics_observe(metric_stage stage, long start);
+
+/**
+ * metrics_count_error counts a response the proxy generated itself.
+ */
+void metrics_count_error(int code);
+
+/**
+ * metrics_add_bytes counts bytes relayed to clients.
+ */
+void metrics_add_bytes(size_t n);
+
+/**
+ * metrics_conn_opened and metrics_conn_closed track client
+ * connections, both must be called on the same thread for a
+ * connection.
+ */
+void metrics_conn_opened(void);
+void metrics_conn_closed(void);
+
+/**
+ * metrics_tunnel_opened counts an established CONNECT tunnel,
+ * metrics_tunnel_closed its end and the bytes it carried each way.
+ * Both are called on the tunnel's thread.
+ */
+void metrics_tunnel_opened(void);
+void metrics_tunnel_closed(unsigned long long up, unsigned long long down);
+
+/**
+ * metrics_render writes the whole exposition to out[0..cap) and
+ * returns its length, the admin thread's scrape handler.
+ */
+size_t metrics_render(char *out, size_t cap);
+
+/**
+ * metrics_shutdown stops the admin thread and frees the thread blocks.
+ * Nothing may record anymore.
+ */
+void metrics_shutdown(void);
+
+#endif
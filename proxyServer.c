@@ -1,25 +1,319 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "threadpool.h"
-
-#define MAX_REQUEST_LEN 2048
-#define MAX_FILTER_LEN 256
+#include "filter.h"
+#include "reactor.h"
+#include "dns.h"
+#include "http.h"
+#include "upstream.h"
+#include "relay.h"
+#include "cache.h"
+#include "listener.h"
+#include "metrics.h"
+#include "timer.h"
+#include "coro.h"
+#include "slab.h"
+#include "buf.h"
+#include "coalesce.h"
+#include "accesslog.h"
+
+#define REQUEST_HEADER_MAX (32 * 1024) // largest request header taken, unless PROXY_MAX_HEADER_KB says otherwise
 #define MAX_HOST_LEN 256
 #define MAX_METHOD_LEN 2048
 #define MAX_PATH_LEN 2048
 #define MAX_PROTOCOL_LEN 2048
 #define MAX_IP_LEN 46 // maximum length of IPv6 address in textual representation
 #define MAX_RESPONSE_LEN 1024 // Maximum response length (in bytes)
-#define TIMEOUT_SECS 10 // Timeout value in seconds
-
+#define MAX_LOOPS 64 // maximum number of event loop threads
+#define CLIENT_IDLE_SECS 15 // close a keep-alive client idle for this long
+#define CLIENT_MAX_REQUESTS 100 // requests served on one client connection
+#define HEADER_TIMEOUT_SECS 10 // for the rest of a request header once it started
+#define CONNECT_TIMEOUT_SECS 5 // for a new origin connection
+#define FIRST_BYTE_TIMEOUT_SECS 30 // from sending the request to the first response byte
+#define RELAY_IDLE_SECS 30 // a response that makes no progress for this long is dropped
+#define TUNNEL_IDLE_SECS 300 // a CONNECT tunnel quiet both ways for this long is closed
+#define LOOP_TICK_MS 100 // timer wheel resolution
+#define RETRY_AFTER_SECS 1 // what a 503 asks the client to wait
+#define SHED_DRAIN_LEN 4096 // request bytes read off a shed connection before closing it
+#define COALESCE_WAIT_SECS 5 // a request attached to another's fetch fetches on its own after this
+#define HEAD_ROOM 1024 // relay buffer bytes left free while a response header is read, it grows when rewritten
+
+
+/**
+ * one event loop thread, it owns every connection it accepted
+ */
+struct proxy_loop {
+    reactor *r;
+    pthread_t thread;
+    int active;                 // connections still open on this loop
+    int accepting;              // 0 once max-number-of-request was reached
+    int listen_fd;              // server_fd, or the loop's own SO_REUSEPORT socket
+    int cpu;                    // the CPU the loop is pinned to, -1 if not pinned
+    reactor_acceptor acceptor;
+    int max_active;             // PROXY_MAX_CONNS share of the loop, 0 for no cap
+    int paused;                 // accepting stopped at max_active, see admit
+    char shed_page[MAX_RESPONSE_LEN]; // the 503 for connections over the cap
+    int shed_len;
+    time_t shed_date;           // second shed_page was rendered in
+    reactor_task stop_task;
+    struct conn *idle_head;     // keep-alive clients waiting for a request,
+    struct conn *idle_tail;     // longest idle first
+    timer_wheel timers;         // connection deadlines
+    relay_cache relay;          // pipes and buffers lent to relaying connections
+    slab_cache conns;           // where this loop's conns come from
+    buf_pool bufs;              // segments the conns receive requests into
+};
+
+/**
+ * what a connection's deadline is waiting for, at most one at a time
+ */
+enum conn_deadline {
+    DEADLINE_IDLE,      // the next request of a keep-alive client
+    DEADLINE_HEADER,    // the rest of the request header
+    DEADLINE_CONNECT,   // the origin connection
+    DEADLINE_FIRST_BYTE,// the origin's answer
+    DEADLINE_RELAY,     // progress sending the response
+    DEADLINE_FILL       // another request's fetch of the same response
+};
+
+/**
+ * the states a client/origin pair goes through
+ */
+enum conn_state {
+    CONN_READ_REQUEST,  // reading the request header from the client
+    CONN_RESOLVING,     // waiting for the resolver
+    CONN_WAIT_UPSTREAM, // the origin is at its connection cap
+    CONN_CONNECTING,    // non-blocking connect to the origin in progress
+    CONN_SEND_REQUEST,  // writing the modified request to the origin
+    CONN_SEND_BODY,     // streaming the request body up, the response may already come down
+    CONN_RELAY,         // copying the response from the origin to the client
+    CONN_SEND_CACHED,   // writing a cached response
+    CONN_WAIT_FILL,     // attached to another request's fetch of the same response
+    CONN_SEND_FILL,     // writing that response as it comes in
+    CONN_SEND_ERROR,    // writing an error response, then close
+    CONN_TUNNEL,        // CONNECT: copying bytes both ways until both sides are done
+    CONN_CLOSED
+};
+
+/**
+ * one direction of a CONNECT tunnel, or a request body on its way up.
+ * Like the response relay it borrows a pipe (or a buffer when splice
+ * is off) only while it holds bytes not yet sent, so an idle tunnel
+ * costs two sockets and its conn, and an upload of any size a pipe.
+ */
+struct tunnel_dir {
+    int pipe_fd[2];
+    size_t piped;
+    char *buf;                  // buf[off..len) is unsent
+    size_t off;
+    size_t len;
+    int eof;                    // the sender shut down its side, and we passed it on
+    unsigned long long bytes;   // delivered so far
+};
+
+/**
+ * what a pipeline step that may block came to
+ */
+enum step {
+    STEP_AGAIN,         // a socket would block, await it
+    STEP_DONE,
+    STEP_RETRY,         // the pooled origin connection was stale, open a fresh one
+    STEP_FAILED,        // answer with a 500 if nothing was sent yet, else close
+    STEP_CLOSE          // close the connection
+};
+
+struct conn {
+    struct proxy_loop *loop;
+    coro co;                    // where conn_run is in the pipeline
+    enum conn_state state;      // what it is waiting for, for deadlines and metrics
+    int error_status;           // error page to answer with instead of carrying on
+    int client_fd;
+    int origin_fd;
+    reactor_handler client_h;
+    reactor_handler origin_h;
+    uint32_t origin_events;     // seen since the origin connect started
+    reactor_task task;          // resumes after another thread answered, then the deferred free
+    int waiting;                // 1 until the resolver or an upstream slot answered
+
+    buf_seg *rx;                // request bytes, from the loop's pool
+    char *request_buf;          // rx->data
+    size_t request_len;
+    size_t header_len;          // end of the current request, pipelined ones follow
+    char saved;                 // byte replaced by the NUL ending the current request
+    http_body upload;           // framing of the request body, HF_DONE once it was all sent
+    size_t body_buffered;       // body bytes that arrived with the header, they follow it in rx
+    int client_keep_alive;      // the client will send another request
+    int requests_served;
+    timer deadline;
+    enum conn_deadline deadline_kind;
+    int idle;                   // 1 while on the loop's idle list
+    struct conn *idle_prev;
+    struct conn *idle_next;
+    int port1;
+    dns_query dns;              // resolved once, used for filtering and connecting
+    upstream_pool *upstream;    // pool of the origin connection
+    int upstream_held;          // 1 while we hold a slot in that pool
+    upstream_waiter upstream_w;
+    int reused;                 // origin_fd came idle from the pool
+
+    cache_entry *hit;           // cached response being sent or revalidated
+    size_t hit_off;
+    size_t conn_off;            // of the Connection line in the stored response sent, 0 if none
+    int revalidating;           // status of the conditional request not known yet
+    int not_modified;           // the origin answered 304, serve "hit"
+    char *capture;              // copy of a response that may be stored
+    size_t capture_len;
+    size_t capture_cap;
+    int capture_borrowed;       // capture is a relay buffer of the loop, not malloc'd
+    int capturing;
+    int capture_checked;        // cache_storable was asked about the header
+    coalesce_fill *fill;        // the fetch this request leads or is attached to
+    coalesce_waiter fill_w;
+    int fill_leader;            // we fetch, requests attached to "fill" get what we relay
+    int fill_bypass;            // fetch on our own, waiting for another fetch came to nothing
+    int fill_posted;            // a wakeup from a fill we left is still queued
+    reactor_task fill_task;     // runs when the fill we wait for has news
+
+    size_t resp_len;            // of response
+    size_t resp_off;
+    char *rbuf;                 // borrowed relay buffer, rbuf[roff..rlen) is unsent
+    size_t rlen;
+    size_t roff;
+    size_t rheld;               // bytes of a header block still being read, held back at the end of rbuf[..rlen)
+    int pipe_fd[2];             // borrowed splice pipe, "piped" bytes are in it
+    size_t piped;
+    size_t relayed;             // response bytes already sent to the client
+
+    int tunnel;                 // the request is a CONNECT
+    struct tunnel_dir up;       // client to origin
+    struct tunnel_dir down;     // origin to client
+
+    long t_start;               // metrics_now() at the first byte of the request, 0 if none
+    long t_mark;                // start of the stage in progress
+    long t_origin;              // the request went to the origin, 0 if it did not
+    long origin_ns;             // from t_origin to the last response byte, 0 until then
+    int status;                 // the client was answered with, 0 if not known yet
+    struct in_addr client_addr; // for the access log
+    int got_first_byte;         // the origin's response has started
+
+    // The buffers last: a recycled conn is cleared up to here only,
+    // and each buffer is written, or set up by its init call, before
+    // it is read
+    http_request req;           // spans of the current request in request_buf
+    http_framing framing;       // where the origin's response ends
+    buf_chain out;              // what the origin is sent first, mostly pieces of rx
+    char method1[MAX_METHOD_LEN];
+    char path1[MAX_PATH_LEN];
+    char protocol1[MAX_PROTOCOL_LEN];
+    char host1[MAX_HOST_LEN];
+    char cache_key[MAX_HOST_LEN + MAX_PATH_LEN + 16]; // "" if the request bypasses the cache
+    char validators[2 * (CACHE_MAX_VALIDATOR + 24)]; // If-None-Match/If-Modified-Since we add
+    char response[MAX_RESPONSE_LEN]; // error pages we generate ourselves
+};
+
+static void conn_run(struct conn *c);
 
-void *handle_client(void *args);
 char *filter_file;
+static threadpool *pool;
+static int server_fd; // shared by all loops, -1 when each has its own
+static int max_requests;
+static size_t max_header_len = REQUEST_HEADER_MAX;
+static atomic_int accepted;
+static atomic_int accept_closed;
+static struct proxy_loop loops[MAX_LOOPS];
+static int num_loops;
+static atomic_int splice_disabled; // PROXY_SPLICE=0, or the kernel refused
+static atomic_int stats_requested; // SIGUSR1, printed by the first loop's tick
+static int overload_pause; // PROXY_OVERLOAD=pause
+static atomic_ulong shed_total; // connections answered 503 at accept
+static atomic_ulong pauses_total; // times a loop stopped accepting at its cap
+static int coalesce_secs = COALESCE_WAIT_SECS; // PROXY_COALESCE_SECS, 0 turns coalescing off
+
+static void on_sighup(int sig) {
+    (void)sig;
+    filter_request_reload();
+    accesslog_reopen();
+}
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    atomic_store(&stats_requested, 1);
+}
+
+// the pool's and admission's gauges for the metrics endpoint
+static size_t pool_metrics(char *out, size_t cap) {
+    threadpool_stats st;
+    threadpool_get_stats(pool, &st);
+    coalesce_stats cs;
+    coalesce_get_stats(&cs);
+    accesslog_stats ls;
+    accesslog_get_stats(&ls);
+    int n = snprintf(out, cap,
+                     "# HELP proxy_pool_threads Resolver pool workers running.\n"
+                     "# TYPE proxy_pool_threads gauge\n"
+                     "proxy_pool_threads %d\n"
+                     "# HELP proxy_pool_idle_threads Resolver pool workers waiting for a job.\n"
+                     "# TYPE proxy_pool_idle_threads gauge\n"
+                     "proxy_pool_idle_threads %d\n"
+                     "# HELP proxy_pool_queued_jobs Jobs waiting for a resolver pool worker.\n"
+                     "# TYPE proxy_pool_queued_jobs gauge\n"
+                     "proxy_pool_queued_jobs %ld\n"
+                     "# HELP proxy_pool_spawned_total Workers the pool started while growing.\n"
+                     "# TYPE proxy_pool_spawned_total counter\n"
+                     "proxy_pool_spawned_total %lu\n"
+                     "# HELP proxy_pool_retired_total Workers that retired while idle.\n"
+                     "# TYPE proxy_pool_retired_total counter\n"
+                     "proxy_pool_retired_total %lu\n"
+                     "# HELP proxy_pool_refused_total Lookups refused, the pool queue was full.\n"
+                     "# TYPE proxy_pool_refused_total counter\n"
+                     "proxy_pool_refused_total %lu\n"
+                     "# HELP proxy_pool_dropped_total Lookups dropped after waiting too long.\n"
+                     "# TYPE proxy_pool_dropped_total counter\n"
+                     "proxy_pool_dropped_total %lu\n"
+                     "# HELP proxy_shed_connections_total Connections answered 503 at accept.\n"
+                     "# TYPE proxy_shed_connections_total counter\n"
+                     "proxy_shed_connections_total %lu\n"
+                     "# HELP proxy_accept_pauses_total Times a loop stopped accepting at its cap.\n"
+                     "# TYPE proxy_accept_pauses_total counter\n"
+                     "proxy_accept_pauses_total %lu\n"
+                     "# HELP proxy_coalesce_fills_total Origin fetches other requests could attach to.\n"
+                     "# TYPE proxy_coalesce_fills_total counter\n"
+                     "proxy_coalesce_fills_total %lu\n"
+                     "# HELP proxy_coalesce_attached_total Requests that attached to another's fetch.\n"
+                     "# TYPE proxy_coalesce_attached_total counter\n"
+                     "proxy_coalesce_attached_total %lu\n"
+                     "# HELP proxy_coalesce_shared_total Attached requests answered from that fetch.\n"
+                     "# TYPE proxy_coalesce_shared_total counter\n"
+                     "proxy_coalesce_shared_total %lu\n"
+                     "# HELP proxy_access_log_written_total Access log records written.\n"
+                     "# TYPE proxy_access_log_written_total counter\n"
+                     "proxy_access_log_written_total %lu\n"
+                     "# HELP proxy_access_log_dropped_total Access log records dropped, the writer fell behind.\n"
+                     "# TYPE proxy_access_log_dropped_total counter\n"
+                     "proxy_access_log_dropped_total %lu\n",
+                     st.threads, st.idle, st.queued, st.spawned, st.retired, st.refused, st.dropped,
+                     atomic_load(&shed_total), atomic_load(&pauses_total),
+                     cs.fills, cs.attached, cs.shared, ls.written, ls.dropped);
+    return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+static void on_accept(void *arg, int client_fd);
+static void *run_loop(void *arg);
+static void loop_tick(void *arg);
 
 int main(int argc, char *argv[]) {
 
@@ -30,7 +324,7 @@ int main(int argc, char *argv[]) {
 
     int port = atoi(argv[1]);
     int pool_size = atoi(argv[2]);
-    int max_requests = atoi(argv[3]);
+    max_requests = atoi(argv[3]);
     filter_file = argv[4];
 
     // Check if the filter file exists
@@ -43,313 +337,467 @@ int main(int argc, char *argv[]) {
 //        return EXIT_FAILURE;
 //    }
 
-
-    threadpool *pool = create_threadpool(pool_size);
+    // Compile the filter once; SIGHUP or editing the file reloads it
+    if (filter_init(filter_file) != 0) {
+        fprintf(stderr, "Filter file %s could not be loaded\n", filter_file);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sighup;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The pool only runs blocking or CPU work (getaddrinfo lookups),
+    // the sockets themselves are driven by the event loops.
+    // PROXY_POOL_QUEUE=locked uses the mutex/condvar job queue instead of the lock-free ring,
+    // PROXY_POOL_QUEUE=stealing gives every worker a deque of its own
+    const char *queue_env = getenv("PROXY_POOL_QUEUE");
+    threadpool_queue queue = TP_QUEUE_LOCKFREE;
+    if (queue_env != NULL && strcmp(queue_env, "locked") == 0) {
+        queue = TP_QUEUE_LOCKED;
+    } else if (queue_env != NULL && strcmp(queue_env, "stealing") == 0) {
+        queue = TP_QUEUE_STEALING;
+    }
+    // PROXY_POOL_MIN=n starts n workers and grows up to <pool-size> under load
+    const char *min_env = getenv("PROXY_POOL_MIN");
+    int pool_min = min_env != NULL ? atoi(min_env) : pool_size;
+    if (pool_min < 1 || pool_min > pool_size) {
+        pool_min = pool_size;
+    }
+    pool = create_threadpool_elastic(pool_min, pool_size, TP_IDLE_TIMEOUT_MS, queue);
     if (pool == NULL) {
         perror( "Failed to create thread pool\n");
         return EXIT_FAILURE;
     }
+    // PROXY_POOL_DEPTH=n lets n lookups wait for a worker, more are answered 503,
+    // PROXY_POOL_BUDGET_MS=n drops lookups that waited longer than n ms (0: no limit)
+    const char *depth_env = getenv("PROXY_POOL_DEPTH");
+    const char *budget_env = getenv("PROXY_POOL_BUDGET_MS");
+    threadpool_set_admission(pool, depth_env != NULL ? atoi(depth_env) : TP_ADMIT_DEPTH,
+                             budget_env != NULL ? atoi(budget_env) : TP_ADMIT_BUDGET_MS);
+
+    // PROXY_MAX_HEADER_KB=n takes request headers up to n KB (64 at most), larger ones get a 431
+    const char *header_env = getenv("PROXY_MAX_HEADER_KB");
+    if (header_env != NULL && atoi(header_env) > 0) {
+        max_header_len = (size_t)atoi(header_env) * 1024;
+    }
+    if (max_header_len > BUF_MAX_LEN - 1) {
+        max_header_len = BUF_MAX_LEN - 1; // the largest segment, less the NUL after the header
+    }
+
+    // PROXY_SPLICE=0 relays bodies through user-space buffers only
+    const char *splice_env = getenv("PROXY_SPLICE");
+    if (splice_env != NULL && strcmp(splice_env, "0") == 0) {
+        atomic_store(&splice_disabled, 1);
+    }
 
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    // PROXY_CACHE_MB=0 turns the response cache off
+    const char *cache_env = getenv("PROXY_CACHE_MB");
+    cache_init((size_t)(cache_env != NULL ? atol(cache_env) : CACHE_DEFAULT_MB) * 1024 * 1024);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("Socket creation failed\n");
+    // PROXY_COALESCE_SECS=n lets identical cacheable GETs wait up to n seconds
+    // for one origin fetch to share, 0 sends each one to the origin
+    const char *coalesce_env = getenv("PROXY_COALESCE_SECS");
+    if (coalesce_env != NULL) {
+        coalesce_secs = atoi(coalesce_env);
+    }
+
+    // PROXY_ADMIN_PORT=n serves Prometheus metrics on 127.0.0.1:n
+    const char *admin_env = getenv("PROXY_ADMIN_PORT");
+    if (admin_env != NULL && metrics_start(atoi(admin_env), pool_metrics) != 0) {
         destroy_threadpool(pool);
         return EXIT_FAILURE;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
+    // PROXY_ACCESS_LOG=file appends a JSON line per request to file ("-" for stderr),
+    // SIGHUP reopens it
+    const char *access_env = getenv("PROXY_ACCESS_LOG");
+    if (access_env != NULL) {
+        if (accesslog_start(access_env) != 0) {
+            destroy_threadpool(pool);
+            return EXIT_FAILURE;
+        }
+        metrics_enable(); // for the times it logs
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed\n");
+    // PROXY_DNS_SERVER=ip[:port] queries that server directly and honours its TTLs
+    if (dns_init(pool, getenv("PROXY_DNS_SERVER")) != 0) {
         destroy_threadpool(pool);
-        close(server_fd);
         return EXIT_FAILURE;
     }
 
-    if (listen(server_fd, max_requests) < 0) {
-        perror("Listen failed\n");
-        destroy_threadpool(pool);
-        close(server_fd);
-        return EXIT_FAILURE;
+    // PROXY_LISTEN=reuseport gives every loop its own socket and pins it to a CPU,
+    // PROXY_LISTEN=reuseport-cpu also steers connections to the loop of the CPU they arrive on
+    const char *listen_env = getenv("PROXY_LISTEN");
+    int sharded = listen_env != NULL && strncmp(listen_env, "reuseport", 9) == 0;
+    int steer = sharded && strcmp(listen_env, "reuseport-cpu") == 0;
+
+    // One event loop per core
+    int cpus[MAX_LOOPS];
+    int num_cpus = listener_cpus(cpus, MAX_LOOPS);
+    num_loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (sharded && num_cpus > 0) {
+        num_loops = num_cpus;
+    }
+    if (num_loops < 1) {
+        num_loops = 1;
+    } else if (num_loops > MAX_LOOPS) {
+        num_loops = MAX_LOOPS;
+    }
+
+    // Every socket of a SO_REUSEPORT group is bound before any loop runs
+    server_fd = -1;
+    if (!sharded) {
+        server_fd = listener_open(port, max_requests, 0);
+        if (server_fd == -1) {
+            destroy_threadpool(pool);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].listen_fd = sharded ? listener_open(port, max_requests, 1) : server_fd;
+        loops[i].cpu = sharded && i < num_cpus ? cpus[i] : -1;
+        if (loops[i].listen_fd == -1) {
+            for (int j = 0; j < i; j++) {
+                close(loops[j].listen_fd);
+            }
+            destroy_threadpool(pool);
+            return EXIT_FAILURE;
+        }
+    }
+    // the program's socket index is the CPU number, so CPUs 0..n-1 must map to loops 0..n-1
+    if (steer) {
+        int contiguous = num_cpus == num_loops && cpus[num_loops - 1] == num_loops - 1;
+        if (!contiguous || listener_steer_by_cpu(loops[0].listen_fd) != 0) {
+            fprintf(stderr, "CPU steering not available, connections are spread by hash\n");
+        }
     }
 
   //  printf("Proxy server running on port %d...\n", port);
 
-    int requests_handled = 0;
-    while (requests_handled < max_requests) {
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            perror("Accept failed\n");
-            continue;
+    // PROXY_IO=uring waits for sockets and accepts through io_uring where the kernel allows it
+    const char *io_env = getenv("PROXY_IO");
+    reactor_backend backend = REACTOR_EPOLL;
+    if (io_env != NULL && strcmp(io_env, "uring") == 0) {
+        if (reactor_uring_supported()) {
+            backend = REACTOR_URING;
+        } else {
+            fprintf(stderr, "io_uring not available, using epoll\n");
         }
+    }
 
-        // Create thread to handle client connection
-        dispatch(pool, (dispatch_fn) handle_client, (void*)(intptr_t)client_fd);
+    // PROXY_MAX_CONNS=n keeps at most n client connections open, split across the loops;
+    // past it new ones get a 503, or wait in the backlog with PROXY_OVERLOAD=pause
+    const char *conns_env = getenv("PROXY_MAX_CONNS");
+    int max_conns = conns_env != NULL ? atoi(conns_env) : 0;
+    const char *overload_env = getenv("PROXY_OVERLOAD");
+    overload_pause = overload_env != NULL && strcmp(overload_env, "pause") == 0;
+
+    int started = 0;
+    for (int i = 0; i < num_loops && max_requests > 0; i++) {
+        struct proxy_loop *loop = &loops[i];
+        loop->r = reactor_create_backend(backend);
+        if (loop->r == NULL) {
+            break;
+        }
+        loop->accepting = 1;
+        slab_init(&loop->conns, sizeof(struct conn));
+        buf_pool_init(&loop->bufs);
+        loop->max_active = max_conns > 0 ? (max_conns + num_loops - 1) / num_loops : 0;
+        loop->acceptor.fn = on_accept;
+        loop->acceptor.arg = loop;
+        timer_wheel_init(&loop->timers, LOOP_TICK_MS);
+        reactor_set_tick(loop->r, LOOP_TICK_MS, loop_tick, loop);
+        if (reactor_add_acceptor(loop->r, loop->listen_fd, &loop->acceptor) != 0
+            || pthread_create(&loop->thread, NULL, run_loop, loop) != 0) {
+            perror("error: event loop creation");
+            reactor_destroy(loop->r);
+            break;
+        }
+        if (loop->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(loop->cpu, &set);
+            if (pthread_setaffinity_np(loop->thread, sizeof(set), &set) != 0) {
+                fprintf(stderr, "could not pin event loop %d to CPU %d\n", i, loop->cpu);
+            }
+        }
+        started++;
+    }
 
-        requests_handled++;
+    if (sharded) {
+        // the kernel would still queue connections on the sockets of loops that did not start
+        for (int i = started; i < num_loops; i++) {
+            close(loops[i].listen_fd);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        reactor_destroy(loops[i].r);
     }
 
+    metrics_shutdown();
+    accesslog_shutdown();
     destroy_threadpool(pool);
-    close(server_fd);
+    dns_shutdown();
+    upstream_shutdown();
+    cache_shutdown();
+    if (server_fd != -1) {
+        close(server_fd);
+    }
+    filter_shutdown();
 
-    return EXIT_SUCCESS;
+    return started > 0 || max_requests <= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int parse_port(char* path) {
-    char temp[MAX_PATH_LEN];
-    int default_port = 80;
-    int port;
-    // Remove "http://" from the URL
-    strcpy(temp, path + 7);
-
-    // Extract hostname
-    char *port_separator = strchr(temp, ':');
-    if (port_separator != NULL) {
-
-        // Check if the port that insert is a number
-        char *port_str = port_separator + 1;
-        while (*port_str != '\0' && *port_str != '/') {
-//            if (!isdigit(*port_str)) {
-//                fprintf(stderr, "Invalid port number specified in the URL.\n");
-//                exit(EXIT_FAILURE);
-//            }
-            port_str++;
-        }
+int is_method_supported(const char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "CONNECT") == 0
+        || strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0;
+}
 
-        // Extract port from the substring after the port separator
-        port= atoi(port_separator + 1);
+int is_valid_host(const filter_snapshot *snap, const char *host) {
 
-    } else {
-        // Use the default port
-        port = default_port;
+    if (snap == NULL) {
+        // The filter file could not be loaded
+        return 500;
     }
-    return port;
+    return filter_match_host(snap, host); // 1 is Forbidden
 }
 
-int parse_request(const char *request_str2,char* method1,char* path1,char* protocol1, char* host1) {
-
-    char request_str[strlen(request_str2)];
-    strcpy(request_str,request_str2);
-
-    if (request_str2 == NULL )
-        return 0;
-
-    char *token = strtok(request_str, " \r\n");
-
-    if (token == NULL)
-        return 0;
-
-    strncpy(method1, token, strlen(token));
-    method1[strlen(token)] = '\0';
-   // printf("%s\n",method1);
+int is_ip_in_filter(const filter_snapshot *snap, struct in_addr input_addr) {
 
-    token = strtok(NULL, " \r\n");
-    if (token == NULL)
-        return 0;
-
-    strncpy(path1, token, strlen(token));
-    path1[strlen(token)] = '\0';
-   //  printf("%s\n",path1);
-
-    int port1= parse_port(path1);
+    if (snap == NULL) {
+        return 500;
+    }
 
-    token = strtok(NULL, " \r\n");
-    if (token == NULL)
-        return 0;
+    if (filter_match_ip(snap, input_addr) >= 0) {
+        return 1; // Forbidden
+    }
+    return 0; // Not forbidden
+}
 
-    strncpy(protocol1, token, strlen(token));
-      protocol1[strlen(token)] = '\0';
-    //printf("%s\n",protocol1);
-    // Check if the protocol is not "HTTP/1.0" or "HTTP/1.1"
-    if (strcmp(protocol1, "HTTP/1.0") != 0 && strcmp(protocol1, "HTTP/1.1") != 0) {
-       // printf("Invalid protocol: %s\n", request->protocol);
-        return 0;
+// the Date header line, rendered again when the second changes; the
+// string belongs to the calling thread and lasts until its next call
+const char * currentDate() {
+    static __thread char buffer[64];
+    static __thread time_t rendered = -1;
+    time_t rawtime;
+    struct tm time_info;
+    time(&rawtime);
+    if (rawtime != rendered) {
+        gmtime_r(&rawtime, &time_info);
+        strftime(buffer, sizeof(buffer), "Date: %a, %d %b %Y %H:%M:%S GMT", &time_info);
+        rendered = rawtime;
     }
-    // Read Host header
-    while ((token = strtok(NULL, " \r\n"))) {
-        if (strcmp(token, "Host:") == 0) {
-            token = strtok(NULL, " \r\n");
-            if (token == NULL)
-                return 0;
+    return buffer;
+}
 
-            strncpy(host1, token, strlen(token));
-            host1[strlen(token)] = '\0';
-          //  printf("%s\n",host1);
-            return port1;
+// headers that only concern one connection, never passed on (RFC 7230
+// 6.1). Transfer-Encoding is one too, but bodies are relayed as they came
+static int is_hop_by_hop(const char *name, size_t len) {
+    static const char *const names[] = {
+        "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Trailer",
+        "Upgrade", "Proxy-Authenticate", "Proxy-Authorization",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == len && strncasecmp(name, names[i], len) == 0) {
+            return 1;
         }
     }
-
     return 0;
 }
 
-
-int is_method_supported(const char *method) {
-    return strcmp(method, "GET") == 0;
+// headers kept whatever a Connection header lists: the origin needs
+// Host, and dropping the ones that frame the message would leave the
+// two sides disagreeing on where it ends
+static int must_keep(const char *name, size_t len) {
+    return (len == 4 && strncasecmp(name, "Host", 4) == 0)
+        || (len == 14 && strncasecmp(name, "Content-Length", 14) == 0)
+        || (len == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0);
 }
 
-int is_valid_host(const char *host) {
-
-    FILE *filter_fp = fopen(filter_file, "r");
-    if (filter_fp == NULL) {
-        perror("Error opening filter file");
-        return 500;
-    }
-
-    //   FilterConfig filter;
-    // memset(filter.filter, 0, MAX_FILTER_LEN);
-    char line[MAX_FILTER_LEN];
-    while (fgets(line, MAX_FILTER_LEN, filter_fp) != NULL) {
-        // printf("%s\n",line);
-        if (strstr(line , host) !=NULL) {
-            fclose(filter_fp);
-            return 1; // Forbidden
+// 1 if "name" is one of the comma separated tokens of value[0..len)
+static int token_listed(const char *value, size_t len, const char *name, size_t name_len) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start == name_len && strncasecmp(value + start, name, name_len) == 0) {
+            return 1;
         }
     }
-    fclose(filter_fp);
     return 0;
 }
 
-int is_ip_in_filter(const char *ip) {
-
-   // printf("Checking IP: %s\n", ip);
-    FILE *filter_fp = fopen(filter_file, "r");
-    if (filter_fp == NULL) {
-        perror("Error opening filter file");
-        return 500;
+// 1 if header i of "r" is not for the origin: a hop-by-hop one, or one
+// the client's Connection header names
+static int request_drops(const char *buf, const http_request *r, int i) {
+    const char *name = buf + r->headers[i].name.off;
+    size_t len = r->headers[i].name.len;
+    if (is_hop_by_hop(name, len)) {
+        return 1;
     }
-
-    struct in_addr input_addr;
-    if (inet_pton(AF_INET, ip, &input_addr) != 1) {
-        fprintf(stderr, "Invalid input IP address: %s\n", ip);
-        fclose(filter_fp);
-        return 500;
+    if (must_keep(name, len)) {
+        return 0;
     }
-
-    char line[MAX_FILTER_LEN];
-    while (fgets(line, MAX_FILTER_LEN, filter_fp) != NULL) {
-        char *token = strtok(line, "/");
-        if (token == NULL) {
-            //  fprintf(stderr, "Skipping line (missing IP address)\n");
-            continue;
-        }
-
-        char *subnet_str = strtok(NULL, "/");
-        int subnet_bits = 32; // Default to no subnet (matching any IP)
-
-        if (subnet_str != NULL) {
-            subnet_bits = atoi(subnet_str);
-            if (subnet_bits < 0 || subnet_bits > 32) {
-                //  fprintf(stderr, "Invalid subnet size: %s\n", subnet_str);
-                continue; // Skip invalid subnet sizes
-            }
+    for (int j = 0; j < r->num_headers; j++) {
+        if (r->headers[j].name.len == 10 && strncasecmp(buf + r->headers[j].name.off, "Connection", 10) == 0
+            && token_listed(buf + r->headers[j].value.off, r->headers[j].value.len, name, len)) {
+            return 1;
         }
+    }
+    return 0;
+}
 
-        // Convert IP address to binary form
-        struct in_addr addr;
-        if (inet_pton(AF_INET, token, &addr) != 1) {
-            // fprintf(stderr, "Invalid IP address: %s\n", token);
-            continue; // Skip invalid IP addresses
+/**
+ * the request target target[0..*len) as the origin is sent it: an
+ * absolute URL loses its scheme and host, which end at the first '/'
+ * or '?'. *len is set to the length of what is left, *slash to 1 if
+ * a "/" has to go before it
+ */
+static const char *origin_form(const char *target, size_t *len, int *slash) {
+    if (*len >= 7 && strncasecmp(target, "http://", 7) == 0) {
+        size_t skip = 7;
+        while (skip < *len && target[skip] != '/' && target[skip] != '?') {
+            skip++;
         }
+        target += skip;
+        *len -= skip;
+    }
+    *slash = *len == 0 || *target == '?';
+    return target;
+}
 
-        // Calculate network address
-        uint32_t ip_network = ntohl(addr.s_addr) >> (32 - subnet_bits);
-        uint32_t input_network = ntohl(input_addr.s_addr) >> (32 - subnet_bits);
-
-       // printf("IP Network: %u\n", ip_network);
-        //printf("Input Network: %u\n", input_network);
-
-        if (ip_network == input_network) {
-            fclose(filter_fp);
-            return 1; // Forbidden
+/**
+ * lays the request for the origin out in "out" as pieces of buf, by the
+ * parsed header "r": an absolute URL loses its scheme and host, the
+ * client's hop-by-hop headers and the ones its Connection header lists
+ * are left out, and as the origin connection is pooled, whatever the
+ * client asked for its own connection, the origin is asked to keep
+ * this one open.
+ * The empty line ending the header is left to the caller, who may
+ * add headers first. returns -1 if the chain ran out of room
+ */
+int modified_request(const char *buf, const http_request *r, buf_chain *out) {
+    static const char keep_alive[] = "Connection: keep-alive\r\n";
+    size_t path_len = r->target.len;
+    int slash;
+    const char *path = origin_form(buf + r->target.off, &path_len, &slash);
+    // empty lines the client sent before the request line are dropped
+    int rc = buf_chain_add(out, buf + r->method.off, r->target.off - r->method.off);
+    if (slash) {
+        rc |= buf_chain_add(out, "/", 1);
+    }
+    rc |= buf_chain_add(out, path, path_len);
+
+    // the rest up to the empty line goes as it is, less the dropped lines
+    size_t from = r->target.off + r->target.len;
+    size_t end = r->header_len - 2;
+    for (int i = 0; i < r->num_headers; i++) {
+        if (request_drops(buf, r, i)) {
+            rc |= buf_chain_add(out, buf + from, r->headers[i].name.off - from);
+            from = i + 1 < r->num_headers ? r->headers[i + 1].name.off : end;
         }
     }
-
-    fclose(filter_fp);
-    return 0; // Not forbidden
+    rc |= buf_chain_add(out, buf + from, end - from);
+    rc |= buf_chain_add(out, keep_alive, sizeof(keep_alive) - 1);
+    return rc;
+}
+// our own Connection line on final responses. Both are as long, so a
+// stored response can have its line swapped for each client in place
+static const char connection_keep_alive[] = "Connection: keep-alive\r\n";
+static const char connection_close[] = "Connection: close     \r\n";
+#define CONNECTION_LINE_LEN (sizeof(connection_keep_alive) - 1)
+
+// the next line of p[0..stop), which ends in '\n': *end is where its
+// CR or LF is, returns where the line after it starts
+static const char *next_line(const char *p, const char *stop, const char **end) {
+    const char *nl = (const char *)memchr(p, '\n', stop - p);
+    *end = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+    return nl + 1;
 }
 
-char * currentDate() {
-    time_t rawtime;
-    struct tm* time_info;
-    char *buffer = (char *)malloc(100); // Allocate memory dynamically
-
-    if (buffer == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+static int append(char *out, size_t *n, size_t cap, const char *s, size_t len) {
+    if (*n + len > cap) {
+        return -1;
     }
-    time(&rawtime);
-    time_info = gmtime(&rawtime);
-
-    strftime(buffer, 100, "Date: %a, %d %b %Y %H:%M:%S GMT", time_info);
-
-    char *formattedDate = strdup(buffer);  // Duplicate the string
-    free(buffer);  // Free the original buffer
-    return formattedDate;
+    memcpy(out + *n, s, len);
+    *n += len;
+    return 0;
 }
 
-void modified_request(const char* request_buf, char* modified_request_buf){
-
-    const char *url_start = strstr(request_buf, "http://");
-    if (url_start == NULL) {
-        // If "http://" is not found, copy the original request buffer
-        strcpy(modified_request_buf, request_buf);
-       // return;
+/**
+ * writes the response header block head[0..len), status line to empty
+ * line, to out[0..cap) as the client gets it: the hop-by-hop headers
+ * and the ones the origin's Connection header lists are left out, lines
+ * end in CRLF, and a final response has "conn_line" right after its
+ * status line, where stored_conn_off finds it.
+ * returns the length written, -1 if it does not fit
+ */
+static ssize_t rewrite_response_head(const char *head, size_t len, const char *conn_line,
+                                     char *out, size_t cap) {
+    const char *stop = head + len;
+    const char *listed[8]; // the origin's Connection values
+    size_t listed_len[8];
+    int num_listed = 0;
+    const char *line, *end;
+    for (line = next_line(head, stop, &end); line < stop; ) {
+        const char *next = next_line(line, stop, &end);
+        if (end - line > 11 && strncasecmp(line, "Connection:", 11) == 0 && num_listed < 8) {
+            listed[num_listed] = line + 11;
+            listed_len[num_listed++] = end - line - 11;
+        }
+        line = next;
     }
 
-    // Find the end of the URL
-   else {
-        const char *url_end = strstr(url_start + 7, "/");
-        if (url_end == NULL) {
-            // If no '/' is found after "http://", copy the original request buffer
-            strcpy(modified_request_buf, request_buf);
-            return;
+    size_t n = 0;
+    line = next_line(head, stop, &end);
+    int rc = append(out, &n, cap, head, end - head);
+    rc |= append(out, &n, cap, "\r\n", 2);
+    if (len > 9 && head[9] != '1') {
+        rc |= append(out, &n, cap, conn_line, CONNECTION_LINE_LEN);
+    }
+    int keep = 1;
+    while (line < stop) {
+        const char *next = next_line(line, stop, &end);
+        if (end > line && (*line == ' ' || *line == '\t')) {
+            // continues the header before it
+        } else if (end > line) {
+            const char *colon = (const char *)memchr(line, ':', end - line);
+            size_t name_len = colon != NULL ? (size_t)(colon - line) : 0;
+            keep = name_len > 0 && !is_hop_by_hop(line, name_len);
+            for (int i = 0; keep && i < num_listed && !must_keep(line, name_len); i++) {
+                keep = !token_listed(listed[i], listed_len[i], line, name_len);
+            }
         }
-        // Copy the part of the original request buffer before the URL
-        strncpy(modified_request_buf, request_buf, url_start - request_buf);
-        modified_request_buf[url_start - request_buf] = '\0';
-        strcat(modified_request_buf, url_end);
-    }
-  //in order to close the connection
-   char *connection_close = strstr(modified_request_buf, "Connection: close\r\n");
-   if(connection_close == NULL) {
-       char *connection_keep_alive = strstr(modified_request_buf, "Connection: keep-alive\r\n");
-       if (connection_keep_alive != NULL) {
-           // Find the end of the line
-           char *line_end = strchr(connection_keep_alive, '\r');
-           if (line_end == NULL) {
-               line_end = strchr(connection_keep_alive, '\n');
-           }
-
-           char *keep_alive_end = strstr(connection_keep_alive, "keep-alive");
-           if (keep_alive_end != NULL) {
-               strcpy(keep_alive_end, "close");
-               // Move the rest of the request up to overwrite the remainder of the old line
-               memmove(keep_alive_end + strlen("close"), line_end, strlen(line_end) + 1);
-           }
-           //  }
-
-       } else {
-           // If "Connection: keep-alive" doesn't exist, add "Connection: close" before the empty line
-           char *empty_line = strstr(modified_request_buf, "\r\n\r\n");
-           if (empty_line != NULL) {
-               strcpy(empty_line, "\r\nConnection: close\r\n\r\n");
-           }
-       }
-   }
-    //modified_request_buf[strlen(modified_request_buf)] = '\0'; // Just to be safe
+        if (keep || end == line) {
+            rc |= append(out, &n, cap, line, end - line);
+            rc |= append(out, &n, cap, "\r\n", 2);
+        }
+        line = next;
+    }
+    return rc != 0 ? -1 : (ssize_t)n;
 }
+
 void generate_error_response(char* response, int error_type){
-    char* date=currentDate();
+    const char* date=currentDate();
     char type[50];
     int length;
     char string[50];
     char str[100]="<HTML><HEAD><TITLE>%s</TITLE></HEAD><BODY><H4>%s</H4>%s</BODY></HTML>";
+    char retry[32]="";
     int str_len= strlen(str);
     switch(error_type){
         case 400:
@@ -393,10 +841,37 @@ void generate_error_response(char* response, int error_type){
             string[strlen(string)]='\0';
             length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
             break;
+        case 408:
+            strcpy(type,"408 Request Timeout");
+            strcpy(string,"The request did not arrive in time.");
+            length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
+            break;
+        case 431:
+            strcpy(type,"431 Request Header Fields Too Large");
+            strcpy(string,"The request header is too large.");
+            length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
+            break;
+        case 417:
+            strcpy(type,"417 Expectation Failed");
+            strcpy(string,"Only 100-continue is supported.");
+            length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
+            break;
+        case 504:
+            strcpy(type,"504 Gateway Timeout");
+            strcpy(string,"The server did not answer in time.");
+            length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
+            break;
+        case 503:
+            strcpy(type,"503 Service Unavailable");
+            strcpy(string,"The proxy is overloaded, try again shortly.");
+            length=str_len+ strlen(type)+ strlen(type)+ strlen(string);
+            snprintf(retry, sizeof(retry), "Retry-After: %d\r\n", RETRY_AFTER_SECS);
+            break;
     }
     snprintf(response, MAX_RESPONSE_LEN, "HTTP/1.1 %s\r\n"
                                          "Server: webserver/1.0\r\n"
                                          "%s\r\n"
+                                         "%s"
                                          "Content-Type: text/html\r\n"
                                          "Content-Length: %d\r\n"
                                          "Connection: close\r\n"
@@ -404,162 +879,1981 @@ void generate_error_response(char* response, int error_type){
                                          "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n"
                                          "<BODY><H4>%s</H4>\r\n"
                                          "%s\r\n"
-                                         "</BODY></HTML>\n",type,date,length,type,type,string);
+                                         "</BODY></HTML>\n",type,date,retry,length,type,type,string);
     response[strlen(response)]='\0';
-    free(date);
 }
 
-void connect_and_forward_request(const char *host, const char *request_buf, ssize_t request_len, int client_fd, int port) {
-    //printf("%s\n",host);
-    char response[MAX_RESPONSE_LEN];
+static void *run_loop(void *arg) {
+    struct proxy_loop *loop = (struct proxy_loop *)arg;
+    reactor_run(loop->r);
+    relay_cache_destroy(&loop->relay);
+    slab_destroy(&loop->conns);
+    buf_pool_destroy(&loop->bufs);
+    return NULL;
+}
+
+static void set_deadline(struct conn *c, enum conn_deadline kind, int secs) {
+    c->deadline_kind = kind;
+    timer_add(&c->loop->timers, &c->deadline, secs * 1000L);
+}
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        generate_error_response(response,500);
-        send(client_fd, response, strlen(response)+1, 0);
+static void idle_add(struct conn *c) {
+    struct proxy_loop *loop = c->loop;
+    if (c->idle) {
         return;
-       // exit(EXIT_FAILURE);
     }
+    c->idle = 1;
+    set_deadline(c, DEADLINE_IDLE, CLIENT_IDLE_SECS);
+    c->idle_next = NULL;
+    c->idle_prev = loop->idle_tail;
+    if (loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = c;
+    } else {
+        loop->idle_head = c;
+    }
+    loop->idle_tail = c;
+}
 
-    struct hostent *server = gethostbyname(host);
-    if (server == NULL) {
-        herror("Error failed to resolve: gethostbyname");
-        close(sockfd);
-        generate_error_response(response,500);
-        send(client_fd, response, strlen(response), 0);
+static void idle_remove(struct conn *c) {
+    struct proxy_loop *loop = c->loop;
+    if (!c->idle) {
         return;
-       // exit(EXIT_FAILURE);//instead 500
     }
+    c->idle = 0;
+    if (c->idle_prev != NULL) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        loop->idle_head = c->idle_next;
+    }
+    if (c->idle_next != NULL) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        loop->idle_tail = c->idle_prev;
+    }
+}
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    //printf("%d\n",port);
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+static void conn_close(struct conn *c);
+static void capture_stop(struct conn *c);
+static void fill_done(struct conn *c, int complete);
+
+// every LOOP_TICK_MS: run the deadlines that passed
+static void loop_tick(void *arg) {
+    struct proxy_loop *loop = (struct proxy_loop *)arg;
+    timer_advance(&loop->timers);
+    if (loop == &loops[0] && atomic_exchange(&stats_requested, 0)) {
+        threadpool_stats st;
+        threadpool_get_stats(pool, &st);
+        fprintf(stderr, "pool: %d threads (%d..%d), %d idle, %ld queued, %lu spawned, %lu retired\n",
+                st.threads, st.min_threads, st.max_threads, st.idle, st.queued, st.spawned, st.retired);
+        fprintf(stderr, "admission: %lu lookups refused, %lu dropped, %lu connections shed, %lu pauses\n",
+                st.refused, st.dropped, atomic_load(&shed_total), atomic_load(&pauses_total));
+        coalesce_stats cs;
+        coalesce_get_stats(&cs);
+        fprintf(stderr, "coalescing: %lu fetches shared, %lu requests attached, %lu answered from them\n",
+                cs.fills, cs.attached, cs.shared);
+        if (accesslog_enabled()) {
+            accesslog_stats ls;
+            accesslog_get_stats(&ls);
+            fprintf(stderr, "access log: %lu records written, %lu dropped\n", ls.written, ls.dropped);
+        }
+    }
+}
 
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sockfd);
-        generate_error_response(response,500);
-        send(client_fd, response, strlen(response), 0);
+// runs on every loop once max-number-of-request connections were accepted
+static void stop_accepting(void *arg) {
+    struct proxy_loop *loop = (struct proxy_loop *)arg;
+    if (!loop->accepting) {
         return;
-       // exit(EXIT_FAILURE);//instead 500
     }
+    loop->accepting = 0;
+    reactor_del(loop->r, loop->listen_fd);
+    if (loop->listen_fd != server_fd) {
+        close(loop->listen_fd);
+    }
+    // keep-alive clients get no further requests, new ones get their first
+    struct conn *c = loop->idle_head;
+    while (c != NULL) {
+        struct conn *next = c->idle_next;
+        if (c->requests_served > 0) {
+            conn_close(c);
+        }
+        c = next;
+    }
+    if (loop->active == 0) {
+        reactor_stop(loop->r);
+    }
+}
 
-    int bytes_sent1;
-    bytes_sent1 = send(sockfd, request_buf, request_len, 0);
-    if (bytes_sent1 < 0) {
-        perror("Error sending request");
-        close(sockfd);
-        generate_error_response(response,500);
-        send(client_fd, response, strlen(response), 0);
+static void close_listener_everywhere(void) {
+    if (atomic_exchange(&accept_closed, 1)) {
         return;
-       // exit(EXIT_FAILURE);//instead 500
     }
-
-    int bytes_received;
-    while ((bytes_received = recv(sockfd, response ,MAX_RESPONSE_LEN-1, 0)) > 0  ) {
-        response[bytes_received] = '\0';
-       // printf("%s\n",response);
-        // Send the response to the client
-        ssize_t bytes_sent = send(client_fd, response, bytes_received, 0);
-        if (bytes_sent < bytes_received) {
-            perror("Sending response to client failed");
-            generate_error_response(response,500);
-            send(client_fd, response, strlen(response), 0);
-            if((bytes_received = recv(sockfd, response ,MAX_RESPONSE_LEN-1, 0))<=0)
-                send(client_fd, "\n", strlen(response), 0);
-            return;
+    for (int i = 0; i < num_loops; i++) {
+        if (loops[i].r == NULL) {
+            continue;
         }
+        loops[i].stop_task.fn = stop_accepting;
+        loops[i].stop_task.arg = &loops[i];
+        reactor_post(loops[i].r, &loops[i].stop_task);
     }
-    if (bytes_received < 0) {
-        perror("Error receiving response");
-        close(sockfd);
-        generate_error_response(response,500);
-        send(client_fd, response, strlen(response), 0);
-        return;
-      //  exit(EXIT_FAILURE);//instead 500
+}
+
+static void conn_free(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    buf_chain_reset(&c->loop->bufs, &c->out);
+    buf_put(&c->loop->bufs, c->rx);
+    slab_free(&c->loop->conns, c);
+}
+
+// copies what of "src" fits an access log field, NUL-terminated if it all does
+static void copy_field(char *field, size_t size, const char *src) {
+    size_t n = strnlen(src, size);
+    memcpy(field, src, n);
+    if (n < size) {
+        field[n] = '\0';
     }
+}
 
-    close(sockfd);
+/**
+ * hands the request just answered to the access log, "now" being when
+ * it was. Never waits: with the writer behind, the record is dropped
+ */
+static void log_request(struct conn *c, long now) {
+    accesslog_record *r = accesslog_reserve();
+    if (r == NULL) {
+        return;
+    }
+    r->client = c->client_addr;
+    // ours, or the origin's as relayed
+    r->status = c->status != 0 ? c->status : c->framing.status;
+    r->bytes = c->relayed;
+    if (c->t_origin == 0) {
+        r->upstream_us = -1;
+    } else {
+        r->upstream_us = (c->origin_ns != 0 ? c->origin_ns : now - c->t_origin) / 1000;
+    }
+    r->total_us = (now - c->t_start) / 1000;
+    copy_field(r->method, sizeof(r->method), c->method1);
+    copy_field(r->host, sizeof(r->host), c->host1);
+    copy_field(r->path, sizeof(r->path), c->path1);
+    accesslog_commit(r);
 }
 
-void *handle_client(void *args) {
-    int client_fd = (int)(intptr_t)args;
-    char recieve[MAX_REQUEST_LEN]="\0";
-    char request_buf[MAX_REQUEST_LEN] ="\0";
-    int bytes_received=0;
+static void conn_close(struct conn *c) {
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+    if (c->t_start != 0) {
+        // a request cut short, or answered with an error page
+        metrics_add_bytes(c->relayed);
+        log_request(c, metrics_observe(METRIC_TOTAL, c->t_start));
+    }
+    metrics_conn_closed();
+    if (c->state == CONN_TUNNEL) {
+        metrics_tunnel_closed(c->up.bytes, c->down.bytes);
+    }
+    c->state = CONN_CLOSED;
+    idle_remove(c);
+    timer_cancel(&c->deadline);
+    reactor_del(c->loop->r, c->client_fd);
+    close(c->client_fd);  // Close the client file descriptor
+    if (c->origin_fd >= 0) {
+        reactor_del(c->loop->r, c->origin_fd);
+    }
+    if (c->upstream_held) {
+        upstream_release(c->upstream, c->origin_fd, 0); // closes origin_fd
+    } else if (c->origin_fd >= 0) {
+        close(c->origin_fd);
+    }
+    if (c->rbuf != NULL) {
+        relay_buf_put(&c->loop->relay, c->rbuf);
+    }
+    if (c->pipe_fd[0] >= 0) {
+        relay_pipe_put(&c->loop->relay, c->pipe_fd, c->piped > 0);
+    }
+    if (c->hit != NULL) {
+        cache_release(c->hit);
+    }
+    capture_stop(c);
+    fill_done(c, 0);
+    struct tunnel_dir *dirs[2] = {&c->up, &c->down};
+    for (int i = 0; i < 2; i++) {
+        if (dirs[i]->buf != NULL) {
+            relay_buf_put(&c->loop->relay, dirs[i]->buf);
+        }
+        if (dirs[i]->pipe_fd[0] >= 0) {
+            relay_pipe_put(&c->loop->relay, dirs[i]->pipe_fd, dirs[i]->piped > 0);
+        }
+    }
+
+    // events for this connection may still be queued in the current batch,
+    // and a fill may have posted it a wakeup that frees it once it runs
+    c->task.fn = conn_free;
+    c->task.arg = c;
+    if (!c->fill_posted) {
+        reactor_defer(c->loop->r, &c->task);
+    }
+
+    struct proxy_loop *loop = c->loop;
+    loop->active--;
+    if (!loop->accepting && loop->active == 0) {
+        reactor_stop(loop->r);
+    }
+    // a paused loop takes connections again once an eighth of its cap is free
+    if (loop->paused && loop->accepting && loop->active < loop->max_active - loop->max_active / 8) {
+        loop->paused = 0;
+        if (reactor_resume_acceptor(loop->r, &loop->acceptor) != 0) {
+            perror("error: resume accepting");
+        }
+    }
+}
 
+static void send_error(struct conn *c, int error_type) {
+    metrics_count_error(error_type);
+    c->status = error_type;
+    generate_error_response(c->response, error_type);
+    c->resp_len = strlen(c->response);
+    c->resp_off = 0;
+    c->state = CONN_SEND_ERROR;
+    set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+}
 
-    char method1[MAX_METHOD_LEN]="\0";
-    char path1[MAX_PATH_LEN]="\0";
-    char protocol1[MAX_PROTOCOL_LEN]="\0";
-    char host1[MAX_HOST_LEN]="\0";
-    int  port1=0;
+// gives up on the origin connection, it is closed rather than pooled
+static void drop_origin(struct conn *c) {
+    if (c->origin_fd >= 0) {
+        reactor_del(c->loop->r, c->origin_fd);
+    }
+    if (c->upstream_held) {
+        upstream_release(c->upstream, c->origin_fd, 0); // closes origin_fd
+        c->upstream_held = 0;
+    } else if (c->origin_fd >= 0) {
+        close(c->origin_fd);
+    }
+    c->origin_fd = -1;
+}
 
-    while ((bytes_received = recv(client_fd, recieve, sizeof(recieve), 0)) > 0) {
-        recieve[bytes_received] = '\0';
-        strcat(request_buf, recieve);
-        char* endloop = strstr(request_buf, "\r\n\r\n");
-        if (endloop != NULL) {
+/**
+ * the connection's deadline passed: a client that never finished its
+ * header gets 408, one whose origin did not connect or answer in time
+ * gets 504, one attached to another request's fetch for too long
+ * fetches on its own, anything else is closed. Waiting for the
+ * resolver or for an upstream slot has no deadline of its own; both
+ * end on their own (the resolver's retries are bounded, and slots
+ * free up as other requests finish or time out).
+ */
+static void on_deadline(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    switch (c->state) {
+        case CONN_READ_REQUEST:
+            if (c->request_len == 0) {
+                conn_close(c); // idle keep-alive client, or one that never sent anything
+                return;
+            }
+            c->client_keep_alive = 0;
+            c->error_status = 408;
             break;
-        }
+        case CONN_WAIT_FILL:
+            fill_done(c, 0); // the request fetches on its own
+            conn_run(c);
+            return;
+        case CONN_RESOLVING:
+        case CONN_WAIT_UPSTREAM:
+            // a deadline left over from an earlier step, these end on their own
+            return;
+        case CONN_SEND_BODY:
+            if (c->relayed == 0 && c->up.buf == NULL && c->up.piped == 0) {
+                // the origin takes what it gets, the client stopped sending the body
+                drop_origin(c);
+                c->client_keep_alive = 0;
+                c->error_status = 408;
+                break;
+            }
+            // fall through
+        case CONN_CONNECTING:
+        case CONN_SEND_REQUEST:
+        case CONN_RELAY:
+            if (c->relayed > 0) {
+                conn_close(c); // too late for an error page
+                return;
+            }
+            drop_origin(c);
+            c->error_status = 504;
+            break;
+        default:
+            conn_close(c); // the client stopped taking what we send
+            return;
+    }
+    conn_run(c); // the pipeline leaves its step for the error page
+}
+
+static void on_client_event(void *arg, uint32_t events) {
+    (void)events;
+    struct conn *c = (struct conn *)arg;
+    if (c->state != CONN_CLOSED) {
+        conn_run(c);
+    }
+}
+
+static void on_origin_event(void *arg, uint32_t events) {
+    struct conn *c = (struct conn *)arg;
+    if (c->state != CONN_CLOSED) {
+        c->origin_events |= events;
+        conn_run(c);
+    }
+}
+
+// the resolver or the upstream pool answered, carry on where the pipeline waits
+static void on_posted(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    c->waiting = 0;
+    conn_run(c);
+}
+
+// Called on the thread of a fill's leader, wakes the waiter up on its loop
+static void on_fill_ready(coalesce_waiter *w) {
+    struct conn *c = (struct conn *)w->arg;
+    reactor_post(c->loop->r, &c->fill_task);
+}
+
+// the fill we wait for has news, or one we left posted a wakeup before we did
+static void on_fill_posted(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    if (c->fill != NULL && !c->fill_leader) {
+        coalesce_ack(c->fill, &c->fill_w);
+    } else {
+        c->fill_posted = 0;
     }
+    if (c->state == CONN_CLOSED) {
+        reactor_defer(c->loop->r, &c->task); // conn_close left the free to us
+        return;
+    }
+    conn_run(c);
+}
 
-    char response[MAX_RESPONSE_LEN]="\0";
-    port1=parse_request(request_buf,method1,path1,protocol1,host1);
-    if (port1==0) {
-        generate_error_response(response, 400);
-        send(client_fd, response, strlen(response), 0);
+/**
+ * answers a connection over the loop's cap with the 503 page and
+ * closes it, without a conn or a reactor registration. Best effort:
+ * whatever of the request already arrived is read first so that the
+ * close does not reset the page away, but a client that is slower
+ * than that, or does not take the page at once, loses it.
+ */
+static void shed(struct proxy_loop *loop, int client_fd) {
+    time_t now = time(NULL);
+    if (loop->shed_len == 0 || now != loop->shed_date) {
+        generate_error_response(loop->shed_page, 503); // for the Date header
+        loop->shed_len = strlen(loop->shed_page);
+        loop->shed_date = now;
+    }
+    char drain[SHED_DRAIN_LEN];
+    if (recv(client_fd, drain, sizeof(drain), MSG_DONTWAIT) < 0 && errno != EAGAIN) {
         close(client_fd);
-        return (void*)0;
+        return;
+    }
+    if (send(client_fd, loop->shed_page, loop->shed_len, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+        shutdown(client_fd, SHUT_WR);
     }
+    close(client_fd);
+    metrics_count_error(503);
+    atomic_fetch_add(&shed_total, 1);
+}
 
-    if (!is_method_supported(method1)) {
-        generate_error_response(response, 501);
-        send(client_fd, response, strlen(response), 0);
+static void on_accept(void *arg, int client_fd) {
+    struct proxy_loop *loop = (struct proxy_loop *)arg;
+    int n = atomic_fetch_add(&accepted, 1);
+    if (!loop->accepting || n >= max_requests) {
+        // another loop accepted the last allowed connection first
         close(client_fd);
-        return (void*)0;
+        close_listener_everywhere();
+        return;
+    }
+    if (loop->max_active > 0 && loop->active >= loop->max_active) {
+        shed(loop, client_fd);
+        if (n + 1 == max_requests) {
+            close_listener_everywhere();
+        }
+        return;
     }
 
-    struct hostent *server = gethostbyname(host1);
-    if (server == NULL) {
-        generate_error_response(response, 404);
-        send(client_fd, response, strlen(response), 0);
+    struct conn *c = (struct conn *)slab_alloc(&loop->conns);
+    buf_seg *rx = c != NULL ? buf_get(&loop->bufs, BUF_MIN_LEN) : NULL;
+    if (rx == NULL) {
+        slab_free(&loop->conns, c);
         close(client_fd);
-        return (void*)0;
+    } else {
+        memset(c, 0, offsetof(struct conn, req));
+        http_framing_init(&c->framing, 0);
+        buf_chain_init(&c->out);
+        c->rx = rx;
+        c->request_buf = rx->data;
+        c->request_buf[0] = '\0';
+        c->method1[0] = c->path1[0] = c->protocol1[0] = c->host1[0] = '\0';
+        c->cache_key[0] = c->validators[0] = c->response[0] = '\0';
+        c->loop = loop;
+        CORO_INIT(&c->co);
+        c->state = CONN_READ_REQUEST;
+        c->client_fd = client_fd;
+        if (accesslog_enabled()) {
+            struct sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            if (getpeername(client_fd, (struct sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET) {
+                c->client_addr = peer.sin_addr;
+            }
+        }
+        c->origin_fd = -1;
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+        c->up.pipe_fd[0] = c->up.pipe_fd[1] = -1;
+        c->down.pipe_fd[0] = c->down.pipe_fd[1] = -1;
+        http_request_init(&c->req);
+        c->client_h.fn = on_client_event;
+        c->client_h.arg = c;
+        c->origin_h.fn = on_origin_event;
+        c->origin_h.arg = c;
+        c->task.fn = on_posted;
+        c->task.arg = c;
+        c->fill_task.fn = on_fill_posted;
+        c->fill_task.arg = c;
+        c->deadline.fn = on_deadline;
+        c->deadline.arg = c;
+        loop->active++;
+        metrics_conn_opened();
+        if (reactor_add(loop->r, client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, &c->client_h) != 0) {
+            conn_close(c);
+        } else {
+            conn_run(c);
+        }
+    }
+
+    // at the cap: leave new connections in the backlog, or to loops with room
+    if (overload_pause && !loop->paused && loop->max_active > 0 && loop->active >= loop->max_active) {
+        loop->paused = 1;
+        atomic_fetch_add(&pauses_total, 1);
+        if (reactor_pause_acceptor(loop->r, &loop->acceptor) != 0) {
+            perror("error: pause accepting");
+        }
+    }
+
+    if (n + 1 == max_requests) {
+        close_listener_everywhere();
     }
+}
 
-    char ip[MAX_IP_LEN];
-    inet_ntop(AF_INET, server->h_addr, ip, sizeof(ip));
+// Called on a resolver thread, hands the connection back to its loop
+static void on_dns_done(dns_query *q) {
+    struct conn *c = (struct conn *)q->arg;
+    reactor_post(c->loop->r, &c->task);
+}
 
-    int valid_host = is_valid_host(host1);
-    int ip_in = is_ip_in_filter(ip);
+// Called on the thread that freed a slot, hands it to the connection's loop
+static void on_upstream_ready(upstream_waiter *w) {
+    struct conn *c = (struct conn *)w->arg;
+    reactor_post(c->loop->r, &c->task);
+}
 
+/**
+ * applies the filter to the requested name and to the address it
+ * resolved to. returns 0 if the request may go on, else the status
+ * to answer with
+ */
+static int filter_verdict(const struct conn *c, struct in_addr addr) {
+    filter_snapshot *snap = filter_acquire();
+    int valid_host = is_valid_host(snap, c->host1);
+    int ip_in = is_ip_in_filter(snap, addr);
+    filter_release(snap);
     if (valid_host == 1 || ip_in == 1) {
-        generate_error_response(response, 403);
-        send(client_fd, response, strlen(response), 0);
-        close(client_fd);
-        return (void*)0;
+        return 403;
     }
-
     if (valid_host == 500 || ip_in == 500) {
-        generate_error_response(response, 500);
-        send(client_fd, response, strlen(response), 0);
-        close(client_fd);
-        return (void*)0;
+        return 500;
     }
+    return 0;
+}
 
-    char modified_request_buf[strlen(request_buf)];
-    modified_request(request_buf, modified_request_buf);
-
-    connect_and_forward_request(host1, modified_request_buf, strlen(modified_request_buf), client_fd, port1);
+/**
+ * registers c->origin_fd with the loop: a pooled connection is used
+ * as it is, with origin_fd -1 a new one is connected without blocking.
+ * returns 0 when the connection is ready for the request, 1 if the
+ * connect is in progress and -1 on failure
+ */
+static int open_origin(struct conn *c) {
+    http_framing_init(&c->framing, 0);
+    buf_chain_rewind(&c->out);
+    c->got_first_byte = 0;
+    c->origin_events = 0;
+    c->reused = c->origin_fd >= 0;
+
+    int in_progress = 0;
+    if (!c->reused) {
+        c->origin_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->origin_fd < 0) {
+            perror("Socket creation failed");
+            return -1;
+        }
 
-    close(client_fd);  // Close the client file descriptor
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        //printf("%d\n",port);
+        server_addr.sin_port = htons(c->port1);
+        server_addr.sin_addr = c->dns.addr;
+
+        c->t_mark = metrics_now();
+        if (connect(c->origin_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+            metrics_observe(METRIC_CONNECT, c->t_mark);
+        } else if (errno == EINPROGRESS) {
+            in_progress = 1;
+        } else {
+            perror("Connection failed");
+            return -1;
+        }
+    }
+    if (reactor_add(c->loop->r, c->origin_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, &c->origin_h) != 0) {
+        return -1;
+    }
+    return in_progress;
+}
 
-    return (void*)0;
+/**
+ * returns 0 while the origin connect is in progress, 1 once it
+ * succeeded and -1 if it failed
+ */
+static int connect_done(struct conn *c) {
+    if ((c->origin_events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) {
+        return 0;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->origin_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        errno = err;
+        perror("Connection failed");
+        return -1;
+    }
+    metrics_observe(METRIC_CONNECT, c->t_mark);
+    return 1;
 }
 
+// makes the request conditional on the stored response still being current
+static size_t add_validators(char *validators, const cache_entry *e) {
+    int len = 0;
+    if (e->etag[0] != '\0') {
+        len += sprintf(validators + len, "If-None-Match: %s\r\n", e->etag);
+    }
+    if (e->last_modified[0] != '\0') {
+        len += sprintf(validators + len, "If-Modified-Since: %s\r\n", e->last_modified);
+    }
+    return len;
+}
 
+/**
+ * lays out c->out, what the origin is sent first. It points into the
+ * request segment, which the chain holds on to until it is reset.
+ * returns -1 if the chain ran out of room
+ */
+static int prepare_request(struct conn *c) {
+    buf_chain_reset(&c->loop->bufs, &c->out);
+    int rc = buf_chain_hold(&c->out, c->rx);
+    if (c->tunnel) {
+        // bytes the client sent right after the CONNECT header go first
+        c->request_buf[c->header_len] = c->saved;
+        return rc | buf_chain_add(&c->out, c->request_buf + c->header_len, c->request_len - c->header_len);
+    }
+    rc |= modified_request(c->request_buf, &c->req, &c->out);
+    if (c->revalidating) {
+        rc |= buf_chain_add(&c->out, c->validators, add_validators(c->validators, c->hit));
+    }
+    rc |= buf_chain_add(&c->out, "\r\n", 2);
+    if (c->upload.state != HF_DONE) {
+        // body bytes that came with the header go with it, what follows them is the next request
+        c->request_buf[c->header_len] = c->saved;
+        c->body_buffered = http_body_feed(&c->upload, c->request_buf + c->header_len,
+                                          c->request_len - c->header_len);
+        rc |= buf_chain_add(&c->out, c->request_buf + c->header_len, c->body_buffered);
+    }
+    return rc;
+}
+
+// methods that may be sent twice (RFC 9110 9.2.2), the origin may have
+// acted on a request it closed on without answering
+static int is_idempotent(const char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0
+        || strcmp(method, "OPTIONS") == 0 || strcmp(method, "PUT") == 0
+        || strcmp(method, "DELETE") == 0;
+}
+
+/**
+ * a pooled connection the origin closed before answering is retried
+ * once on a fresh connection, the slot is kept.
+ * returns 1 if the stale connection was closed for a retry
+ */
+static int retry_stale(struct conn *c) {
+    // body bytes streamed from the client are gone, only those still in rx can be sent again
+    if (!c->reused || c->relayed > 0 || c->framing.status != 0 || c->framing.line_len > 0
+        || c->up.bytes > 0 || !is_idempotent(c->method1)) {
+        return 0;
+    }
+    reactor_del(c->loop->r, c->origin_fd);
+    close(c->origin_fd);
+    c->origin_fd = -1;
+    return 1;
+}
+
+/**
+ * lets go of c->fill: a leader ends it, "complete" if the whole
+ * response was appended, a waiter leaves it, "complete" if it was
+ * answered from it
+ */
+static void fill_done(struct conn *c, int complete) {
+    if (c->fill == NULL) {
+        return;
+    }
+    if (c->fill_leader) {
+        coalesce_end(c->fill, complete);
+    } else {
+        c->fill_posted = coalesce_leave(c->fill, &c->fill_w, complete);
+    }
+    c->fill = NULL;
+}
+
+// drops the copy of a response that turned out not to be storable, nobody may share it either
+static void capture_stop(struct conn *c) {
+    if (c->fill_leader) {
+        fill_done(c, 0);
+    }
+    c->capturing = 0;
+    if (c->capture_borrowed) {
+        relay_buf_put(&c->loop->relay, c->capture);
+    } else {
+        free(c->capture);
+    }
+    c->capture = NULL;
+    c->capture_borrowed = 0;
+    c->capture_len = c->capture_cap = 0;
+}
+
+// moves on to the next (possibly already pipelined) request of a keep-alive client
+static void next_request(struct conn *c) {
+    buf_chain_reset(&c->loop->bufs, &c->out);
+    c->request_buf[c->header_len] = c->saved;
+    c->header_len += c->body_buffered;
+    c->request_len -= c->header_len;
+    // a keep-alive client that sent one large header does not hold a large segment after it
+    buf_seg *small = c->rx->cap > BUF_MIN_LEN && c->request_len < BUF_MIN_LEN
+                   ? buf_get(&c->loop->bufs, BUF_MIN_LEN) : NULL;
+    if (small != NULL) {
+        memcpy(small->data, c->request_buf + c->header_len, c->request_len);
+        buf_put(&c->loop->bufs, c->rx);
+        c->rx = small;
+        c->request_buf = small->data;
+    } else {
+        memmove(c->request_buf, c->request_buf + c->header_len, c->request_len);
+    }
+    c->request_buf[c->request_len] = '\0';
+    c->header_len = c->body_buffered = 0;
+    http_request_init(&c->req);
+    c->up.bytes = 0;
+
+    c->upstream = NULL;
+    c->reused = 0;
+    c->resp_len = c->resp_off = 0;
+    c->hit_off = c->conn_off = 0;
+    c->revalidating = c->not_modified = 0;
+    capture_stop(c);
+    c->capture_checked = 0;
+    c->fill_leader = c->fill_bypass = 0;
+    c->relayed = 0;
+    c->t_origin = c->origin_ns = 0;
+    c->status = 0;
+    c->state = CONN_READ_REQUEST;
+}
+
+/**
+ * the client got its whole response.
+ * returns 1 if the client may send another request
+ */
+static int response_done(struct conn *c) {
+    metrics_add_bytes(c->relayed);
+    log_request(c, metrics_observe(METRIC_TOTAL, c->t_start));
+    c->t_start = 0;
+    if (c->hit != NULL) {
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    c->requests_served++;
+    return c->client_keep_alive && c->requests_served < CLIENT_MAX_REQUESTS && c->loop->accepting;
+}
+
+/**
+ * the whole response was relayed: the origin connection goes back to
+ * the pool, and the response to the cache and to the requests attached
+ * to our fetch
+ */
+static void finish_response(struct conn *c) {
+    c->origin_ns = metrics_observe(METRIC_RELAY, c->t_mark) - c->t_origin;
+    reactor_del(c->loop->r, c->origin_fd);
+    upstream_release(c->upstream, c->origin_fd, c->framing.keep_alive);
+    c->upstream_held = 0;
+    c->origin_fd = -1;
+
+    if (c->not_modified) {
+        cache_refresh(c->hit, c->capture, c->capture_len);
+    } else if (c->capturing) {
+        cache_store(c->cache_key, c->capture, c->capture_len, c->dns.addr);
+        if (c->fill != NULL) {
+            coalesce_publish(c->fill, c->dns.addr); // a chunked one, shared once complete
+        }
+    }
+    // after a 304 the waiters find the refreshed copy in the cache
+    fill_done(c, 1);
+}
+
+// request bytes rx takes, one byte stays free for the NUL after the header
+static size_t receive_limit(const struct conn *c) {
+    return c->rx->cap - 1 < max_header_len ? c->rx->cap - 1 : max_header_len;
+}
+
+/**
+ * reads until a whole request header is buffered, without blocking.
+ * A header that fills its segment moves to one twice as large, until
+ * it is max_header_len long.
+ * returns 1 when the header is complete (c->header_len is set) or
+ * not taken (c->req.state is HR_ERROR or HR_TOO_LARGE), 0 if more data
+ * is needed and -1 if the client went away
+ */
+static int read_request(struct conn *c) {
+    while (1) {
+        // The parser resumes where it stopped, old bytes are not scanned again
+        int rc = http_request_parse(&c->req, c->request_buf, c->request_len);
+        if (rc > 0) {
+            c->header_len = c->req.header_len;
+            return 1;
+        }
+        if (rc == 0 && c->request_len >= receive_limit(c)) {
+            if (c->request_len >= max_header_len
+                || buf_grow(&c->loop->bufs, &c->rx, c->request_len, 0) != 0) {
+                c->req.state = HR_TOO_LARGE;
+            }
+            c->request_buf = c->rx->data;
+        }
+        if (c->req.state == HR_ERROR || c->req.state == HR_TOO_LARGE) {
+            c->header_len = c->request_len;
+            return 1;
+        }
+        ssize_t bytes_received = recv(c->client_fd, c->request_buf + c->request_len,
+                                      receive_limit(c) - c->request_len, 0);
+        if (bytes_received == 0) {
+            if (c->request_len == 0) {
+                return -1;
+            }
+            c->req.state = HR_ERROR; // the client stopped in the middle of a request
+            c->header_len = c->request_len;
+            return 1;
+        }
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->request_len += bytes_received;
+        c->request_buf[c->request_len] = '\0';
+    }
+}
+
+/**
+ * fills method1, path1, protocol1, host1 and port1 from the parsed
+ * request. The port comes from an absolute URL, else from the Host
+ * header. A CONNECT names "host:port" as its target, which is used
+ * for both. returns 0 if the request is bad
+ */
+static int parse_request(struct conn *c) {
+    const char *buf = c->request_buf;
+    const http_request *r = &c->req;
+    if (r->state != HR_DONE
+        || http_span_copy(buf, r->method, c->method1, sizeof(c->method1)) != 0
+        || http_span_copy(buf, r->target, c->path1, sizeof(c->path1)) != 0
+        || http_span_copy(buf, r->version, c->protocol1, sizeof(c->protocol1)) != 0) {
+        return 0;
+    }
+    // Check if the protocol is not "HTTP/1.0" or "HTTP/1.1"
+    if (strcmp(c->protocol1, "HTTP/1.0") != 0 && strcmp(c->protocol1, "HTTP/1.1") != 0) {
+        return 0;
+    }
+
+    c->tunnel = strcmp(c->method1, "CONNECT") == 0;
+    if (c->tunnel) {
+        if (http_span_copy(buf, r->target, c->host1, sizeof(c->host1)) != 0 || strchr(c->host1, ':') == NULL) {
+            return 0; // the port is not optional here
+        }
+    } else if (r->host < 0 || http_span_copy(buf, r->headers[r->host].value, c->host1, sizeof(c->host1)) != 0) {
+        return 0;
+    }
+
+    const char *authority = c->host1;
+    if (strncasecmp(c->path1, "http://", 7) == 0) {
+        authority = c->path1 + 7;
+    }
+    size_t authority_len = strcspn(authority, "/?#");
+    const char *port_separator = memchr(authority, ':', authority_len);
+    c->port1 = port_separator != NULL ? atoi(port_separator + 1) : 80;
+    return c->port1 > 0 && c->port1 <= 65535;
+}
+
+/**
+ * returns 1 if the request has header "name", and its value contains
+ * "token" (any value if token is NULL)
+ */
+static int request_header_has(const struct conn *c, const char *name, const char *token) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < c->req.num_headers; i++) {
+        http_span n = c->req.headers[i].name;
+        if (n.len != name_len || strncasecmp(c->request_buf + n.off, name, name_len) != 0) {
+            continue;
+        }
+        if (token == NULL) {
+            return 1;
+        }
+        char value[256];
+        http_span v = c->req.headers[i].value;
+        snprintf(value, sizeof(value), "%.*s", (int)v.len, c->request_buf + v.off);
+        if (strcasestr(value, token) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * HTTP/1.1 connections persist unless the client sends
+ * "Connection: close", HTTP/1.0 ones only with "Connection: keep-alive"
+ */
+static int wants_keep_alive(const struct conn *c) {
+    if (request_header_has(c, "Connection", "close")) {
+        return 0;
+    }
+    return strcmp(c->protocol1, "HTTP/1.1") == 0 || request_header_has(c, "Connection", "keep-alive");
+}
+
+/**
+ * sets c->upload up for the request body: chunked, Content-Length
+ * bytes, or none. A request with both, with Content-Length more than
+ * once, or with a coding other than chunked last is refused, as the
+ * origin could see a different end of the body than we do.
+ * returns 0 if the request is bad
+ */
+static int request_body(struct conn *c) {
+    const http_request *r = &c->req;
+    if (c->tunnel) {
+        http_body_init(&c->upload, 0, 0); // what follows the header is the tunnel's
+        return 1;
+    }
+    const http_span *length = NULL;
+    const http_span *coding = NULL;
+    for (int i = 0; i < r->num_headers; i++) {
+        http_span n = r->headers[i].name;
+        if (n.len == 14 && strncasecmp(c->request_buf + n.off, "Content-Length", 14) == 0) {
+            if (length != NULL) {
+                return 0;
+            }
+            length = &r->headers[i].value;
+        } else if (n.len == 17 && strncasecmp(c->request_buf + n.off, "Transfer-Encoding", 17) == 0) {
+            if (coding != NULL) {
+                return 0;
+            }
+            coding = &r->headers[i].value;
+        }
+    }
+    if (coding != NULL) {
+        // the last coding, a whole token
+        const char *value = c->request_buf + coding->off;
+        size_t end = coding->len;
+        while (end > 0 && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        size_t start = end;
+        while (start > 0 && value[start - 1] != ',') {
+            start--;
+        }
+        while (start < end && (value[start] == ' ' || value[start] == '\t')) {
+            start++;
+        }
+        if (length != NULL || end - start != 7 || strncasecmp(value + start, "chunked", 7) != 0) {
+            return 0;
+        }
+        http_body_init(&c->upload, 1, 0);
+        return 1;
+    }
+    long long bytes = 0;
+    if (length != NULL) {
+        if (length->len == 0 || length->len > 18) {
+            return 0;
+        }
+        for (unsigned i = 0; i < length->len; i++) {
+            char digit = c->request_buf[length->off + i];
+            if (digit < '0' || digit > '9') {
+                return 0;
+            }
+            bytes = bytes * 10 + (digit - '0');
+        }
+    }
+    http_body_init(&c->upload, 0, bytes);
+    return 1;
+}
+
+// "host:port/path" with the host lowercased and the path as the origin
+// is sent it, "" if the request must not use the cache
+static void make_cache_key(struct conn *c) {
+    c->cache_key[0] = '\0';
+    if (request_header_has(c, "Authorization", NULL)
+        || request_header_has(c, "Range", NULL)
+        || request_header_has(c, "If-None-Match", NULL)
+        || request_header_has(c, "If-Modified-Since", NULL)
+        || request_header_has(c, "Cache-Control", "no-store")) {
+        return;
+    }
+
+    size_t path_len = strlen(c->path1);
+    int slash;
+    const char *path = origin_form(c->path1, &path_len, &slash);
+    size_t host_len = strcspn(c->host1, ":");
+    int len = snprintf(c->cache_key, sizeof(c->cache_key), "%.*s:%d%s%.*s",
+                       (int)host_len, c->host1, c->port1, slash ? "/" : "", (int)path_len, path);
+    if (len >= (int)sizeof(c->cache_key)) {
+        c->cache_key[0] = '\0';
+        return;
+    }
+    for (size_t i = 0; i < host_len; i++) {
+        c->cache_key[i] = tolower((unsigned char)c->cache_key[i]);
+    }
+}
+
+/**
+ * attaches the request to a fetch of the same response that is already
+ * on its way, or makes its own fetch one that others can attach to
+ */
+static void join_fill(struct conn *c) {
+    if (coalesce_secs <= 0 || c->fill_bypass) {
+        return;
+    }
+    int leader;
+    c->fill_w.ready = on_fill_ready;
+    c->fill_w.arg = c;
+    c->fill = coalesce_join(c->cache_key, &c->fill_w, c->fill_posted, &leader);
+    c->fill_leader = c->fill != NULL && leader;
+    if (c->fill != NULL && !leader) {
+        c->fill_posted = 0; // the waiter's notified flag tracks that wakeup now
+        if (c->hit != NULL) {
+            // the fetch we wait for revalidates it, or replaces it
+            cache_release(c->hit);
+            c->hit = NULL;
+            c->revalidating = 0;
+        }
+    }
+}
+
+/**
+ * looks the request up in the cache. A fresh copy is left in c->hit
+ * to be served, a stale one to be revalidated, and a miss is captured
+ * on its way to the client so it can be stored. Unless it was served,
+ * the request joins a fetch of the same response (join_fill).
+ * returns 1 if the request can be answered from c->hit
+ */
+static int lookup_cache(struct conn *c) {
+    if (c->tunnel || strcmp(c->method1, "GET") != 0) {
+        return 0;
+    }
+    make_cache_key(c);
+    if (c->cache_key[0] == '\0') {
+        return 0;
+    }
+    c->capturing = 1;
+    if (request_header_has(c, "Cache-Control", "no-cache")
+        || request_header_has(c, "Pragma", "no-cache")) {
+        return 0; // the client wants it from the origin, we may still store it
+    }
+
+    int fresh;
+    c->hit = cache_lookup(c->cache_key, &fresh);
+    if (c->hit != NULL && fresh) {
+        return 1;
+    }
+    c->revalidating = c->hit != NULL;
+    join_fill(c);
+    return 0;
+}
+
+/**
+ * reads the request header and keeps the client's deadline: the idle
+ * one while nothing was sent, one for the whole header once it started.
+ * returns what read_request returned
+ */
+static int receive_request(struct conn *c) {
+    int rc = read_request(c);
+    if (c->t_start == 0 && c->request_len > 0) {
+        c->t_start = metrics_now();
+    }
+    if (rc == 0) {
+        // a client with nothing buffered is idle between requests
+        if (c->request_len == 0) {
+            idle_add(c);
+        } else {
+            idle_remove(c);
+            // the whole header has one deadline, trickling bytes don't extend it
+            if (c->deadline_kind != DEADLINE_HEADER || !timer_pending(&c->deadline)) {
+                set_deadline(c, DEADLINE_HEADER, HEADER_TIMEOUT_SECS);
+            }
+        }
+    } else if (rc > 0) {
+        idle_remove(c);
+        timer_cancel(&c->deadline);
+    }
+    return rc;
+}
+
+/**
+ * writes c->response[resp_off..resp_len) to the client.
+ * returns 1 when everything was sent, 0 on EAGAIN and -1 on error
+ */
+static int flush_response(struct conn *c) {
+    while (c->resp_off < c->resp_len) {
+        ssize_t bytes_sent = send(c->client_fd, c->response + c->resp_off,
+                                  c->resp_len - c->resp_off, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->resp_off += bytes_sent;
+        c->relayed += bytes_sent;
+    }
+    return 1;
+}
+
+// the Connection line the client is sent on a response we write
+static const char *connection_line(const struct conn *c) {
+    int keep = c->client_keep_alive && c->requests_served + 1 < CLIENT_MAX_REQUESTS && c->loop->accepting;
+    return keep ? connection_keep_alive : connection_close;
+}
+
+// where the Connection line rewrite_response_head put in the stored
+// response data[0..len) starts, 0 if there is none
+static size_t stored_conn_off(const char *data, size_t len) {
+    const char *nl = (const char *)memchr(data, '\n', len);
+    if (nl == NULL) {
+        return 0;
+    }
+    size_t off = nl + 1 - data;
+    if (len - off < CONNECTION_LINE_LEN || strncmp(data + off, "Connection: ", 12) != 0) {
+        return 0;
+    }
+    return off;
+}
+
+/**
+ * sends data[0..len), bytes "pos" on of a stored response, with the
+ * client's own Connection line in place of the stored one.
+ * returns what send returned
+ */
+static ssize_t send_stored(struct conn *c, const char *data, size_t len, size_t pos) {
+    size_t line = c->conn_off;
+    if (line == 0 || pos >= line + CONNECTION_LINE_LEN) {
+        return send(c->client_fd, data, len, MSG_NOSIGNAL);
+    }
+    if (pos < line) {
+        size_t before = line - pos < len ? line - pos : len;
+        return send(c->client_fd, data, before, MSG_NOSIGNAL);
+    }
+    const char *own = connection_line(c) + (pos - line);
+    size_t n = line + CONNECTION_LINE_LEN - pos;
+    return send(c->client_fd, own, n < len ? n : len, MSG_NOSIGNAL);
+}
+
+/**
+ * writes c->hit->data[hit_off..len) to the client, progress pushes the
+ * relay deadline back.
+ * returns 1 when everything was sent, 0 on EAGAIN and -1 on error
+ */
+static int flush_cached(struct conn *c) {
+    size_t sent = c->hit_off;
+    while (c->hit_off < c->hit->len) {
+        ssize_t bytes_sent = send_stored(c, c->hit->data + c->hit_off,
+                                         c->hit->len - c->hit_off, c->hit_off);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (c->hit_off > sent) {
+                    set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+                }
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->hit_off += bytes_sent;
+        c->relayed += bytes_sent;
+    }
+    return 1;
+}
+
+/**
+ * waits for the fill the request is attached to. c->dns.addr is set
+ * to the origin's address of a published fill, the leader's lookup
+ * stands in for our own.
+ * returns COALESCE_WAIT until the fill can be sent (COALESCE_DATA or
+ * COALESCE_DONE), and COALESCE_UNSHARED if the request has to fetch
+ * on its own: the fill was no use, or the wait took too long
+ */
+static int fill_wait(struct conn *c) {
+    if (c->fill == NULL) {
+        return COALESCE_UNSHARED; // on_deadline left it
+    }
+    const char *data;
+    size_t len;
+    int rc = coalesce_read(c->fill, &c->fill_w, &data, &len, &c->dns.addr);
+    return rc == COALESCE_BROKEN ? COALESCE_UNSHARED : rc; // nothing was sent yet
+}
+
+/**
+ * writes the fill's bytes the client was not sent yet, progress pushes
+ * the relay deadline back.
+ * returns 1 when the whole response was sent, 0 if the client or the
+ * fill has to catch up and -1 on error or if the leader's fetch broke
+ */
+static int flush_fill(struct conn *c) {
+    size_t sent = c->relayed;
+    while (1) {
+        const char *data;
+        size_t len;
+        int rc = coalesce_read(c->fill, &c->fill_w, &data, &len, &c->dns.addr);
+        if (rc == COALESCE_DATA) {
+            if (c->relayed == 0) {
+                c->conn_off = stored_conn_off(data, len);
+            }
+            ssize_t bytes_sent = send_stored(c, data, len, c->relayed);
+            if (bytes_sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return -1;
+                }
+                rc = COALESCE_WAIT;
+            } else {
+                coalesce_consume(c->fill, &c->fill_w, bytes_sent);
+                c->relayed += bytes_sent;
+                continue;
+            }
+        }
+        if (rc == COALESCE_WAIT) {
+            if (c->relayed > sent) {
+                set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+            }
+            return 0;
+        }
+        return rc == COALESCE_DONE ? 1 : -1;
+    }
+}
+
+/**
+ * keeps a copy of the response bytes just relayed while the response
+ * may still be stored, stops as soon as it can't
+ */
+static void capture_response(struct conn *c, const char *buf, size_t n) {
+    if (c->capture_len + n > CACHE_MAX_OBJECT) {
+        capture_stop(c);
+        return;
+    }
+    if (c->capture == NULL && n <= RELAY_BUF_LEN) {
+        // most responses fit a relay buffer, borrowed like the relay's own
+        c->capture = relay_buf_get(&c->loop->relay);
+        if (c->capture == NULL) {
+            capture_stop(c);
+            return;
+        }
+        c->capture_borrowed = 1;
+        c->capture_cap = RELAY_BUF_LEN;
+    }
+    if (c->capture_len + n > c->capture_cap) {
+        size_t cap = c->capture_cap > 0 ? c->capture_cap : 16384;
+        while (cap < c->capture_len + n) {
+            cap *= 2;
+        }
+        char *capture;
+        if (c->capture_borrowed) {
+            capture = (char *)malloc(cap);
+            if (capture != NULL) {
+                memcpy(capture, c->capture, c->capture_len);
+                relay_buf_put(&c->loop->relay, c->capture);
+                c->capture_borrowed = 0;
+            }
+        } else {
+            capture = (char *)realloc(c->capture, cap);
+        }
+        if (capture == NULL) {
+            capture_stop(c);
+            return;
+        }
+        c->capture = capture;
+        c->capture_cap = cap;
+    }
+    memcpy(c->capture + c->capture_len, buf, n);
+    c->capture_len += n;
+    if (c->fill != NULL && !c->not_modified && coalesce_append(c->fill, buf, n) != 0) {
+        fill_done(c, 0);
+    }
+
+    if (!c->capture_checked && c->framing.body.state != HF_HEADER) {
+        c->capture_checked = 1;
+        if (c->not_modified) {
+            return; // only the 304's headers are needed, to refresh the copy
+        }
+        if (!cache_storable(c->capture, c->capture_len)
+            || (c->framing.have_length && c->capture_len + c->framing.body.remaining > CACHE_MAX_OBJECT)) {
+            capture_stop(c);
+        } else if (c->fill != NULL && c->framing.have_length) {
+            // it will be stored whole, the requests attached to us may have it as it comes
+            coalesce_publish(c->fill, c->dns.addr);
+        }
+    }
+}
+
+/**
+ * writes what the relay holds (buffer first, then the pipe) to the
+ * client, borrowed buffers and pipes go back to the loop once empty.
+ * A header block still being read is held back.
+ * returns 1 when everything was sent, 0 on EAGAIN and -1 on error
+ */
+static int flush_relay(struct conn *c) {
+    while (c->roff < c->rlen - c->rheld) {
+        ssize_t bytes_sent = send(c->client_fd, c->rbuf + c->roff,
+                                  c->rlen - c->rheld - c->roff, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->roff += bytes_sent;
+        c->relayed += bytes_sent;
+    }
+    if (c->rbuf != NULL && c->rheld == 0) {
+        relay_buf_put(&c->loop->relay, c->rbuf);
+        c->rbuf = NULL;
+        c->rlen = c->roff = 0;
+    }
+
+    while (c->piped > 0) {
+        ssize_t moved = splice(c->pipe_fd[0], NULL, c->client_fd, NULL, c->piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->piped -= moved;
+        c->relayed += moved;
+    }
+    if (c->pipe_fd[0] >= 0) {
+        relay_pipe_put(&c->loop->relay, c->pipe_fd, 0);
+    }
+    return 1;
+}
+
+/**
+ * moves up to "max" body bytes from the origin into the pipe.
+ * returns what splice returned, or -2 if the caller should use the
+ * buffered path instead
+ */
+static ssize_t splice_from_origin(struct conn *c, long long max) {
+    if (c->pipe_fd[0] < 0 && relay_pipe_get(&c->loop->relay, c->pipe_fd) != 0) {
+        return -2;
+    }
+    size_t len = max < RELAY_PIPE_LEN ? (size_t)max : RELAY_PIPE_LEN;
+    ssize_t moved = splice(c->origin_fd, NULL, c->pipe_fd[1], NULL, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // this kernel or socket type can't splice, don't try again
+        atomic_store(&splice_disabled, 1);
+        relay_pipe_put(&c->loop->relay, c->pipe_fd, 0);
+        return -2;
+    }
+    if (moved <= 0) {
+        relay_pipe_put(&c->loop->relay, c->pipe_fd, 0); // nothing in flight
+    }
+    return moved;
+}
+
+/**
+ * response bytes came from the origin: the first ones end the
+ * time-to-first-byte stage, all of them push the relay deadline back
+ */
+static void got_response_bytes(struct conn *c) {
+    if (!c->got_first_byte) {
+        c->got_first_byte = 1;
+        c->t_mark = metrics_observe(METRIC_TTFB, c->t_mark);
+    }
+    set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+}
+
+/**
+ * moves bytes "from" -> "to" through "d" until one side blocks, and
+ * passes an end of stream on as a write shutdown.
+ * returns 1 if anything moved, 0 if not and -1 if the tunnel broke
+ */
+static int tunnel_pump(struct conn *c, struct tunnel_dir *d, int from, int to) {
+    int moved = 0;
+    while (1) {
+        while (d->off < d->len) {
+            ssize_t n = send(to, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? moved : -1;
+            }
+            d->off += n;
+            d->bytes += n;
+            moved = 1;
+        }
+        if (d->buf != NULL) {
+            relay_buf_put(&c->loop->relay, d->buf);
+            d->buf = NULL;
+            d->off = d->len = 0;
+        }
+        while (d->piped > 0) {
+            ssize_t n = splice(d->pipe_fd[0], NULL, to, NULL, d->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? moved : -1;
+            }
+            d->piped -= n;
+            d->bytes += n;
+            moved = 1;
+        }
+        if (d->pipe_fd[0] >= 0) {
+            relay_pipe_put(&c->loop->relay, d->pipe_fd, 0);
+        }
+        if (d->eof) {
+            return moved;
+        }
+
+        ssize_t n = -2;
+        int err = 0;
+        if (!atomic_load_explicit(&splice_disabled, memory_order_relaxed)
+            && relay_pipe_get(&c->loop->relay, d->pipe_fd) == 0) {
+            n = splice(from, NULL, d->pipe_fd[1], NULL, RELAY_PIPE_LEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            err = errno;
+            if (n > 0) {
+                d->piped = n;
+            } else {
+                relay_pipe_put(&c->loop->relay, d->pipe_fd, 0);
+                if (n < 0 && (err == EINVAL || err == ENOSYS)) {
+                    atomic_store(&splice_disabled, 1);
+                    n = -2;
+                }
+            }
+        }
+        if (n == -2) {
+            d->buf = relay_buf_get(&c->loop->relay);
+            if (d->buf == NULL) {
+                return -1;
+            }
+            n = recv(from, d->buf, RELAY_BUF_LEN, 0);
+            err = errno;
+            if (n > 0) {
+                d->len = n;
+            } else {
+                relay_buf_put(&c->loop->relay, d->buf);
+                d->buf = NULL;
+            }
+        }
+        if (n == 0) {
+            d->eof = 1;
+            shutdown(to, SHUT_WR);
+            return moved;
+        }
+        if (n < 0) {
+            if (err == EINTR) {
+                continue;
+            }
+            return err == EAGAIN || err == EWOULDBLOCK ? moved : -1;
+        }
+        moved = 1;
+    }
+}
+
+/**
+ * rewrites the header block rbuf[head..head+len) in place for the
+ * client, the "rest" bytes after it move along.
+ * returns the new length of the block, -1 if it no longer fits
+ */
+static ssize_t rewrite_held_head(struct conn *c, size_t head, size_t len, size_t rest) {
+    if (c->framing.body.state == HF_BODY_EOF || (c->framing.body.state != HF_HEADER && c->upload.state != HF_DONE)) {
+        // the client's connection ends with this response: the origin
+        // closes to end it, or answers before it has the whole body
+        c->client_keep_alive = 0;
+    }
+    char *out = relay_buf_get(&c->loop->relay);
+    if (out == NULL) {
+        return -1;
+    }
+    ssize_t n = rewrite_response_head(c->rbuf + head, len, connection_line(c), out, RELAY_BUF_LEN);
+    if (n >= 0 && head + n + rest > RELAY_BUF_LEN) {
+        n = -1;
+    }
+    if (n >= 0) {
+        memmove(c->rbuf + head + n, c->rbuf + head + len, rest);
+        memcpy(c->rbuf + head, out, n);
+    }
+    relay_buf_put(&c->loop->relay, out);
+    return n;
+}
+
+/**
+ * feeds the "n" bytes just received at rbuf[rlen..) to the framing.
+ * Header blocks are held back (c->rheld) until their empty line, then
+ * rewritten for the client; body bytes are kept as they came.
+ * returns -1 if a rewritten header block does not fit the buffer
+ */
+static int feed_response(struct conn *c, size_t n) {
+    size_t head = c->rlen - c->rheld;
+    size_t pos = c->rlen;
+    size_t end = c->rlen + n;
+    while (pos < end && c->framing.body.state == HF_HEADER) {
+        // a line at a time, to know where each header block ends
+        const char *nl = (const char *)memchr(c->rbuf + pos, '\n', end - pos);
+        size_t take = nl != NULL ? (size_t)(nl + 1 - (c->rbuf + pos)) : end - pos;
+        int heads = c->framing.heads;
+        http_framing_feed(&c->framing, c->rbuf + pos, take);
+        pos += take;
+        if (c->framing.heads != heads) {
+            ssize_t len = rewrite_held_head(c, head, pos - head, end - pos);
+            if (len < 0) {
+                return -1;
+            }
+            end = head + len + (end - pos);
+            head = pos = head + len;
+        }
+    }
+    if (c->framing.body.state != HF_HEADER) {
+        size_t used = http_framing_feed(&c->framing, c->rbuf + pos, end - pos);
+        if (used < end - pos) {
+            c->framing.keep_alive = 0; // more than one response, don't trust the connection
+            end = pos + used;
+        }
+        head = end; // a broken header goes on as it came
+    }
+    c->rlen = end;
+    c->rheld = end - head;
+    return 0;
+}
+
+/**
+ * copies the origin's response to the client until one side blocks.
+ * returns STEP_DONE once the whole response was sent
+ */
+static enum step relay_response(struct conn *c) {
+    while (1) {
+        // while the answer to a revalidation may still be a 304, hold it back
+        int rc = c->revalidating ? 1 : flush_relay(c);
+        if (rc < 0) {
+            perror("Sending response to client failed");
+            return STEP_CLOSE;
+        }
+        if (rc == 0) {
+            return STEP_AGAIN; // wait until the client can take more
+        }
+        if (c->framing.body.state == HF_DONE) {
+            return STEP_DONE;
+        }
+
+        // Body bytes go origin -> pipe -> client without being copied,
+        // headers and chunk-size lines go through a buffer to be parsed
+        ssize_t bytes_received = -2;
+        long long body = http_framing_passthrough(&c->framing);
+        if (body > 0 && !c->capturing && !atomic_load_explicit(&splice_disabled, memory_order_relaxed)) {
+            bytes_received = splice_from_origin(c, body);
+            if (bytes_received > 0) {
+                got_response_bytes(c);
+                http_framing_skip(&c->framing, bytes_received);
+                c->piped = bytes_received;
+                continue;
+            }
+        }
+        if (bytes_received == -2) {
+            if (c->rbuf == NULL) {
+                c->rbuf = relay_buf_get(&c->loop->relay);
+                if (c->rbuf == NULL) {
+                    return STEP_CLOSE;
+                }
+            }
+            if (c->roff > 0) {
+                // make room for the rest of the header block held back
+                memmove(c->rbuf, c->rbuf + c->roff, c->rlen - c->roff);
+                c->rlen -= c->roff;
+                c->roff = 0;
+            }
+            if (c->rlen == RELAY_BUF_LEN) {
+                fprintf(stderr, "Response header over %d bytes\n", RELAY_BUF_LEN);
+                return STEP_FAILED;
+            }
+            size_t room = RELAY_BUF_LEN - c->rlen;
+            if (c->framing.body.state == HF_HEADER && room > HEAD_ROOM) {
+                room -= HEAD_ROOM;
+            }
+            bytes_received = recv(c->origin_fd, c->rbuf + c->rlen, room, 0);
+            if (bytes_received <= 0 && c->rlen == 0) {
+                relay_buf_put(&c->loop->relay, c->rbuf);
+                c->rbuf = NULL;
+            }
+        }
+        if (bytes_received == 0) {
+            return retry_stale(c) ? STEP_RETRY : STEP_CLOSE;
+        }
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_AGAIN;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (retry_stale(c)) {
+                return STEP_RETRY;
+            }
+            perror("Error receiving response");
+            return STEP_FAILED;
+        }
+        got_response_bytes(c);
+        size_t ready = c->rlen - c->rheld;
+        if (feed_response(c, bytes_received) != 0) {
+            fprintf(stderr, "Response header too large to rewrite\n");
+            return STEP_FAILED;
+        }
+        if (c->revalidating && (c->framing.status != 0 || c->framing.body.state != HF_HEADER)) {
+            c->revalidating = 0;
+            c->not_modified = c->framing.status == 304;
+        }
+        if (c->capturing) {
+            capture_response(c, c->rbuf + ready, c->rlen - c->rheld - ready);
+        }
+        if (c->not_modified) {
+            // the client never asked for the 304
+            memmove(c->rbuf, c->rbuf + c->rlen - c->rheld, c->rheld);
+            c->rlen = c->rheld;
+            c->roff = 0;
+        }
+    }
+}
+
+/**
+ * moves request body bytes client -> origin through c->up until one
+ * side blocks or the body is complete. Body bytes are spliced; the
+ * chunk-size lines of a chunked body are peeked at first, so that not
+ * a byte of a request pipelined after the body is taken.
+ * returns 1 once the whole body was sent, 0 if a side blocks and -1
+ * if the client went away or the body is malformed
+ */
+static int upload_body(struct conn *c) {
+    struct tunnel_dir *d = &c->up;
+    while (1) {
+        while (d->off < d->len) {
+            ssize_t n = send(c->origin_fd, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            d->off += n;
+            d->bytes += n;
+        }
+        if (d->buf != NULL) {
+            relay_buf_put(&c->loop->relay, d->buf);
+            d->buf = NULL;
+            d->off = d->len = 0;
+        }
+        while (d->piped > 0) {
+            ssize_t n = splice(d->pipe_fd[0], NULL, c->origin_fd, NULL, d->piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            d->piped -= n;
+            d->bytes += n;
+        }
+        if (d->pipe_fd[0] >= 0) {
+            relay_pipe_put(&c->loop->relay, d->pipe_fd, 0);
+        }
+        if (c->upload.state == HF_DONE || c->upload.state == HF_ERROR) {
+            return c->upload.state == HF_DONE ? 1 : -1;
+        }
+
+        long long body = http_body_passthrough(&c->upload);
+        ssize_t n = -2;
+        int err = 0;
+        if (body > 0 && !atomic_load_explicit(&splice_disabled, memory_order_relaxed)
+            && relay_pipe_get(&c->loop->relay, d->pipe_fd) == 0) {
+            n = splice(c->client_fd, NULL, d->pipe_fd[1], NULL,
+                       body < RELAY_PIPE_LEN ? (size_t)body : RELAY_PIPE_LEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            err = errno;
+            if (n > 0) {
+                d->piped = n;
+                http_body_skip(&c->upload, n);
+            } else {
+                relay_pipe_put(&c->loop->relay, d->pipe_fd, 0);
+                if (n < 0 && (err == EINVAL || err == ENOSYS)) {
+                    atomic_store(&splice_disabled, 1);
+                    n = -2;
+                }
+            }
+        }
+        if (n == -2) {
+            d->buf = relay_buf_get(&c->loop->relay);
+            if (d->buf == NULL) {
+                return -1;
+            }
+            size_t want = body > 0 && body < RELAY_BUF_LEN ? (size_t)body : RELAY_BUF_LEN;
+            n = recv(c->client_fd, d->buf, want, body > 0 ? 0 : MSG_PEEK);
+            err = errno;
+            if (n > 0 && body > 0) {
+                http_body_skip(&c->upload, n);
+            } else if (n > 0) {
+                n = recv(c->client_fd, d->buf, http_body_feed(&c->upload, d->buf, n), 0);
+                err = errno;
+            }
+            if (n > 0) {
+                d->len = n;
+            } else {
+                relay_buf_put(&c->loop->relay, d->buf);
+                d->buf = NULL;
+            }
+        }
+        if (n == 0) {
+            return -1; // the client closed in the middle of the body
+        }
+        if (n < 0) {
+            if (err == EINTR) {
+                continue;
+            }
+            return err == EAGAIN || err == EWOULDBLOCK ? 0 : -1;
+        }
+        set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+    }
+}
+
+/**
+ * relays the response while the rest of the request body still goes
+ * up, the origin may answer (or refuse) before it has read all of it.
+ * returns what relay_response returned
+ */
+static enum step upload_and_relay(struct conn *c) {
+    if (c->state == CONN_SEND_BODY) {
+        int rc = upload_body(c);
+        if (rc < 0) {
+            return STEP_CLOSE;
+        }
+        if (rc > 0) {
+            c->state = CONN_RELAY;
+            if (!c->got_first_byte) {
+                set_deadline(c, DEADLINE_FIRST_BYTE, FIRST_BYTE_TIMEOUT_SECS);
+            }
+        }
+    }
+    enum step step = relay_response(c);
+    if (step == STEP_DONE && c->state == CONN_SEND_BODY) {
+        // answered before the body was read: what is left of it is on
+        // both connections, neither can carry another request
+        c->client_keep_alive = 0;
+        c->framing.keep_alive = 0;
+    }
+    return step;
+}
+
+/**
+ * writes what is left of c->out to the origin, gathered in one call.
+ * returns STEP_DONE once all of it was sent
+ */
+static enum step send_request(struct conn *c) {
+    int rc = buf_chain_write(&c->out, c->origin_fd);
+    if (rc > 0) {
+        return STEP_DONE;
+    }
+    if (rc == 0) {
+        return STEP_AGAIN;
+    }
+    if (retry_stale(c)) {
+        return STEP_RETRY;
+    }
+    perror("Error sending request");
+    return STEP_FAILED;
+}
+
+// the origin connection is up: tell the client, then relay both ways
+static void tunnel_start(struct conn *c) {
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    memcpy(c->response, established, sizeof(established) - 1);
+    c->resp_len = sizeof(established) - 1;
+    c->resp_off = 0;
+    c->state = CONN_TUNNEL;
+    c->status = 200;
+    // the request is answered, the tunnel's lifetime is no request latency
+    log_request(c, metrics_observe(METRIC_TOTAL, c->t_start));
+    c->t_start = 0;
+    metrics_tunnel_opened();
+    set_deadline(c, DEADLINE_RELAY, TUNNEL_IDLE_SECS);
+}
+
+/**
+ * pumps both directions of a tunnel until they block.
+ * returns 0 while the tunnel stays open, 1 once it should be closed
+ */
+static int tunnel_relay(struct conn *c) {
+    int up = tunnel_pump(c, &c->up, c->client_fd, c->origin_fd);
+    int down = up < 0 ? -1 : tunnel_pump(c, &c->down, c->origin_fd, c->client_fd);
+    if (up < 0 || down < 0 || (c->up.eof && c->down.eof)) {
+        return 1;
+    }
+    if (up > 0 || down > 0) {
+        set_deadline(c, DEADLINE_RELAY, TUNNEL_IDLE_SECS);
+    }
+    return 0;
+}
+
+/**
+ * the life of a client connection, one request after the other:
+ * receive, parse, resolve, filter, connect, send and relay.
+ *
+ * It runs as a coroutine on the connection's loop (coro.h) and is
+ * called again on every event of either socket, when the resolver or
+ * the upstream pool answers, and when a deadline cuts a step short.
+ * Each await gives the loop back until its step can go on, so a
+ * waiting connection costs its struct conn and nothing else; only
+ * getaddrinfo, which has to block, runs on the threadpool. c->state
+ * names what is being awaited for on_deadline and conn_close.
+ */
+static void conn_run(struct conn *c) {
+    int rc;
+    enum step step;
+    coro *co = &c->co;
+    if (c->error_status != 0 && c->state != CONN_SEND_ERROR) {
+        goto fail; // a deadline passed
+    }
+    CORO_BEGIN(co);
+
+    while (1) {
+        // receive
+        CORO_AWAIT(co, (rc = receive_request(c)) != 0);
+        if (rc < 0) {
+            conn_close(c);
+            return;
+        }
+        c->t_mark = metrics_observe(METRIC_RECV, c->t_start);
+        // Pipelined requests stay in the buffer until this one is answered
+        c->saved = c->request_buf[c->header_len];
+        c->request_buf[c->header_len] = '\0';
+
+        // parse
+        if (c->req.state == HR_TOO_LARGE) {
+            c->error_status = 431;
+            goto fail;
+        }
+        if (!parse_request(c)) {
+            c->error_status = 400;
+            goto fail;
+        }
+        c->client_keep_alive = wants_keep_alive(c);
+        metrics_observe(METRIC_PARSE, c->t_mark);
+        if (!is_method_supported(c->method1)) {
+            c->error_status = 501;
+            goto fail;
+        }
+        if (!request_body(c)) {
+            c->error_status = 400;
+            goto fail;
+        }
+        // "Expect: 100-continue" goes on to the origin, whose 100 or refusal is
+        // relayed before the client sends the body. Our own error pages come
+        // before any of it was read, and close the connection.
+        if (request_header_has(c, "Expect", NULL) && !request_header_has(c, "Expect", "100-continue")) {
+            c->error_status = 417;
+            goto fail;
+        }
+
+        // Fresh cached responses need neither the resolver nor the origin,
+        // but the filter may have changed since they were stored
+    lookup:
+        if (lookup_cache(c)) {
+            c->error_status = filter_verdict(c, c->hit->addr);
+            if (c->error_status != 0) {
+                goto fail;
+            }
+            goto send_cached;
+        }
+
+        // Another request is fetching the same response: take what it gets,
+        // or fetch on our own if it can't be shared or takes too long
+        if (c->fill != NULL && !c->fill_leader) {
+            c->state = CONN_WAIT_FILL;
+            set_deadline(c, DEADLINE_FILL, coalesce_secs);
+            CORO_AWAIT(co, (rc = fill_wait(c)) != COALESCE_WAIT);
+            if (rc == COALESCE_UNSHARED) {
+                fill_done(c, 0);
+                c->fill_bypass = 1;
+                timer_cancel(&c->deadline); // resolving and waiting for a slot have none
+                goto lookup; // after a 304 the cache has it again
+            }
+            c->error_status = filter_verdict(c, c->dns.addr);
+            if (c->error_status != 0) {
+                goto fail;
+            }
+            c->state = CONN_SEND_FILL;
+            c->status = 200; // only a storable response is shared
+            set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+            CORO_AWAIT(co, (rc = flush_fill(c)) != 0);
+            fill_done(c, rc > 0);
+            if (rc < 0) {
+                conn_close(c);
+                return;
+            }
+            goto request_done;
+        }
+
+        // resolve, on the threadpool unless the answer is cached
+        c->state = CONN_RESOLVING;
+        c->dns.done = on_dns_done;
+        c->dns.arg = c;
+        c->t_mark = metrics_now();
+        c->waiting = !dns_resolve(c->host1, &c->dns);
+        CORO_AWAIT(co, !c->waiting);
+        c->t_mark = metrics_observe(METRIC_DNS, c->t_mark);
+        if (c->dns.status != DNS_OK) {
+            c->error_status = c->dns.status == DNS_BUSY ? 503 : 404;
+            goto fail;
+        }
+
+        // filter the name and the address
+        c->error_status = filter_verdict(c, c->dns.addr);
+        metrics_observe(METRIC_FILTER, c->t_mark);
+        if (c->error_status != 0) {
+            goto fail;
+        }
+
+        // connect, a tunnel's connection is never pooled so it takes no slot
+        if (prepare_request(c) != 0) {
+            c->error_status = 500;
+            goto fail;
+        }
+        if (!c->tunnel) {
+            c->upstream_w.ready = on_upstream_ready;
+            c->upstream_w.arg = c;
+            rc = upstream_acquire(c->host1, c->port1, &c->upstream_w, &c->upstream);
+            if (rc == UPSTREAM_WAIT) {
+                c->state = CONN_WAIT_UPSTREAM;
+                c->waiting = 1;
+                CORO_AWAIT(co, !c->waiting);
+                rc = c->upstream_w.fd;
+            }
+            c->upstream_held = 1;
+            c->origin_fd = rc >= 0 ? rc : -1; // pooled, or UPSTREAM_NEW
+        }
+    connect_origin:
+        rc = open_origin(c);
+        if (rc > 0) {
+            c->state = CONN_CONNECTING;
+            set_deadline(c, DEADLINE_CONNECT, CONNECT_TIMEOUT_SECS);
+            CORO_AWAIT(co, (rc = connect_done(c)) != 0);
+            rc = rc > 0 ? 0 : -1;
+        }
+        if (rc < 0) {
+            c->error_status = 500;
+            goto fail;
+        }
+
+        // send
+        c->state = CONN_SEND_REQUEST;
+        c->t_origin = metrics_now();
+        c->origin_ns = 0;
+        set_deadline(c, DEADLINE_FIRST_BYTE, FIRST_BYTE_TIMEOUT_SECS);
+        CORO_AWAIT(co, (step = send_request(c)) != STEP_AGAIN);
+        if (step == STEP_RETRY) {
+            goto connect_origin;
+        }
+        if (step != STEP_DONE) {
+            c->error_status = 500;
+            goto fail;
+        }
+
+        if (c->tunnel) {
+            tunnel_start(c);
+            CORO_AWAIT(co, (rc = flush_response(c)) != 0); // "200 Connection Established" first
+            if (rc > 0) {
+                CORO_AWAIT(co, tunnel_relay(c));
+            }
+            conn_close(c);
+            return;
+        }
+
+        // relay, while the rest of the body goes up
+        c->state = c->upload.state == HF_DONE ? CONN_RELAY : CONN_SEND_BODY;
+        c->t_mark = metrics_now();
+        CORO_AWAIT(co, (step = upload_and_relay(c)) != STEP_AGAIN);
+        if (step == STEP_RETRY) {
+            goto connect_origin;
+        }
+        if (step == STEP_FAILED && c->relayed == 0) {
+            c->error_status = 500;
+            goto fail;
+        }
+        if (step != STEP_DONE) {
+            conn_close(c);
+            return;
+        }
+        finish_response(c);
+        if (!c->not_modified) {
+            goto request_done;
+        }
+        // our copy is still current, the client gets it instead of the 304
+
+    send_cached:
+        c->state = CONN_SEND_CACHED;
+        c->status = 200; // the cache keeps nothing else
+        c->conn_off = stored_conn_off(c->hit->data, c->hit->len);
+        set_deadline(c, DEADLINE_RELAY, RELAY_IDLE_SECS);
+        CORO_AWAIT(co, (rc = flush_cached(c)) != 0);
+        if (rc < 0) {
+            conn_close(c);
+            return;
+        }
+
+    request_done:
+        if (!response_done(c)) {
+            conn_close(c);
+            return;
+        }
+        next_request(c);
+    }
+
+fail:
+    send_error(c, c->error_status);
+    CORO_AWAIT(co, flush_response(c) != 0);
+    conn_close(c);
+    CORO_END(co);
+}
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define URING_ENTRIES 1024 // submission entries per ring
+#define URING_CANCEL_DATA (~0ULL) // user_data of cancellations, their completions are ignored
+#define URING_ACCEPT_DATA (1ULL << 63) // in the user_data of accepts
+#define URING_GEN_MASK 0x7fffffffu
+
+/**
+ * io_uring: what an fd is registered for. A completion's user_data is
+ * the fd and the generation of its registration, so completions that
+ * were already queued when the fd was removed (and maybe reused) are
+ * told apart and dropped, and a bit telling accepts apart, whose
+ * dropped completions still hold a connection to close.
+ */
+struct reactor_reg {
+    reactor_handler *h;         // polled for "events"
+    reactor_acceptor *a;        // or accepted on, NULL for both if not registered
+    uint32_t events;
+    uint32_t gen;
+    int paused;                 // accepting failed, try again at the next tick
+};
+
+struct reactor {
+    int epfd;                   // -1 with io_uring
+    int use_uring;
+    uring ring;
+    struct reactor_reg *regs;   // io_uring: by fd
+    int nregs;
+    int paused;                 // acceptors waiting for the next tick
+    int wakefd;
+    atomic_int running;
+    reactor_handler wake_h;
+    pthread_mutex_t post_lock;  // protects posted
+    reactor_task *posted;       // tasks from other threads, newest first
+    reactor_task *deferred;     // tasks to run after the current batch
+    int tick_ms;                // 0 if no tick was set
+    long long next_tick;        // monotonic ms of the next tick
+    void (*tick_fn)(void *arg);
+    void *tick_arg;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void run_list(reactor_task *list) {
+    // lists are pushed newest first, run them in submission order
+    reactor_task *ordered = NULL;
+    while (list != NULL) {
+        reactor_task *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered != NULL) {
+        reactor_task *next = ordered->next;
+        ordered->fn(ordered->arg);
+        ordered = next;
+    }
+}
+
+static void on_wakeup(void *arg, uint32_t events) {
+    (void)events;
+    reactor *r = (reactor *)arg;
+    uint64_t count;
+    while (read(r->wakefd, &count, sizeof(count)) > 0) {
+        // drain the counter so the next post triggers a new edge
+    }
+
+    pthread_mutex_lock(&r->post_lock);
+    reactor_task *list = r->posted;
+    r->posted = NULL;
+    pthread_mutex_unlock(&r->post_lock);
+
+    run_list(list);
+}
+
+int reactor_uring_supported(void) {
+    return uring_supported();
+}
+
+reactor *reactor_create(void) {
+    return reactor_create_backend(REACTOR_EPOLL);
+}
+
+reactor *reactor_create_backend(reactor_backend backend) {
+    reactor *r = (reactor *)calloc(1, sizeof(reactor));
+    if (r == NULL) {
+        perror("error: malloc");
+        return NULL;
+    }
+
+    r->epfd = -1;
+    if (backend == REACTOR_URING) {
+        if (uring_init(&r->ring, URING_ENTRIES) == 0) {
+            r->use_uring = 1;
+        } else {
+            perror("error: io_uring_setup, using epoll");
+        }
+    }
+    if (!r->use_uring) {
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            perror("error: epoll_create1");
+            free(r);
+            return NULL;
+        }
+    }
+
+    r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wakefd < 0) {
+        perror("error: eventfd");
+        if (r->use_uring) {
+            uring_exit(&r->ring);
+        } else {
+            close(r->epfd);
+        }
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->post_lock, NULL);
+    r->wake_h.fn = on_wakeup;
+    r->wake_h.arg = r;
+    if (reactor_add(r, r->wakefd, EPOLLIN, &r->wake_h) != 0) {
+        reactor_destroy(r);
+        return NULL;
+    }
+    atomic_store(&r->running, 1);
+    return r;
+}
+
+static uint64_t reg_data(const reactor *r, int fd) {
+    const struct reactor_reg *reg = &r->regs[fd];
+    uint64_t data = (uint64_t)(reg->gen & URING_GEN_MASK) << 32 | (uint32_t)fd;
+    return reg->a != NULL ? data | URING_ACCEPT_DATA : data;
+}
+
+// queues the multishot poll or accept of a registered fd
+static int uring_arm(reactor *r, int fd) {
+    struct reactor_reg *reg = &r->regs[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (sqe == NULL) {
+        perror("error: io_uring submission");
+        return -1;
+    }
+    sqe->fd = fd;
+    sqe->user_data = reg_data(r, fd);
+    if (reg->a != NULL) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = reg->events & ~EPOLLEXCLUSIVE;
+    }
+    return 0;
+}
+
+// io_uring: records what "fd" is registered for and arms it
+static int uring_add(reactor *r, int fd, uint32_t events, reactor_handler *h, reactor_acceptor *a) {
+    if (fd >= r->nregs) {
+        int n = r->nregs > 0 ? r->nregs : 1024;
+        while (n <= fd) {
+            n *= 2;
+        }
+        struct reactor_reg *regs = (struct reactor_reg *)realloc(r->regs, n * sizeof(*regs));
+        if (regs == NULL) {
+            perror("error: malloc");
+            return -1;
+        }
+        memset(regs + r->nregs, 0, (n - r->nregs) * sizeof(*regs));
+        r->regs = regs;
+        r->nregs = n;
+    }
+    struct reactor_reg *reg = &r->regs[fd];
+    reg->h = h;
+    reg->a = a;
+    reg->events = events | EPOLLET;
+    reg->gen = (reg->gen + 1) & URING_GEN_MASK;
+    reg->paused = 0;
+    if (uring_arm(r, fd) != 0) {
+        reg->h = NULL;
+        reg->a = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_add(reactor *r, int fd, uint32_t events, reactor_handler *h) {
+    if (r->use_uring) {
+        return uring_add(r, fd, events, h, NULL);
+    }
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = h;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("error: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// epoll: accepts until the backlog is empty
+static void on_acceptable(void *arg, uint32_t events) {
+    (void)events;
+    reactor_acceptor *a = (reactor_acceptor *)arg;
+    while (!a->paused) {
+        int fd = accept4(a->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed\n");
+            }
+            return;
+        }
+        a->fn(a->arg, fd);
+    }
+}
+
+int reactor_add_acceptor(reactor *r, int fd, reactor_acceptor *a) {
+    a->fd = fd;
+    a->paused = 0;
+    if (r->use_uring) {
+        return uring_add(r, fd, 0, NULL, a);
+    }
+    a->h.fn = on_acceptable;
+    a->h.arg = a;
+    // EPOLLEXCLUSIVE: one reactor wakes up per connection on a shared socket
+    return reactor_add(r, fd, EPOLLIN | EPOLLEXCLUSIVE, &a->h);
+}
+
+int reactor_pause_acceptor(reactor *r, reactor_acceptor *a) {
+    if (a->paused) {
+        return 0;
+    }
+    a->paused = 1;
+    return reactor_del(r, a->fd);
+}
+
+int reactor_resume_acceptor(reactor *r, reactor_acceptor *a) {
+    if (!a->paused) {
+        return 0;
+    }
+    return reactor_add_acceptor(r, a->fd, a);
+}
+
+int reactor_del(reactor *r, int fd) {
+    if (!r->use_uring) {
+        return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    if (fd < 0 || fd >= r->nregs || (r->regs[fd].h == NULL && r->regs[fd].a == NULL)) {
+        errno = ENOENT;
+        return -1;
+    }
+    struct reactor_reg *reg = &r->regs[fd];
+    uint64_t data = reg_data(r, fd);
+    reg->h = NULL;
+    reg->a = NULL;
+    if (reg->paused) {
+        reg->paused = 0;
+        r->paused--;
+        return 0; // nothing armed
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (sqe == NULL) {
+        perror("error: io_uring submission");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_CANCEL_DATA;
+    return 0;
+}
+
+void reactor_post(reactor *r, reactor_task *t) {
+    pthread_mutex_lock(&r->post_lock);
+    t->next = r->posted;
+    r->posted = t;
+    pthread_mutex_unlock(&r->post_lock);
+
+    uint64_t one = 1;
+    if (write(r->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("error: eventfd write");
+    }
+}
+
+void reactor_defer(reactor *r, reactor_task *t) {
+    t->next = r->deferred;
+    r->deferred = t;
+}
+
+void reactor_set_tick(reactor *r, int interval_ms, void (*fn)(void *arg), void *arg) {
+    r->tick_ms = interval_ms;
+    r->tick_fn = fn;
+    r->tick_arg = arg;
+    r->next_tick = now_ms() + interval_ms;
+}
+
+/**
+ * io_uring: hands a completion to the fd's handler, or its acceptor,
+ * and arms the fd again if its multishot request ended
+ */
+static void uring_dispatch(reactor *r, uint64_t data, int res, uint32_t flags) {
+    int fd = (int)(uint32_t)data;
+    uint32_t gen = (uint32_t)(data >> 32) & URING_GEN_MASK;
+    if (data == URING_CANCEL_DATA) {
+        return;
+    }
+    if (fd >= r->nregs || r->regs[fd].gen != gen
+        || (r->regs[fd].h == NULL && r->regs[fd].a == NULL)) {
+        // the fd was removed, and maybe registered again, since; a
+        // connection accepted meanwhile has nobody to go to
+        if ((data & URING_ACCEPT_DATA) && res >= 0) {
+            close(res);
+        }
+        return;
+    }
+    struct reactor_reg *reg = &r->regs[fd];
+    if (reg->a != NULL) {
+        if (res >= 0) {
+            reg->a->fn(reg->a->arg, res);
+        } else if (res != -ECONNABORTED && res != -EINTR) {
+            errno = -res;
+            perror("Accept failed\n");
+            if (!(flags & IORING_CQE_F_MORE)) {
+                reg->paused = 1; // out of fds or memory, don't spin on it
+                r->paused++;
+                return;
+            }
+        }
+    } else if (reg->h != NULL && res > 0) {
+        reg->h->fn(reg->h->arg, (uint32_t)res);
+    }
+
+    // the callback may have removed the fd, or even added it again
+    reg = &r->regs[fd];
+    if (!(flags & IORING_CQE_F_MORE) && reg->gen == gen && (reg->h != NULL || reg->a != NULL)) {
+        uring_arm(r, fd);
+    }
+}
+
+// io_uring: accepting failed, try again now that a tick passed
+static void uring_resume_acceptors(reactor *r) {
+    for (int fd = 0; fd < r->nregs && r->paused > 0; fd++) {
+        if (r->regs[fd].paused) {
+            r->regs[fd].paused = 0;
+            r->paused--;
+            uring_arm(r, fd);
+        }
+    }
+}
+
+static void run_uring(reactor *r) {
+    while (atomic_load(&r->running)) {
+        int timeout = -1;
+        if (r->tick_ms > 0) {
+            long long left = r->next_tick - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        // what the last batch queued is submitted here, with the wait
+        if (uring_submit_and_wait(&r->ring, timeout) < 0
+            && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("error: io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&r->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_seen(&r->ring);
+            uring_dispatch(r, data, res, flags);
+        }
+
+        if (r->tick_ms > 0 && now_ms() >= r->next_tick) {
+            r->next_tick = now_ms() + r->tick_ms;
+            r->tick_fn(r->tick_arg);
+            if (r->paused > 0) {
+                uring_resume_acceptors(r);
+            }
+        }
+
+        while (r->deferred != NULL) {
+            reactor_task *list = r->deferred;
+            r->deferred = NULL;
+            run_list(list);
+        }
+    }
+}
+
+void reactor_run(reactor *r) {
+    if (r->use_uring) {
+        run_uring(r);
+        return;
+    }
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (atomic_load(&r->running)) {
+        int timeout = -1;
+        if (r->tick_ms > 0) {
+            long long left = r->next_tick - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            reactor_handler *h = (reactor_handler *)events[i].data.ptr;
+            h->fn(h->arg, events[i].events);
+        }
+
+        if (r->tick_ms > 0 && now_ms() >= r->next_tick) {
+            r->next_tick = now_ms() + r->tick_ms;
+            r->tick_fn(r->tick_arg);
+        }
+
+        while (r->deferred != NULL) {
+            reactor_task *list = r->deferred;
+            r->deferred = NULL;
+            run_list(list);
+        }
+    }
+}
+
+void reactor_stop(reactor *r) {
+    atomic_store(&r->running, 0);
+    uint64_t one = 1;
+    if (write(r->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("error: eventfd write");
+    }
+}
+
+void reactor_destroy(reactor *r) {
+    if (r == NULL)
+        return;
+    close(r->wakefd);
+    if (r->use_uring) {
+        uring_exit(&r->ring);
+    } else {
+        close(r->epfd);
+    }
+    pthread_mutex_destroy(&r->post_lock);
+    free(r->regs);
+    free(r);
+}
@@ -0,0 +1,161 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/**
+ * reactor.h
+ *
+ * A small edge-triggered event loop. Each reactor is driven by
+ * exactly one thread (reactor_run); other threads talk to it only
+ * through reactor_post, which queues a task and wakes the loop up
+ * through an eventfd.
+ *
+ * Readiness comes from epoll, or from io_uring: there every fd gets a
+ * multishot poll and every listening socket a multishot accept, and
+ * adding and removing fds is queued and submitted with the wait for
+ * events, in the same system call.
+ */
+
+// maximum number of events handled per epoll_wait
+#define REACTOR_MAX_EVENTS 256
+
+typedef struct reactor reactor;
+
+/**
+ * called with the epoll event mask whenever a registered fd is ready
+ */
+typedef void (*reactor_fn)(void *arg, uint32_t events);
+
+/**
+ * registered with an fd, normally embedded in the object owning the fd
+ */
+typedef struct reactor_handler {
+    reactor_fn fn;
+    void *arg;
+} reactor_handler;
+
+/**
+ * called with each connection accepted on a listening socket
+ */
+typedef void (*reactor_accept_fn)(void *arg, int fd);
+
+/**
+ * a listening socket the reactor accepts on, embedded in its owner
+ */
+typedef struct reactor_acceptor {
+    reactor_accept_fn fn;
+    void *arg;
+    int fd;
+    int paused;                 // see reactor_pause_acceptor
+    reactor_handler h;          // epoll: readiness of fd
+} reactor_acceptor;
+
+/**
+ * where readiness comes from
+ */
+typedef enum {
+    REACTOR_EPOLL,
+    REACTOR_URING               // io_uring multishot poll and accept
+} reactor_backend;
+
+/**
+ * a unit of work run on the loop thread, embedded in the caller's
+ * object so that posting never allocates
+ */
+typedef struct reactor_task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct reactor_task *next;
+} reactor_task;
+
+/**
+ * reactor_create creates an epoll instance and its wakeup eventfd.
+ * returns NULL on failure.
+ */
+reactor *reactor_create(void);
+
+/**
+ * reactor_create_backend creates a reactor on "backend", falling back
+ * to epoll if an io_uring can't be set up.
+ * returns NULL on failure.
+ */
+reactor *reactor_create_backend(reactor_backend backend);
+
+/**
+ * reactor_uring_supported returns 1 if the kernel has what the
+ * io_uring backend needs (5.19 or later, and io_uring not disabled).
+ */
+int reactor_uring_supported(void);
+
+/**
+ * reactor_add registers "fd" for "events" (EPOLLET is added).
+ * returns 0 on success, -1 on failure.
+ */
+int reactor_add(reactor *r, int fd, uint32_t events, reactor_handler *h);
+
+/**
+ * reactor_add_acceptor accepts connections on the listening socket
+ * "fd" and passes each, non-blocking and close-on-exec, to
+ * a->fn(a->arg, client_fd). When several reactors share "fd", a
+ * connection wakes only one of them. Removed with reactor_del.
+ * returns 0 on success, -1 on failure.
+ */
+int reactor_add_acceptor(reactor *r, int fd, reactor_acceptor *a);
+
+/**
+ * reactor_pause_acceptor stops accepting on "a" until
+ * reactor_resume_acceptor: new connections wait in the socket's
+ * backlog, or go to the other reactors sharing it. Either may be
+ * called from a->fn. With io_uring, connections the kernel accepted
+ * before the pause took effect are closed.
+ * returns 0 on success, -1 on failure.
+ */
+int reactor_pause_acceptor(reactor *r, reactor_acceptor *a);
+int reactor_resume_acceptor(reactor *r, reactor_acceptor *a);
+
+/**
+ * reactor_del removes "fd" from the loop, call before close().
+ * With epoll, events already in the current batch are still
+ * delivered (see reactor_defer).
+ */
+int reactor_del(reactor *r, int fd);
+
+/**
+ * reactor_post queues "t" to run on the loop thread.
+ * Safe to call from any thread.
+ */
+void reactor_post(reactor *r, reactor_task *t);
+
+/**
+ * reactor_defer queues "t" to run once the current batch of events
+ * has been handled. Used to free objects that may still have events
+ * pending in the batch. Loop thread only.
+ */
+void reactor_defer(reactor *r, reactor_task *t);
+
+/**
+ * reactor_set_tick makes the loop call fn(arg) about every
+ * "interval_ms" milliseconds, used for housekeeping like timeouts.
+ * Loop thread only (or before reactor_run).
+ */
+void reactor_set_tick(reactor *r, int interval_ms, void (*fn)(void *arg), void *arg);
+
+/**
+ * reactor_run handles events until reactor_stop is called.
+ */
+void reactor_run(reactor *r);
+
+/**
+ * reactor_stop makes reactor_run return after the current batch.
+ * Safe to call from any thread.
+ */
+void reactor_stop(reactor *r);
+
+/**
+ * reactor_destroy closes the epoll (or io_uring) and eventfd descriptors.
+ */
+void reactor_destroy(reactor *r);
+
+#endif
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int relay_pipe_get(relay_cache *rc, int p[2]) {
+    if (rc->num_pipes > 0) {
+        rc->num_pipes--;
+        p[0] = rc->pipes[rc->num_pipes][0];
+        p[1] = rc->pipes[rc->num_pipes][1];
+        return 0;
+    }
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("error: pipe2");
+        return -1;
+    }
+    // larger pipes mean fewer splice calls, the default size still works
+    fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_LEN);
+    return 0;
+}
+
+void relay_pipe_put(relay_cache *rc, int p[2], int dirty) {
+    if (dirty || rc->num_pipes == RELAY_CACHE_PIPES) {
+        close(p[0]);
+        close(p[1]);
+    } else {
+        rc->pipes[rc->num_pipes][0] = p[0];
+        rc->pipes[rc->num_pipes][1] = p[1];
+        rc->num_pipes++;
+    }
+    p[0] = p[1] = -1;
+}
+
+char *relay_buf_get(relay_cache *rc) {
+    if (rc->num_bufs > 0) {
+        return rc->bufs[--rc->num_bufs];
+    }
+    char *buf = (char *)malloc(RELAY_BUF_LEN);
+    if (buf == NULL) {
+        perror("error: malloc");
+    }
+    return buf;
+}
+
+void relay_buf_put(relay_cache *rc, char *buf) {
+    if (rc->num_bufs == RELAY_CACHE_BUFS) {
+        free(buf);
+    } else {
+        rc->bufs[rc->num_bufs++] = buf;
+    }
+}
+
+void relay_cache_destroy(relay_cache *rc) {
+    while (rc->num_pipes > 0) {
+        rc->num_pipes--;
+        close(rc->pipes[rc->num_pipes][0]);
+        close(rc->pipes[rc->num_pipes][1]);
+    }
+    while (rc->num_bufs > 0) {
+        free(rc->bufs[--rc->num_bufs]);
+    }
+}
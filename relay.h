@@ -0,0 +1,51 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+/**
+ * relay.h
+ *
+ * Per-thread resources for moving response bytes to clients.
+ *
+ * Bodies are moved origin -> pipe -> client with splice(), so they
+ * never enter user space. Headers, chunk-size lines and the fallback
+ * path (when splice is not possible) go through large buffers.
+ * A connection borrows a pipe or buffer only while it holds bytes
+ * that are not yet sent, so idle connections cost neither.
+ */
+
+#define RELAY_BUF_LEN (64 * 1024)    // user-space relay buffer
+#define RELAY_PIPE_LEN (256 * 1024)  // requested pipe capacity
+#define RELAY_CACHE_PIPES 64         // free pipes kept per thread
+#define RELAY_CACHE_BUFS 64          // free buffers kept per thread
+
+typedef struct relay_cache {
+    int pipes[RELAY_CACHE_PIPES][2];
+    int num_pipes;
+    char *bufs[RELAY_CACHE_BUFS];
+    int num_bufs;
+} relay_cache;
+
+/**
+ * relay_pipe_get hands out an empty pipe with non-blocking ends.
+ * returns 0 on success, -1 if no pipe could be created.
+ */
+int relay_pipe_get(relay_cache *rc, int p[2]);
+
+/**
+ * relay_pipe_put returns a pipe, "dirty" pipes still holding bytes
+ * are closed instead of being cached.
+ */
+void relay_pipe_put(relay_cache *rc, int p[2], int dirty);
+
+/**
+ * relay_buf_get hands out a RELAY_BUF_LEN buffer, NULL if out of memory.
+ */
+char *relay_buf_get(relay_cache *rc);
+void relay_buf_put(relay_cache *rc, char *buf);
+
+/**
+ * relay_cache_destroy closes and frees everything cached.
+ */
+void relay_cache_destroy(relay_cache *rc);
+
+#endif
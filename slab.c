@@ -0,0 +1,77 @@
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void slab_init(slab_cache *sc, size_t size) {
+    memset(sc, 0, sizeof(*sc));
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    sc->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    // the last word of a slab links it to the one taken before
+    sc->per_slab = (SLAB_BYTES - sizeof(void *)) / sc->size;
+    if (sc->per_slab == 0) {
+        sc->per_slab = 1;
+    }
+}
+
+// a slab's objects and its link, a multiple of SLAB_ALIGN as aligned_alloc wants
+static size_t slab_bytes(const slab_cache *sc) {
+    size_t bytes = sc->per_slab * sc->size + sizeof(void *);
+    return (bytes + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+// takes a slab from the system and makes it the one objects are carved from
+static int slab_grow(slab_cache *sc) {
+    size_t bytes = slab_bytes(sc);
+    char *slab = (char *)aligned_alloc(SLAB_ALIGN, bytes);
+    if (slab == NULL) {
+        perror("error: malloc");
+        return -1;
+    }
+    memcpy(slab + bytes - sizeof(void *), &sc->slabs, sizeof(void *));
+    sc->slabs = slab;
+    sc->carve = slab;
+    sc->left = sc->per_slab;
+    sc->slabs_taken++;
+    return 0;
+}
+
+void *slab_alloc(slab_cache *sc) {
+    void *obj = sc->free_list;
+    if (obj != NULL) {
+        memcpy(&sc->free_list, obj, sizeof(void *));
+    } else {
+        // carving in order keeps a young cache's objects next to each other
+        if (sc->left == 0 && slab_grow(sc) != 0) {
+            return NULL;
+        }
+        obj = sc->carve;
+        sc->carve += sc->size;
+        sc->left--;
+    }
+    sc->in_use++;
+    return obj;
+}
+
+void slab_free(slab_cache *sc, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    memcpy(obj, &sc->free_list, sizeof(void *));
+    sc->free_list = obj;
+    sc->in_use--;
+}
+
+void slab_destroy(slab_cache *sc) {
+    size_t bytes = slab_bytes(sc);
+    char *slab = (char *)sc->slabs;
+    while (slab != NULL) {
+        char *older;
+        memcpy(&older, slab + bytes - sizeof(void *), sizeof(void *));
+        free(slab);
+        slab = older;
+    }
+    slab_init(sc, sc->size);
+}
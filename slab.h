@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/**
+ * slab.h
+ *
+ * Caches of fixed-size objects, one per thread that allocates them.
+ * Objects are carved out of SLAB_BYTES slabs taken from the system,
+ * and a freed object goes on the cache's free list for the next
+ * allocation. Objects that come and go with connections then cost no
+ * allocator call once the cache has grown to the peak number alive.
+ *
+ * A cache is used from its thread only, objects are freed on the
+ * thread that allocated them. Slabs go back to the system when the
+ * cache is destroyed, not before.
+ */
+
+#define SLAB_BYTES (256 * 1024) // carved into objects; an object larger than this gets a slab of its own
+#define SLAB_ALIGN 64           // objects start on a cache line
+
+typedef struct slab_cache {
+    size_t size;                // of an object, rounded up to SLAB_ALIGN
+    size_t per_slab;            // objects carved from one slab
+    void *free_list;            // freed objects, linked through their first word
+    void *slabs;                // slabs taken, linked through their last word
+    char *carve;                // next object not carved yet in the newest slab
+    size_t left;                // objects not carved yet in the newest slab
+    unsigned long slabs_taken;  // allocator calls this cache made
+    unsigned long in_use;       // objects handed out and not freed
+} slab_cache;
+
+/**
+ * slab_init prepares an empty cache of "size"-byte objects, it takes
+ * no memory until the first slab_alloc.
+ */
+void slab_init(slab_cache *sc, size_t size);
+
+/**
+ * slab_alloc returns an object, its contents are whatever the last
+ * user left. returns NULL if no slab could be taken.
+ */
+void *slab_alloc(slab_cache *sc);
+
+/**
+ * slab_free gives "obj" back to the cache it came from.
+ */
+void slab_free(slab_cache *sc, void *obj);
+
+/**
+ * slab_destroy gives every slab back to the system, objects still in
+ * use included.
+ */
+void slab_destroy(slab_cache *sc);
+
+#endif
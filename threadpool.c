@@ -2,20 +2,47 @@
 #include "threadpool.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define MAXT_IN_POOL 200 // maximum number of threads allowed in a pool
 
 
+static void* do_work_ring(void* p);
+static void* do_work_stealing(void* p);
+static void wake_one(threadpool* tp);
+static int start_worker(threadpool* tp, int index);
+
+// the ring-mode pool and the work-stealing worker running on this thread, if any
+static __thread threadpool* current_pool;
+static __thread tp_worker* current_worker;
+
 threadpool* create_threadpool(int num_threads_in_pool) {
-    if (num_threads_in_pool < 1 || num_threads_in_pool >MAXT_IN_POOL) {
+    return create_threadpool_queue(num_threads_in_pool, TP_QUEUE_LOCKFREE);
+}
+
+threadpool* create_threadpool_queue(int num_threads_in_pool, threadpool_queue queue) {
+    return create_threadpool_elastic(num_threads_in_pool, num_threads_in_pool, TP_IDLE_TIMEOUT_MS, queue);
+}
+
+threadpool* create_threadpool_elastic(int min_threads, int max_threads, int idle_timeout_ms,
+                                      threadpool_queue queue) {
+    int num_threads_in_pool = max_threads;
+    if (min_threads < 1 || min_threads > max_threads || num_threads_in_pool >MAXT_IN_POOL) {
         fprintf(stderr, "Usage: <pool-size> <number-of-tasks> <max-number-of-request>\n");
         //exit(EXIT_FAILURE); // Incorrect command usage
         return NULL;
     }
 
-    threadpool* pool = (threadpool*)malloc(sizeof(threadpool));
+    // aligned so the ring positions really get cache lines of their own
+    threadpool* pool = (threadpool*)aligned_alloc(64, sizeof(threadpool));
     if (pool == NULL) {
         perror("error: malloc");
         // exit(EXIT_FAILURE); // Memory allocation failed
@@ -28,8 +55,84 @@ threadpool* create_threadpool(int num_threads_in_pool) {
     pool->shutdown = 0;
     pool->dont_accept = 0;
 
+    pool->queue = queue;
+    pool->ring = NULL;
+    pool->workers = NULL;
+    pool->records = NULL;
+    atomic_init(&pool->free_records, 0);
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    atomic_init(&pool->wake_seq, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->waking, 0);
+    atomic_init(&pool->dispatching, 0);
+    atomic_init(&pool->closed, 0);
+    atomic_init(&pool->stopping, 0);
+    pool->min_threads = queue == TP_QUEUE_LOCKED ? max_threads : min_threads;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    atomic_init(&pool->live_threads, 0);
+    atomic_init(&pool->slots_used, 0);
+    atomic_init(&pool->spawning, 0);
+    atomic_init(&pool->last_take_ms, 0);
+    atomic_init(&pool->spawned, 0);
+    atomic_init(&pool->retired, 0);
+    pool->max_queued = 0;
+    pool->budget_us = 0;
+    atomic_init(&pool->bounded_queued, 0);
+    atomic_init(&pool->refused, 0);
+    atomic_init(&pool->dropped, 0);
+    atomic_flag_clear(&pool->codel_lock);
+    pool->codel_above_us = 0;
+    pool->codel_next_us = 0;
+    pool->codel_count = 0;
+    pool->codel_dropping = 0;
+    threadpool_set_admission(pool, TP_ADMIT_DEPTH, TP_ADMIT_BUDGET_MS);
+    // the ring also takes the jobs submitted from outside a TP_QUEUE_STEALING pool
+    if (queue == TP_QUEUE_LOCKFREE || queue == TP_QUEUE_STEALING) {
+        pool->ring = (tp_slot*)malloc(TP_RING_SIZE * sizeof(tp_slot));
+        if (pool->ring == NULL) {
+            perror("error: malloc");
+            free(pool);
+            return NULL;
+        }
+        for (size_t i = 0; i < TP_RING_SIZE; i++) {
+            atomic_init(&pool->ring[i].seq, i);
+        }
+    }
+    if (queue == TP_QUEUE_LOCKED) {
+        pool->records = (work_t*)malloc(TP_WORK_RECORDS * sizeof(work_t));
+        if (pool->records == NULL) {
+            perror("error: malloc");
+            free(pool);
+            return NULL;
+        }
+        // all free, in order
+        for (unsigned i = 0; i < TP_WORK_RECORDS; i++) {
+            atomic_init(&pool->records[i].free_next, i + 1 < TP_WORK_RECORDS ? i + 2 : 0);
+        }
+        atomic_init(&pool->free_records, 1);
+    }
+    if (queue == TP_QUEUE_STEALING) {
+        pool->workers = (tp_worker*)aligned_alloc(64, num_threads_in_pool * sizeof(tp_worker));
+        if (pool->workers == NULL) {
+            perror("error: malloc");
+            free(pool->ring);
+            free(pool);
+            return NULL;
+        }
+        for (int i = 0; i < num_threads_in_pool; i++) {
+            atomic_init(&pool->workers[i].top, 0);
+            atomic_init(&pool->workers[i].bottom, 0);
+            pool->workers[i].pool = pool;
+            pool->workers[i].rng = 2654435761u * (i + 1);
+        }
+    }
+
     if (pthread_mutex_init(&(pool->qlock), NULL) != 0) {
         perror("error: mutex init");
+        free(pool->ring);
+        free(pool->workers);
+        free(pool->records);
         free(pool);
         //  exit(EXIT_FAILURE);
         return NULL;
@@ -37,6 +140,9 @@ threadpool* create_threadpool(int num_threads_in_pool) {
     if (pthread_cond_init(&(pool->q_not_empty), NULL) != 0) {
         perror("error: condition variable init");
         pthread_mutex_destroy(&(pool->qlock));
+        free(pool->ring);
+        free(pool->workers);
+        free(pool->records);
         free(pool);
         // exit(EXIT_FAILURE);
         return NULL;
@@ -45,6 +151,9 @@ threadpool* create_threadpool(int num_threads_in_pool) {
         perror("error: condition variable init");
         pthread_mutex_destroy(&(pool->qlock));
         pthread_cond_destroy(&(pool->q_not_empty));
+        free(pool->ring);
+        free(pool->workers);
+        free(pool->records);
         free(pool);
         // exit(EXIT_FAILURE);
         return NULL;
@@ -56,18 +165,53 @@ threadpool* create_threadpool(int num_threads_in_pool) {
         pthread_mutex_destroy(&(pool->qlock));
         pthread_cond_destroy(&(pool->q_not_empty));
         pthread_cond_destroy(&(pool->q_empty));
+        free(pool->ring);
+        free(pool->workers);
+        free(pool->records);
         free(pool);
         //exit(EXIT_FAILURE); // Memory allocation failed
         return NULL;
     }
 
+    pool->slots = (tp_thread*)malloc(num_threads_in_pool * sizeof(tp_thread));
+    if (pool->slots == NULL) {
+        perror("error: malloc");
+        pthread_mutex_destroy(&(pool->qlock));
+        pthread_cond_destroy(&(pool->q_not_empty));
+        pthread_cond_destroy(&(pool->q_empty));
+        free(pool->threads);
+        free(pool->ring);
+        free(pool->workers);
+        free(pool->records);
+        free(pool);
+        return NULL;
+    }
     for (int i = 0; i < num_threads_in_pool; i++) {
-        if (pthread_create(&(pool->threads[i]), NULL, do_work, (void*)pool) != 0) {
+        pool->slots[i].pool = pool;
+        pool->slots[i].index = i;
+        atomic_init(&pool->slots[i].state, TP_SLOT_FREE);
+    }
+
+    // the other slots are filled as the pool grows
+    for (int i = 0; i < pool->min_threads; i++) {
+        int rc;
+        if (queue == TP_QUEUE_LOCKED) {
+            atomic_store(&pool->slots[i].state, TP_SLOT_RUNNING);
+            rc = pthread_create(&(pool->threads[i]), NULL, do_work, (void*)pool);
+        } else {
+            rc = start_worker(pool, i);
+        }
+        atomic_fetch_add(&pool->live_threads, rc == 0);
+        if (rc != 0) {
             perror("error: thread creation");
             pthread_mutex_destroy(&(pool->qlock));
             pthread_cond_destroy(&(pool->q_not_empty));
             pthread_cond_destroy(&(pool->q_empty));
+            free(pool->slots);
             free(pool->threads);
+            free(pool->ring);
+            free(pool->workers);
+        free(pool->records);
             free(pool);
             //  exit(EXIT_FAILURE);
             return NULL;
@@ -77,17 +221,379 @@ threadpool* create_threadpool(int num_threads_in_pool) {
     return pool;
 }
 
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
+// returns -1 with errno ETIMEDOUT if "timeout" (may be NULL) ran out
+static int futex_wait(atomic_uint *word, unsigned expected, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
 
-    if (from_me == NULL || dispatch_to_here == NULL) {
-        return; // Input sanity check
+static void futex_wake(atomic_uint *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// claims the next free slot, returns 0 if the ring is full
+static int ring_push(threadpool* tp, dispatch_fn routine, void *arg) {
+    size_t pos = atomic_load_explicit(&tp->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        tp_slot* slot = &tp->ring[pos & (TP_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&tp->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->routine = routine;
+                slot->arg = arg;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // the consumer of this slot's previous lap is not done yet
+        } else {
+            pos = atomic_load_explicit(&tp->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// takes the oldest job, returns 0 if the ring is empty
+static int ring_pop(threadpool* tp, dispatch_fn* routine, void **arg) {
+    size_t pos = atomic_load_explicit(&tp->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        tp_slot* slot = &tp->ring[pos & (TP_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&tp->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *routine = slot->routine;
+                *arg = slot->arg;
+                atomic_store_explicit(&slot->seq, pos + TP_RING_SIZE, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&tp->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal at the top
+
+// returns 0 if the deque is full, 2 if it was empty before
+static int deque_push(tp_worker* w, dispatch_fn routine, void *arg) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    if (b - t >= TP_DEQUE_SIZE) {
+        return 0;
+    }
+    tp_job* job = &w->jobs[b & (TP_DEQUE_SIZE - 1)];
+    atomic_store_explicit(&job->routine, routine, memory_order_relaxed);
+    atomic_store_explicit(&job->arg, arg, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    return b == t ? 2 : 1;
+}
+
+static int deque_take(tp_worker* w, dispatch_fn* routine, void **arg) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&w->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    tp_job* job = &w->jobs[b & (TP_DEQUE_SIZE - 1)];
+    *routine = atomic_load_explicit(&job->routine, memory_order_relaxed);
+    *arg = atomic_load_explicit(&job->arg, memory_order_relaxed);
+    if (t == b) {
+        // the last job, a thief may be after it too
+        int won = atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                                                          memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+// returns 1 with a job, 0 if "w" looked empty and -1 if another thief got there first
+static int deque_steal(tp_worker* w, dispatch_fn* routine, void **arg) {
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (t >= b) {
+        return 0;
+    }
+    // may be overwritten by a push once top moved on, then the CAS fails
+    tp_job* job = &w->jobs[t & (TP_DEQUE_SIZE - 1)];
+    *routine = atomic_load_explicit(&job->routine, memory_order_relaxed);
+    *arg = atomic_load_explicit(&job->arg, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return -1;
+    }
+    return 1;
+}
+
+// tries every other worker's deque once, starting at a random one
+static int steal_any(threadpool* tp, tp_worker* self, dispatch_fn* routine, void **arg) {
+    // slots never started hold empty deques, retired ones too
+    int n = atomic_load_explicit(&tp->slots_used, memory_order_acquire);
+    while (1) {
+        self->rng ^= self->rng << 13; // xorshift32
+        self->rng ^= self->rng >> 17;
+        self->rng ^= self->rng << 5;
+        int start = self->rng % n;
+        int contended = 0;
+        for (int i = 0; i < n; i++) {
+            tp_worker* victim = &tp->workers[(start + i) % n];
+            if (victim == self) {
+                continue;
+            }
+            int rc = deque_steal(victim, routine, arg);
+            if (rc > 0) {
+                // the owner woke one thief when its deque stopped being
+                // empty: pass the wake-up on while it has jobs to spare
+                if (atomic_load_explicit(&victim->bottom, memory_order_relaxed)
+                    > atomic_load_explicit(&victim->top, memory_order_relaxed)) {
+                    wake_one(tp);
+                }
+                return 1;
+            }
+            contended |= rc < 0;
+        }
+        // lost a race: that deque had jobs, so going to sleep would be wrong
+        if (!contended) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * finds the next job for a worker: the newest one of its own deque
+ * (what it just spawned, likely still in its cache), then the jobs
+ * submitted from outside the pool, then the oldest ones of the other
+ * workers. "self" is NULL in a TP_QUEUE_LOCKFREE pool.
+ */
+static int find_job(threadpool* tp, tp_worker* self, dispatch_fn* routine, void **arg) {
+    if (self != NULL && deque_take(self, routine, arg)) {
+        return 1;
+    }
+    if (ring_pop(tp, routine, arg)) {
+        return 1;
+    }
+    return self != NULL && steal_any(tp, self, routine, arg);
+}
+
+static long deque_size(tp_worker* w) {
+    long size = atomic_load_explicit(&w->bottom, memory_order_relaxed)
+                - atomic_load_explicit(&w->top, memory_order_relaxed);
+    return size > 0 ? size : 0;
+}
+
+static long ring_size(threadpool* tp) {
+    long size = (long)(atomic_load_explicit(&tp->enqueue_pos, memory_order_relaxed)
+                       - atomic_load_explicit(&tp->dequeue_pos, memory_order_relaxed));
+    return size > 0 ? size : 0;
+}
+
+// 1 if jobs are known to be queued besides the one just found
+static int more_jobs(threadpool* tp, tp_worker* self) {
+    return (self != NULL && deque_size(self) > 0) || ring_size(tp) > 0;
+}
+
+static long coarse_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// runs a worker in slot "index", the caller accounts for it in live_threads
+static int start_worker(threadpool* tp, int index) {
+    // steal scans must cover the slot before its worker can push
+    int used = atomic_load(&tp->slots_used);
+    while (used < index + 1 && !atomic_compare_exchange_weak(&tp->slots_used, &used, index + 1)) {
+    }
+    void* (*work)(void*) = tp->queue == TP_QUEUE_STEALING ? do_work_stealing : do_work_ring;
+    atomic_store(&tp->slots[index].state, TP_SLOT_RUNNING);
+    if (pthread_create(&(tp->threads[index]), NULL, work, &tp->slots[index]) != 0) {
+        atomic_store(&tp->slots[index].state, TP_SLOT_FREE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * starts one more worker if the pool may grow and nobody is idle while
+ * jobs pile up (TP_SPAWN_DEPTH) or stop moving (TP_SPAWN_WAIT_MS).
+ * Called by dispatch with "self" the dispatching worker, if any.
+ */
+static void maybe_grow(threadpool* tp, tp_worker* self) {
+    if (tp->min_threads == tp->num_threads
+        || atomic_load_explicit(&tp->sleepers, memory_order_relaxed) > 0) {
+        return;
+    }
+    int live = atomic_load_explicit(&tp->live_threads, memory_order_relaxed);
+    if (live >= tp->num_threads) {
+        return;
+    }
+    long depth = ring_size(tp) + (self != NULL ? deque_size(self) : 0);
+    if (depth == 0 || (depth < TP_SPAWN_DEPTH
+                       && coarse_ms() - atomic_load_explicit(&tp->last_take_ms, memory_order_relaxed)
+                          < TP_SPAWN_WAIT_MS)) {
+        return;
+    }
+    int idle = 0;
+    if (!atomic_compare_exchange_strong(&tp->spawning, &idle, 1)) {
+        return; // someone is on it already
+    }
+    // workers retire concurrently, so claim the place in live_threads first
+    while (live < tp->num_threads
+           && !atomic_compare_exchange_weak(&tp->live_threads, &live, live + 1)) {
+    }
+    if (live < tp->num_threads) {
+        int started = 0;
+        for (int i = 0; i < tp->num_threads && !started; i++) {
+            int state = atomic_load(&tp->slots[i].state);
+            if (state == TP_SLOT_RUNNING) {
+                continue;
+            }
+            if (state == TP_SLOT_RETIRED) {
+                pthread_join(tp->threads[i], NULL); // it is on its way out
+            }
+            started = start_worker(tp, i) == 0;
+        }
+        if (started) {
+            atomic_fetch_add(&tp->spawned, 1);
+        } else {
+            // a retiring worker may not have freed its slot yet
+            atomic_fetch_sub(&tp->live_threads, 1);
+        }
+    }
+    atomic_store(&tp->spawning, 0);
+}
+
+/**
+ * called by a worker above the minimum whose idle wait timed out.
+ * returns 1 if it is to exit.
+ */
+static int try_retire(threadpool* tp) {
+    int live = atomic_load(&tp->live_threads);
+    while (live > tp->min_threads) {
+        if (atomic_compare_exchange_weak(&tp->live_threads, &live, live - 1)) {
+            // A dispatch may have picked us for its wake-up just as we
+            // timed out: pass it on to a worker that stays
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&tp->waking)) {
+                atomic_store(&tp->waking, 0);
+                wake_one(tp);
+            }
+            atomic_fetch_add(&tp->retired, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * wakes one parked worker, unless one is already on its way: that one
+ * runs jobs until the ring is empty, so it will see ours too
+ */
+static void wake_one(threadpool* tp) {
+    // Pairs with the fence in worker_loop: either a worker about to park
+    // sees the job just queued, or we see it is parking and bump wake_seq under it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&tp->sleepers, memory_order_relaxed) == 0) {
+        return;
+    }
+    int idle = 0;
+    if (!atomic_compare_exchange_strong(&tp->waking, &idle, 1)) {
+        return;
+    }
+    atomic_fetch_add(&tp->wake_seq, 1);
+    futex_wake(&tp->wake_seq, 1);
+}
+
+// returns -1 if the pool is shutting down and the job was not taken
+static int dispatch_ring(threadpool* tp, dispatch_fn routine, void *arg) {
+    atomic_fetch_add(&tp->dispatching, 1);
+    if (atomic_load(&tp->closed)) {
+        atomic_fetch_sub(&tp->dispatching, 1);
+        return -1;
+    }
+    // A job spawned by one of our workers stays with it, unless its
+    // deque is full. The owner runs it anyway, so a thief is only woken
+    // when the deque stops being empty; thieves wake each other after that
+    tp_worker* self = current_worker;
+    if (self != NULL && self->pool != tp) {
+        self = NULL;
+    }
+    int pushed = self != NULL ? deque_push(self, routine, arg) : 0;
+    if (pushed) {
+        maybe_grow(tp, self);
+        atomic_fetch_sub(&tp->dispatching, 1);
+        if (pushed == 2) {
+            wake_one(tp);
+        }
+        return 0;
     }
+    while (!ring_push(tp, routine, arg)) {
+        if (current_pool == tp) {
+            // full, and waiting could deadlock when every worker is
+            // dispatching: run the job here instead
+            atomic_fetch_sub(&tp->dispatching, 1);
+            routine(arg);
+            return 0;
+        }
+        sched_yield(); // full: the workers are behind, let them catch up
+    }
+    maybe_grow(tp, self);
+    atomic_fetch_sub(&tp->dispatching, 1);
+    wake_one(tp);
+    return 0;
+}
 
+// TP_QUEUE_LOCKED: a free work_t record, malloc'd if none is left
+static work_t* work_get(threadpool* tp) {
+    unsigned long long head = atomic_load(&tp->free_records);
+    while ((unsigned)head != 0) {
+        work_t* work = &tp->records[(unsigned)head - 1];
+        unsigned long long next = (head >> 32) + 1;
+        next = next << 32 | atomic_load_explicit(&work->free_next, memory_order_relaxed);
+        if (atomic_compare_exchange_weak(&tp->free_records, &head, next)) {
+            return work;
+        }
+    }
     work_t* work = (work_t*)malloc(sizeof(work_t));
     if (work == NULL) {
         perror("error: malloc");
+    }
+    return work;
+}
+
+static void work_put(threadpool* tp, work_t* work) {
+    if (work < tp->records || work >= tp->records + TP_WORK_RECORDS) {
+        free(work);
         return;
     }
+    unsigned index = (unsigned)(work - tp->records) + 1;
+    unsigned long long head = atomic_load(&tp->free_records);
+    unsigned long long next;
+    do {
+        atomic_store_explicit(&work->free_next, (unsigned)head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak(&tp->free_records, &head, next));
+}
+
+// dispatch without the checks, returns -1 if the job was not taken
+static int enqueue(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
+    if (from_me->queue != TP_QUEUE_LOCKED) {
+        return dispatch_ring(from_me, dispatch_to_here, arg);
+    }
+
+    work_t* work = work_get(from_me);
+    if (work == NULL) {
+        return -1;
+    }
 
     work->routine = dispatch_to_here;
     work->arg = arg;
@@ -98,8 +604,8 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
     // If destruction function has begun, don't accept new items to the queue
     if (from_me->dont_accept) {
         pthread_mutex_unlock(&(from_me->qlock));
-        free(work);
-        return;
+        work_put(from_me, work);
+        return -1;
     }
 
     // Add item to the queue
@@ -115,7 +621,122 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
     pthread_cond_signal(&(from_me->q_not_empty));
 
     pthread_mutex_unlock(&(from_me->qlock));
+    return 0;
+}
+
+void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
+
+    if (from_me == NULL || dispatch_to_here == NULL) {
+        return; // Input sanity check
+    }
+    enqueue(from_me, dispatch_to_here, arg);
+}
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static unsigned isqrt(unsigned n) {
+    unsigned r = 0;
+    while ((r + 1) * (r + 1) <= n) {
+        r++;
+    }
+    return r;
 }
+
+/**
+ * CoDel (Nichols and Jacobson) on the queue of bounded jobs, decided
+ * as each is taken: a short burst that drains within an interval costs
+ * nothing, a standing queue loses jobs until the ones that are left
+ * wait less than the target. "queued" is how many are still waiting
+ * behind this one, the last is never dropped.
+ * returns 1 if the job is to be dropped.
+ */
+static int codel_drop(threadpool* tp, long now, long sojourn, int queued) {
+    const long target = TP_CODEL_TARGET_MS * 1000L;
+    const long interval = TP_CODEL_INTERVAL_MS * 1000L;
+    int drop = 0;
+    while (atomic_flag_test_and_set_explicit(&tp->codel_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+    int above = 0;
+    if (sojourn < target || queued == 0) {
+        tp->codel_above_us = 0;
+    } else if (tp->codel_above_us == 0) {
+        tp->codel_above_us = now + interval;
+    } else if (now >= tp->codel_above_us) {
+        above = 1;
+    }
+    if (tp->codel_dropping) {
+        if (!above) {
+            tp->codel_dropping = 0;
+        } else if (now >= tp->codel_next_us) {
+            drop = 1;
+            tp->codel_count++;
+            tp->codel_next_us += interval / isqrt(tp->codel_count);
+        }
+    } else if (above) {
+        drop = 1;
+        tp->codel_dropping = 1;
+        // dropping again soon after it stopped: carry on near the old rate
+        if (tp->codel_count > 2 && now - tp->codel_next_us < 16 * interval) {
+            tp->codel_count -= 2;
+        } else {
+            tp->codel_count = 1;
+        }
+        tp->codel_next_us = now + interval / isqrt(tp->codel_count);
+    }
+    atomic_flag_clear_explicit(&tp->codel_lock, memory_order_release);
+    return drop;
+}
+
+// what a worker runs for a dispatch_bounded job
+static int run_bounded(void* arg) {
+    tp_bounded_job* job = (tp_bounded_job*)arg;
+    threadpool* tp = job->pool;
+    int queued = atomic_fetch_sub(&tp->bounded_queued, 1) - 1;
+    long now = now_us();
+    long sojourn = now - job->enqueued_us;
+    if ((tp->budget_us > 0 && sojourn > tp->budget_us) || codel_drop(tp, now, sojourn, queued)) {
+        atomic_fetch_add(&tp->dropped, 1);
+        return job->dropped(job->arg);
+    }
+    return job->routine(job->arg);
+}
+
+int dispatch_bounded(threadpool* from_me, tp_bounded_job* job) {
+    if (from_me == NULL || job == NULL || job->routine == NULL || job->dropped == NULL) {
+        return -1; // Input sanity check
+    }
+    int queued = atomic_fetch_add(&from_me->bounded_queued, 1);
+    if (from_me->max_queued > 0 && queued >= from_me->max_queued) {
+        atomic_fetch_sub(&from_me->bounded_queued, 1);
+        atomic_fetch_add(&from_me->refused, 1);
+        return -1;
+    }
+    job->pool = from_me;
+    job->enqueued_us = now_us();
+    if (enqueue(from_me, run_bounded, job) != 0) {
+        // the pool is shutting down: no worker will take the job, it is dropped here
+        atomic_fetch_sub(&from_me->bounded_queued, 1);
+        atomic_fetch_add(&from_me->dropped, 1);
+        job->dropped(job->arg);
+    }
+    return 0;
+}
+
+void threadpool_set_admission(threadpool* tp, int max_queued, int budget_ms) {
+    if (max_queued < 0) {
+        max_queued = 0;
+    }
+    if (tp->queue != TP_QUEUE_LOCKED && (max_queued == 0 || max_queued > TP_RING_SIZE)) {
+        max_queued = TP_RING_SIZE;
+    }
+    tp->max_queued = max_queued;
+    tp->budget_us = budget_ms > 0 ? budget_ms * 1000L : 0;
+}
+
 // Thread-local variable to store thread ID
 static pthread_key_t thread_id_key;
 
@@ -135,9 +756,11 @@ void* do_work(void* p) {
             pthread_exit(NULL);
         }
 
-        // If the queue is empty, wait
-        if (tp->qsize == 0) {
+        // If the queue is empty, wait (another thread may take the job first)
+        while (tp->qsize == 0 && !tp->shutdown) {
+            atomic_fetch_add(&tp->sleepers, 1);
             pthread_cond_wait(&(tp->q_not_empty), &(tp->qlock));
+            atomic_fetch_sub(&tp->sleepers, 1);
         }
         // Check again destruction flag after waking up
         if (tp->shutdown) {
@@ -159,9 +782,145 @@ void* do_work(void* p) {
 
         pthread_mutex_unlock(&(tp->qlock));
 
-        // Call the thread routine
-        (*(work->routine))(work->arg);
-        free(work);
+        // Call the thread routine, the record can be reused already
+        int (*routine)(void*) = work->routine;
+        void* arg = work->arg;
+        work_put(tp, work);
+        routine(arg);
+    }
+}
+
+/**
+ * worker of a TP_QUEUE_LOCKFREE or TP_QUEUE_STEALING pool. An idle
+ * worker parks on wake_seq (an eventcount): it reads the count,
+ * announces itself in "sleepers", looks for a job once more and only
+ * then sleeps, so a dispatch either is seen by that last look or
+ * changes the count and makes the futex wait return at once.
+ * A worker that got a job while a wake-up was in flight lets the next
+ * dispatch wake someone again, and passes the wake-up on if more jobs
+ * are queued, so a burst spreads over the idle workers.
+ * In an elastic pool the wait is bounded by idle_timeout_ms, and a
+ * worker that times out retires while the pool is above its minimum.
+ */
+static void worker_loop(threadpool* tp, tp_thread* slot, tp_worker* self) {
+    dispatch_fn routine;
+    void *arg;
+    int elastic = tp->min_threads < tp->num_threads;
+    struct timespec idle_timeout = {tp->idle_timeout_ms / 1000, (tp->idle_timeout_ms % 1000) * 1000000L};
+
+    current_pool = tp;
+
+    while (1) {
+        if (find_job(tp, self, &routine, &arg)) {
+            if (atomic_load_explicit(&tp->waking, memory_order_relaxed)) {
+                atomic_store(&tp->waking, 0);
+            }
+            if (elastic) {
+                // read by maybe_grow, written only when it changes
+                long now = coarse_ms();
+                if (atomic_load_explicit(&tp->last_take_ms, memory_order_relaxed) != now) {
+                    atomic_store_explicit(&tp->last_take_ms, now, memory_order_relaxed);
+                }
+            }
+            if (more_jobs(tp, self)) {
+                wake_one(tp);
+            }
+            routine(arg);
+            continue;
+        }
+        // queued jobs are run before the pool stops
+        if (atomic_load(&tp->stopping)) {
+            return;
+        }
+
+        unsigned key = atomic_load(&tp->wake_seq);
+        atomic_fetch_add(&tp->sleepers, 1);
+        // A wake-up in flight is over once we park: cleared before the
+        // last look, a dispatch that still saw it set queued a job we see
+        if (atomic_load(&tp->waking)) {
+            atomic_store(&tp->waking, 0);
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        int found = find_job(tp, self, &routine, &arg);
+        int timed_out = 0;
+        if (!found && !atomic_load(&tp->stopping)) {
+            timed_out = futex_wait(&tp->wake_seq, key, elastic ? &idle_timeout : NULL) != 0
+                        && errno == ETIMEDOUT;
+        }
+        atomic_fetch_sub(&tp->sleepers, 1);
+        if (found) {
+            routine(arg);
+        } else if (timed_out && try_retire(tp)) {
+            // our deque is empty: we only park after finding nothing in it
+            atomic_store(&slot->state, TP_SLOT_RETIRED);
+            return;
+        }
+    }
+}
+
+static void* do_work_ring(void* p) {
+    tp_thread* slot = (tp_thread*)p;
+    worker_loop(slot->pool, slot, NULL);
+    return NULL;
+}
+
+static void* do_work_stealing(void* p) {
+    tp_thread* slot = (tp_thread*)p;
+    tp_worker* self = &slot->pool->workers[slot->index];
+    current_worker = self;
+    worker_loop(slot->pool, slot, self);
+    return NULL;
+}
+
+static void destroy_ring(threadpool* tp) {
+    // Don't accept new jobs, and let the dispatch calls already past that check finish
+    atomic_store(&tp->closed, 1);
+    while (atomic_load(&tp->dispatching) > 0) {
+        sched_yield();
+    }
+    atomic_store(&tp->stopping, 1);
+    atomic_fetch_add(&tp->wake_seq, 1);
+    futex_wake(&tp->wake_seq, INT_MAX);
+
+    // no dispatch runs anymore, so no worker is being started either
+    for (int i = 0; i < tp->num_threads; i++) {
+        if (atomic_load(&tp->slots[i].state) != TP_SLOT_FREE) {
+            pthread_join(tp->threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&(tp->qlock));
+    pthread_cond_destroy(&(tp->q_not_empty));
+    pthread_cond_destroy(&(tp->q_empty));
+    free(tp->ring);
+    free(tp->workers);
+    free(tp->slots);
+    free(tp->threads);
+    free(tp);
+}
+
+void threadpool_get_stats(threadpool* tp, threadpool_stats* stats) {
+    stats->min_threads = tp->min_threads;
+    stats->max_threads = tp->num_threads;
+    stats->idle = atomic_load(&tp->sleepers);
+    stats->spawned = atomic_load(&tp->spawned);
+    stats->retired = atomic_load(&tp->retired);
+    stats->bounded_queued = atomic_load(&tp->bounded_queued);
+    stats->refused = atomic_load(&tp->refused);
+    stats->dropped = atomic_load(&tp->dropped);
+    if (tp->queue == TP_QUEUE_LOCKED) {
+        stats->threads = tp->num_threads;
+        pthread_mutex_lock(&(tp->qlock));
+        stats->queued = tp->qsize;
+        pthread_mutex_unlock(&(tp->qlock));
+        return;
+    }
+    stats->threads = atomic_load(&tp->live_threads);
+    stats->queued = ring_size(tp);
+    if (tp->workers != NULL) {
+        int used = atomic_load(&tp->slots_used);
+        for (int i = 0; i < used; i++) {
+            stats->queued += deque_size(&tp->workers[i]);
+        }
     }
 }
 
@@ -169,6 +928,10 @@ void destroy_threadpool(threadpool* destroyme) {
     if (destroyme == NULL) {
         return; // Input sanity check
     }
+    if (destroyme->queue != TP_QUEUE_LOCKED) {
+        destroy_ring(destroyme);
+        return;
+    }
 
     pthread_mutex_lock(&(destroyme->qlock));
 
@@ -198,6 +961,8 @@ void destroy_threadpool(threadpool* destroyme) {
     pthread_cond_destroy(&(destroyme->q_not_empty));
     pthread_cond_destroy(&(destroyme->q_empty));
     // Free memory associated with the thread pool
+    free(destroyme->records);
+    free(destroyme->slots);
     free(destroyme->threads);
     free(destroyme);
 }
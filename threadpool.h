@@ -1,4 +1,9 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 #include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 /**
  * threadpool.h
@@ -10,6 +15,35 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// job slots in the lock-free ring (a power of 2)
+#define TP_RING_SIZE 4096
+
+// job slots in each worker's deque in work-stealing mode (a power of 2)
+#define TP_DEQUE_SIZE 1024
+
+// work_t records a TP_QUEUE_LOCKED pool allocates with itself, the
+// jobs queued beyond them are malloc'd
+#define TP_WORK_RECORDS 1024
+
+// an elastic pool starts a worker when no worker is idle and either
+// this many jobs are queued or none was taken for TP_SPAWN_WAIT_MS
+#define TP_SPAWN_DEPTH 8
+#define TP_SPAWN_WAIT_MS 5
+
+// default time a worker above the minimum stays idle before it retires
+#define TP_IDLE_TIMEOUT_MS 10000
+
+// admission of dispatch_bounded jobs by default: how many may wait,
+// and how long one may wait before it is dropped instead of run
+#define TP_ADMIT_DEPTH 1024
+#define TP_ADMIT_BUDGET_MS 1000
+
+// CoDel: once jobs have waited more than TP_CODEL_TARGET_MS for a whole
+// TP_CODEL_INTERVAL_MS, drop them at a rate growing with the square
+// root of the drops, until a job gets through in time again
+#define TP_CODEL_TARGET_MS 5
+#define TP_CODEL_INTERVAL_MS 100
+
 
 /**
  * the pool holds a queue of this structure
@@ -18,14 +52,89 @@ typedef struct work_st{
       int (*routine) (void*);  //the threads process function
       void * arg;  //argument to the function
       struct work_st* next;  
+      atomic_uint free_next;   // next record on the free list, as index + 1
 } work_t;
 
 
+/**
+ * how a pool queues its jobs
+ */
+typedef enum {
+    TP_QUEUE_LOCKFREE,  // bounded MPMC ring, idle workers park on a futex
+    TP_QUEUE_LOCKED,    // linked list of work_t under qlock
+    TP_QUEUE_STEALING   // a deque per worker plus the ring for outside jobs
+} threadpool_queue;
+
+/**
+ * one preallocated job slot of the lock-free ring. "seq" tells
+ * producers and consumers whose turn it is (Vyukov's bounded MPMC
+ * queue).
+ */
+typedef struct tp_slot {
+    atomic_size_t seq;
+    int (*routine) (void*);
+    void * arg;
+} tp_slot;
+
+/**
+ * a job in a worker's deque. Thieves may read a slot while its owner
+ * reuses it (the steal then fails), hence the atomic fields.
+ */
+typedef struct tp_job {
+    _Atomic(int (*) (void*)) routine;
+    _Atomic(void *) arg;
+} tp_job;
+
+/**
+ * a job dispatched with dispatch_bounded, normally embedded in the
+ * object it works on. It must stay put until "routine" or "dropped"
+ * was called.
+ */
+typedef struct tp_bounded_job {
+    int (*routine) (void*);     // runs the job
+    int (*dropped) (void*);     // runs instead when the job waited too long
+    void * arg;
+    long enqueued_us;           // set by dispatch_bounded
+    struct _threadpool_st *pool;
+} tp_bounded_job;
+
+/**
+ * state of a thread slot of the pool
+ */
+typedef enum {
+    TP_SLOT_FREE,       // no thread
+    TP_SLOT_RUNNING,    // a worker runs in it
+    TP_SLOT_RETIRED     // the worker retired, its thread is still to be joined
+} tp_slot_state;
+
+/**
+ * a thread slot, the argument of a TP_QUEUE_LOCKFREE or
+ * TP_QUEUE_STEALING worker
+ */
+typedef struct tp_thread {
+    struct _threadpool_st *pool;
+    int index;                  // in threads[], and workers[] if stealing
+    atomic_int state;           // a tp_slot_state
+} tp_thread;
+
+/**
+ * a worker in work-stealing mode. Its Chase-Lev deque is pushed and
+ * popped at the bottom by the worker only, and stolen from at the top
+ * by the others. Jobs dispatched from inside the worker land here.
+ */
+typedef struct tp_worker {
+    atomic_long top __attribute__((aligned(64)));
+    atomic_long bottom __attribute__((aligned(64)));
+    tp_job jobs[TP_DEQUE_SIZE];
+    struct _threadpool_st *pool;
+    unsigned rng;               // picks steal victims
+} tp_worker;
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
- 	int num_threads;	//number of active threads
+ 	int num_threads;	//number of thread slots, the most threads the pool runs
 	int qsize;	        //number in the queue
 	pthread_t *threads;	//pointer to threads
 	work_t* qhead;		//queue head pointer
@@ -35,8 +144,70 @@ typedef struct _threadpool_st {
 	pthread_cond_t q_empty;
     int shutdown;            //1 if the pool is in distruction process     
     int dont_accept;       //1 if destroy function has begun
+
+    threadpool_queue queue;     // which queue the pool uses
+
+    // TP_QUEUE_LOCKED: the preallocated work_t records and a lock-free
+    // stack of the free ones. The head is a record's index + 1 (0 if
+    // none) with a tag above it that changes on every update, so a pop
+    // that read a stale next record fails its compare-and-swap (ABA)
+    work_t *records;
+    atomic_ullong free_records;
+
+    // TP_QUEUE_LOCKFREE and TP_QUEUE_STEALING, where the ring is the
+    // injection queue for jobs dispatched from outside the pool.
+    // Producer and consumer sides on their own cache lines
+    tp_slot *ring;
+    tp_worker *workers;         // TP_QUEUE_STEALING only
+    tp_thread *slots;           // one per entry of threads[]
+    atomic_size_t enqueue_pos __attribute__((aligned(64)));
+    atomic_size_t dequeue_pos __attribute__((aligned(64)));
+    atomic_uint wake_seq __attribute__((aligned(64))); // futex word idle workers wait on
+    atomic_int sleepers;        // workers parked or about to park
+    atomic_int waking;          // 1 while a woken worker has not taken a job yet
+    atomic_int dispatching;     // dispatch calls in progress
+    atomic_int closed;          // dont_accept for the ring
+    atomic_int stopping;        // shutdown for the ring
+
+    // elastic sizing, TP_QUEUE_LOCKFREE and TP_QUEUE_STEALING only
+    int min_threads;            // equal to num_threads for a fixed-size pool
+    int idle_timeout_ms;
+    atomic_int live_threads;    // workers running
+    atomic_int slots_used;      // highest slot ever started + 1
+    atomic_int spawning;        // 1 while a dispatch is starting a worker
+    atomic_long last_take_ms;   // when a worker last took a job (coarse clock)
+    atomic_ulong spawned;       // workers started after creation
+    atomic_ulong retired;       // workers that retired while idle
+
+    // admission of dispatch_bounded jobs, see threadpool_set_admission
+    int max_queued;             // bounded jobs waiting at most, 0 for no bound
+    long budget_us;             // the longest a bounded job may wait, 0 for no budget
+    atomic_int bounded_queued;  // bounded jobs dispatched and not taken yet
+    atomic_ulong refused;       // dispatch_bounded calls that found the queue full
+    atomic_ulong dropped;       // bounded jobs that waited too long
+    atomic_flag codel_lock;     // protects the CoDel state below
+    long codel_above_us;        // when waits above target will have lasted an interval, 0 if not above
+    long codel_next_us;         // when the next job is dropped while dropping
+    unsigned codel_count;       // jobs dropped since dropping began
+    int codel_dropping;
 } threadpool;
 
+/**
+ * a snapshot of a pool, for monitoring
+ */
+typedef struct threadpool_stats {
+    int threads;                // workers running
+    int min_threads;
+    int max_threads;
+    int idle;                   // workers waiting for a job
+    long queued;                // jobs waiting for a worker
+    unsigned long spawned;      // workers started after creation
+    unsigned long retired;      // workers that retired while idle
+    int bounded_queued;         // dispatch_bounded jobs waiting
+    unsigned long refused;      // dispatch_bounded calls refused, the queue was full
+    unsigned long dropped;      // dispatch_bounded jobs dropped, they waited too long
+} threadpool_stats;
+
 
 // "dispatch_fn" declares a typed function pointer.  A
 // variable of type "dispatch_fn" points to a function
@@ -58,6 +229,29 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_queue is create_threadpool with a choice of
+ * queue. create_threadpool uses TP_QUEUE_LOCKFREE.
+ */
+threadpool* create_threadpool_queue(int num_threads_in_pool, threadpool_queue queue);
+
+/**
+ * create_threadpool_elastic creates a pool that starts "min_threads"
+ * workers and grows up to "max_threads" while jobs queue up (see
+ * TP_SPAWN_DEPTH), then shrinks back as workers above the minimum stay
+ * idle for "idle_timeout_ms". A TP_QUEUE_LOCKED pool does not resize
+ * and runs "max_threads" workers.
+ */
+threadpool* create_threadpool_elastic(int min_threads, int max_threads, int idle_timeout_ms,
+                                      threadpool_queue queue);
+
+/**
+ * threadpool_get_stats fills "stats" with the current size and queue
+ * depth of the pool. The fields are read without stopping the
+ * workers, so they are only consistent with each other roughly.
+ */
+void threadpool_get_stats(threadpool* tp, threadpool_stats* stats);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -68,10 +262,40 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * 2. lock the mutex
  * 3. add the work_t element to the queue
  * 4. unlock mutex
+ * With TP_QUEUE_LOCKFREE nothing is allocated or locked: the job goes
+ * into a ring slot, and a parked worker is woken only if there is one.
+ * If all TP_RING_SIZE slots are taken, dispatch waits for one.
+ * With TP_QUEUE_STEALING a job dispatched by one of the pool's own
+ * workers goes to that worker's deque, where it is run next unless an
+ * idle worker steals it first.
  *
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_bounded dispatches job->routine(job->arg) unless the pool
+ * already has as many bounded jobs waiting as it admits, in which case
+ * it returns -1 and nothing is queued. A job taken by a worker after
+ * waiting longer than the budget, or while CoDel finds the queue
+ * standing (see TP_CODEL_TARGET_MS), gets job->dropped(job->arg)
+ * instead, so the work that is done is work that is still wanted.
+ * A job the pool can't take, because it is being destroyed, gets
+ * job->dropped(job->arg) right away on the calling thread.
+ * Jobs dispatched with dispatch share the queue but are never
+ * refused or dropped. returns 0 if the job was queued or dropped.
+ */
+int dispatch_bounded(threadpool* from_me, tp_bounded_job* job);
+
+/**
+ * threadpool_set_admission sets how many dispatch_bounded jobs may
+ * wait ("max_queued", 0 for no bound) and how long each may wait
+ * ("budget_ms", 0 for no budget). The pool starts with TP_ADMIT_DEPTH
+ * and TP_ADMIT_BUDGET_MS. A ring pool admits at most TP_RING_SIZE, so
+ * that bounded jobs alone never make dispatch_bounded wait for a ring
+ * slot. Call it before dispatching bounded jobs.
+ */
+void threadpool_set_admission(threadpool* tp, int max_queued, int budget_ms);
+
 /**
  * The work function of the thread
  * this function should:
@@ -92,4 +316,4 @@ void* do_work(void* p);
  */
 void destroy_threadpool(threadpool* destroyme);
 
-
+#endif
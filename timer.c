@@ -0,0 +1,98 @@
+#include "timer.h"
+#include <string.h>
+#include <time.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE (1ULL << (TIMER_BITS * TIMER_LEVELS)) // ticks the wheel can look ahead
+
+static uint64_t now_ticks(const timer_wheel *w) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / w->tick_ms;
+}
+
+// links "t" into the slot its expiry falls in, seen from w->now
+static void place(timer_wheel *w, timer *t) {
+    if (t->expires < w->now) {
+        t->expires = w->now;
+    }
+    uint64_t delta = t->expires - w->now;
+    if (delta >= TIMER_RANGE) {
+        delta = TIMER_RANGE - 1;
+        t->expires = w->now + delta;
+    }
+    int level = 0;
+    while (delta >= 1ULL << (TIMER_BITS * (level + 1))) {
+        level++;
+    }
+    timer **slot = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+void timer_wheel_init(timer_wheel *w, int tick_ms) {
+    memset(w, 0, sizeof(*w));
+    w->tick_ms = tick_ms;
+    w->now = now_ticks(w);
+}
+
+void timer_add(timer_wheel *w, timer *t, long timeout_ms) {
+    timer_cancel(t);
+    t->expires = w->now + (timeout_ms + w->tick_ms - 1) / w->tick_ms;
+    place(w, t);
+}
+
+void timer_cancel(timer *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+int timer_pending(const timer *t) {
+    return t->pprev != NULL;
+}
+
+void timer_advance(timer_wheel *w) {
+    uint64_t target = now_ticks(w);
+    while (w->now <= target) {
+        int index = w->now & TIMER_MASK;
+        // level 0 wrapped: the next slot of each level above moves down
+        for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+            int upper = (w->now >> (TIMER_BITS * level)) & TIMER_MASK;
+            timer *list = w->slots[level][upper];
+            w->slots[level][upper] = NULL;
+            while (list != NULL) {
+                timer *t = list;
+                list = t->next;
+                place(w, t);
+            }
+            if (upper != 0) {
+                break;
+            }
+        }
+
+        // the tick counts as run before the callbacks, so timers they
+        // add land in a later slot instead of this one
+        timer *expired = w->slots[0][index];
+        w->slots[0][index] = NULL;
+        if (expired != NULL) {
+            expired->pprev = &expired; // a callback may cancel the ones after it
+        }
+        w->now++;
+        while (expired != NULL) {
+            timer *t = expired;
+            timer_cancel(t); // unlinks it from "expired"
+            t->fn(t->arg);
+        }
+    }
+}
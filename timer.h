@@ -0,0 +1,68 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/**
+ * timer.h
+ *
+ * A hierarchical timer wheel, one per event loop (Varghese & Lauck,
+ * as in the Linux kernel). Level 0 has a slot per tick, every level
+ * above it a slot per TIMER_SLOTS ticks of the level below; a timer
+ * sits in the slot of the coarsest level that still tells when it
+ * expires and moves down a level each time the level below wraps.
+ * Adding and cancelling are O(1), and so is each tick apart from the
+ * timers that expire or move down.
+ *
+ * Timers are embedded in their owner and never allocated. The wheel
+ * is used from its loop's thread only.
+ */
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4 // 2^24 ticks, more than a day at 10ms
+
+typedef struct timer {
+    void (*fn)(void *arg);  // run once when the timer expires
+    void *arg;
+    uint64_t expires;       // tick
+    struct timer *next;
+    struct timer **pprev;   // NULL while not armed
+} timer;
+
+typedef struct timer_wheel {
+    int tick_ms;
+    uint64_t now;           // the next tick to run
+    timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+/**
+ * timer_wheel_init prepares an empty wheel that counts "tick_ms"
+ * milliseconds per tick, starting now.
+ */
+void timer_wheel_init(timer_wheel *w, int tick_ms);
+
+/**
+ * timer_add arms "t" to run t->fn(t->arg) "timeout_ms" from now
+ * (rounded up to whole ticks, capped at the wheel's range). An armed
+ * timer is moved.
+ */
+void timer_add(timer_wheel *w, timer *t, long timeout_ms);
+
+/**
+ * timer_cancel disarms "t", nothing happens if it is not armed.
+ */
+void timer_cancel(timer *t);
+
+/**
+ * timer_pending returns 1 while "t" is armed.
+ */
+int timer_pending(const timer *t);
+
+/**
+ * timer_advance runs every timer that expired by now. Callbacks may
+ * add and cancel timers, their own included.
+ */
+void timer_advance(timer_wheel *w);
+
+#endif
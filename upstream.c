@@ -0,0 +1,234 @@
+#include "upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define UPSTREAM_MAX_NAME 256 // longest host name used as a key
+#define UPSTREAM_BUCKETS 256  // hash buckets per shard
+
+struct idle_conn {
+    int fd;
+    time_t since;               // monotonic seconds
+};
+
+struct upstream_pool {
+    char host[UPSTREAM_MAX_NAME];
+    int port;
+    uint32_t hash;
+    int open;                   // busy and idle connections
+    int num_idle;
+    struct idle_conn idle[UPSTREAM_MAX_IDLE]; // oldest first
+    upstream_waiter *waiters;   // FIFO of requests over the cap
+    upstream_waiter *waiters_tail;
+    struct upstream_shard *shard;
+    struct upstream_pool *next; // hash chain
+};
+
+struct upstream_shard {
+    pthread_mutex_t lock;
+    struct upstream_pool *buckets[UPSTREAM_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct upstream_shard shards[UPSTREAM_SHARDS] = {
+    [0 ... UPSTREAM_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static atomic_long last_sweep;
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t hash_key(const char *s, int port) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= (uint32_t)port;
+    h *= 16777619u;
+    return h;
+}
+
+// a pooled connection the origin closed (or wrote to) is not reusable
+static int still_open(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// closes connections idle for too long, and frees unused pools.
+// called with the shard lock held
+static void sweep_shard(struct upstream_shard *shard, time_t now) {
+    for (int b = 0; b < UPSTREAM_BUCKETS; b++) {
+        struct upstream_pool **link = &shard->buckets[b];
+        while (*link != NULL) {
+            struct upstream_pool *p = *link;
+            int expired = 0;
+            while (expired < p->num_idle && p->idle[expired].since + UPSTREAM_IDLE_SECS <= now) {
+                close(p->idle[expired].fd);
+                expired++;
+            }
+            if (expired > 0) {
+                memmove(p->idle, p->idle + expired, (p->num_idle - expired) * sizeof(struct idle_conn));
+                p->num_idle -= expired;
+                p->open -= expired;
+            }
+            if (p->open == 0 && p->waiters == NULL) {
+                *link = p->next;
+                free(p);
+                continue;
+            }
+            link = &p->next;
+        }
+    }
+}
+
+// at most once a second, whichever thread gets here first sweeps
+static void maybe_sweep(time_t now) {
+    long last = atomic_load(&last_sweep);
+    if (last >= now || !atomic_compare_exchange_strong(&last_sweep, &last, now)) {
+        return;
+    }
+    for (int i = 0; i < UPSTREAM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        sweep_shard(&shards[i], now);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+int upstream_acquire(const char *host, int port, upstream_waiter *w, upstream_pool **pool) {
+    char key[UPSTREAM_MAX_NAME];
+    size_t len = 0;
+    while (host[len] != '\0' && host[len] != ':' && len < sizeof(key) - 1) {
+        key[len] = (char)tolower((unsigned char)host[len]);
+        len++;
+    }
+    key[len] = '\0';
+
+    time_t now = now_secs();
+    maybe_sweep(now);
+
+    uint32_t h = hash_key(key, port);
+    struct upstream_shard *shard = &shards[h % UPSTREAM_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+
+    struct upstream_pool **bucket = &shard->buckets[(h / UPSTREAM_SHARDS) % UPSTREAM_BUCKETS];
+    struct upstream_pool *p = *bucket;
+    while (p != NULL && (p->hash != h || p->port != port || strcmp(p->host, key) != 0)) {
+        p = p->next;
+    }
+    if (p == NULL) {
+        p = (struct upstream_pool *)calloc(1, sizeof(struct upstream_pool));
+        if (p == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            perror("error: malloc");
+            *pool = NULL;
+            return UPSTREAM_NEW; // unpooled connection
+        }
+        strcpy(p->host, key);
+        p->port = port;
+        p->hash = h;
+        p->shard = shard;
+        p->next = *bucket;
+        *bucket = p;
+    }
+    *pool = p;
+
+    // most recently used first, it is the least likely to have timed out
+    while (p->num_idle > 0) {
+        struct idle_conn ic = p->idle[--p->num_idle];
+        if (ic.since + UPSTREAM_IDLE_SECS > now && still_open(ic.fd)) {
+            pthread_mutex_unlock(&shard->lock);
+            return ic.fd;
+        }
+        close(ic.fd);
+        p->open--;
+    }
+
+    if (p->open < UPSTREAM_MAX_PER_HOST) {
+        p->open++;
+        pthread_mutex_unlock(&shard->lock);
+        return UPSTREAM_NEW;
+    }
+
+    w->next = NULL;
+    if (p->waiters == NULL) {
+        p->waiters = w;
+    } else {
+        p->waiters_tail->next = w;
+    }
+    p->waiters_tail = w;
+    pthread_mutex_unlock(&shard->lock);
+    return UPSTREAM_WAIT;
+}
+
+void upstream_release(upstream_pool *p, int fd, int reusable) {
+    if (p == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (fd < 0) {
+        reusable = 0;
+    }
+
+    struct upstream_shard *shard = p->shard;
+    pthread_mutex_lock(&shard->lock);
+
+    upstream_waiter *w = p->waiters;
+    if (w != NULL) {
+        // the slot (and the connection, if it is reusable) moves to the next waiter
+        p->waiters = w->next;
+        pthread_mutex_unlock(&shard->lock);
+        if (!reusable && fd >= 0) {
+            close(fd);
+        }
+        w->fd = reusable ? fd : UPSTREAM_NEW;
+        w->ready(w);
+        return;
+    }
+
+    if (reusable && p->num_idle < UPSTREAM_MAX_IDLE) {
+        p->idle[p->num_idle].fd = fd;
+        p->idle[p->num_idle].since = now_secs();
+        p->num_idle++;
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    p->open--;
+    pthread_mutex_unlock(&shard->lock);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void upstream_shutdown(void) {
+    for (int i = 0; i < UPSTREAM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        for (int b = 0; b < UPSTREAM_BUCKETS; b++) {
+            struct upstream_pool *p = shards[i].buckets[b];
+            while (p != NULL) {
+                struct upstream_pool *next = p->next;
+                for (int k = 0; k < p->num_idle; k++) {
+                    close(p->idle[k].fd);
+                }
+                free(p);
+                p = next;
+            }
+            shards[i].buckets[b] = NULL;
+        }
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+/**
+ * upstream.h
+ *
+ * Pool of persistent origin connections, one pool per (host, port).
+ * A pool keeps at most UPSTREAM_MAX_IDLE idle connections, closes
+ * the ones idle for more than UPSTREAM_IDLE_SECS, and caps the
+ * connections open to one origin (busy and idle) at
+ * UPSTREAM_MAX_PER_HOST; requests over the cap wait for a slot.
+ */
+
+#define UPSTREAM_MAX_IDLE 16      // idle connections kept per origin
+#define UPSTREAM_IDLE_SECS 30     // idle connections older than this are closed
+#define UPSTREAM_MAX_PER_HOST 256 // connections open to one origin
+#define UPSTREAM_SHARDS 16        // pool table shards, each with its own lock
+
+// upstream_acquire results besides a reusable fd
+#define UPSTREAM_NEW -1           // a slot was reserved, open a new connection
+#define UPSTREAM_WAIT -2          // the origin is at its cap, wait for "ready"
+
+typedef struct upstream_pool upstream_pool;
+
+/**
+ * a request waiting for a slot. "ready" is called on the thread that
+ * freed the slot with fd set to an idle connection, or to UPSTREAM_NEW.
+ */
+typedef struct upstream_waiter {
+    void (*ready)(struct upstream_waiter *w);
+    void *arg;
+    int fd;
+    struct upstream_waiter *next;
+} upstream_waiter;
+
+/**
+ * upstream_acquire takes a slot in the pool of ("host", "port"), a
+ * ":port" suffix of "host" is ignored. *pool is set in every case
+ * and must be passed back to upstream_release.
+ * returns an idle connected fd, UPSTREAM_NEW or UPSTREAM_WAIT.
+ */
+int upstream_acquire(const char *host, int port, upstream_waiter *w, upstream_pool **pool);
+
+/**
+ * upstream_release gives the slot back. If "reusable" the connection
+ * is kept idle (or handed to a waiter), otherwise "fd" is closed.
+ * "fd" may be -1 if the connection was never opened.
+ */
+void upstream_release(upstream_pool *pool, int fd, int reusable);
+
+/**
+ * upstream_shutdown closes every idle connection and frees the pools.
+ */
+void upstream_shutdown(void);
+
+#endif
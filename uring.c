@@ -0,0 +1,209 @@
+#include "uring.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                     void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_supported(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_setup(4, &p);
+    if (fd < 0) {
+        return 0; // not built in, or forbidden (seccomp, io_uring_disabled)
+    }
+    int ok = (p.features & IORING_FEAT_EXT_ARG) && (p.features & IORING_FEAT_NODROP);
+
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+    if (probe == NULL || sys_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        ok = 0;
+    } else {
+        // IORING_OP_SOCKET came with multishot accept (5.19), which has no probe of its own
+        static const int needed[] = {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+                                     IORING_OP_ACCEPT, IORING_OP_SOCKET};
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    free(probe);
+    close(fd);
+    return ok;
+}
+
+int uring_init(uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // completions are only ever reaped in io_uring_enter, no need to interrupt the loop for them
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd < 0) {
+        return -1;
+    }
+    u->enter_fd = u->fd;
+    u->features = p.features;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = 0;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+    if (u->cq_ring_size > 0) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = (char *)u->sq_ring;
+    char *cq = (char *)u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    // entry i always goes in slot i, the indirection array is never changed again
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_exit(u);
+    return -1;
+}
+
+// hands the filled entries to the kernel, returns how many it has not consumed yet
+static unsigned publish(uring *u) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    return u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * registered ring fds belong to the thread that registered them (and
+ * go away with it), so the ring is registered by the thread that waits
+ * on it, the first time it does. Without it every io_uring_enter looks
+ * the fd up.
+ */
+static void register_ring(uring *u) {
+    struct io_uring_rsrc_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = -1U; // any free index
+    update.data = u->fd;
+    if (sys_register(u->fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+        u->enter_fd = update.offset;
+        u->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *u) {
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        unsigned pending = publish(u);
+        if (sys_enter(u->enter_fd, pending, 0, u->enter_flags, NULL, 0) < 0
+            || u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring *u, int timeout_ms) {
+    if (!u->waited) {
+        u->waited = 1;
+        register_ring(u);
+    }
+    unsigned pending = publish(u);
+    unsigned flags = u->enter_flags | IORING_ENTER_GETEVENTS;
+    if (timeout_ms < 0) {
+        return sys_enter(u->enter_fd, pending, 1, flags, NULL, 0) < 0 ? -1 : 0;
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+    return sys_enter(u->enter_fd, pending, timeout_ms > 0 ? 1 : 0, flags | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg)) < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek(uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_seen(uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_exit(uring *u) {
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
@@ -0,0 +1,83 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/**
+ * uring.h
+ *
+ * The little of io_uring the reactor needs, on the raw system calls:
+ * set a ring up, fill submission entries, submit them while waiting
+ * for completions, and walk the completions. A ring belongs to one
+ * thread.
+ */
+
+typedef struct uring {
+    int fd;
+    int enter_fd;               // fd, or its index once the ring fd is registered
+    unsigned enter_flags;       // IORING_ENTER_REGISTERED_RING if it is
+    unsigned features;          // IORING_FEAT_*
+    int waited;                 // the waiting thread registered the ring fd, or tried to
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // entries filled but not yet published to the kernel
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;              // same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+/**
+ * uring_supported returns 1 if the kernel has everything the reactor
+ * uses: multishot poll and accept, and waiting with a timeout.
+ */
+int uring_supported(void);
+
+/**
+ * uring_init sets up a ring of "entries" submission entries (twice as
+ * many completions) and registers its fd when the kernel can.
+ * returns 0 on success, -1 with errno set on failure.
+ */
+int uring_init(uring *u, unsigned entries);
+
+/**
+ * uring_get_sqe returns a zeroed submission entry, submitting what is
+ * queued first if the ring is full. returns NULL if that failed too.
+ */
+struct io_uring_sqe *uring_get_sqe(uring *u);
+
+/**
+ * uring_submit_and_wait submits the queued entries and waits until a
+ * completion is there or "timeout_ms" passed (-1 waits, 0 does not).
+ * returns 0, or -1 with errno set (ETIME and EINTR are no failures).
+ */
+int uring_submit_and_wait(uring *u, int timeout_ms);
+
+/**
+ * uring_peek returns the oldest completion not yet marked seen, NULL if none.
+ */
+struct io_uring_cqe *uring_peek(uring *u);
+
+/**
+ * uring_seen hands the completion uring_peek returned back to the kernel.
+ */
+void uring_seen(uring *u);
+
+/**
+ * uring_exit unmaps and closes the ring.
+ */
+void uring_exit(uring *u);
+
+#endif